@@ -97,6 +97,7 @@ check_function_exists (ftello           HAVE_FTELLO)
 check_function_exists (getopt           HAVE_GETOPT)
 check_function_exists (getpwuid         HAVE_GETPWUID)
 check_function_exists (llabs            HAVE_LLABS)
+check_function_exists (mmap             HAVE_MMAP)
 check_function_exists (pclose           HAVE_PCLOSE)
 check_function_exists (popen            HAVE_POPEN)
 check_function_exists (qsort_r          HAVE_QSORT_R)
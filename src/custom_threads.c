@@ -0,0 +1,162 @@
+/*--------------------------------------------------------------------
+ *
+ *	Copyright (c) 1991-2020 by the GMT Team (https://www.generic-mapping-tools.org/team.html)
+ *	See LICENSE.TXT file for copying and redistribution conditions.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU Lesser General Public License as published by
+ *	the Free Software Foundation; version 3 or any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU Lesser General Public License for more details.
+ *
+ *	Contact info: www.generic-mapping-tools.org
+ *--------------------------------------------------------------------*/
+/*
+ * Version:	6 API
+ *
+ * Brief synopsis: A minimal fork/join worker pool built on POSIX threads.
+ * Workers repeatedly grab the next chunk of items until none are left, so
+ * uneven work per item (e.g., blocks with very different numbers of points)
+ * is balanced automatically.  If the workers cannot be set up the items are
+ * simply processed in the calling thread.
+ */
+
+#include "gmt.h"
+#include "custom_version.h"
+#include "custom_threads.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include <time.h>
+
+#define CUSTOM_MAX_THREADS	1024	/* Sanity limit on the number of workers */
+
+unsigned int custom_n_cores (void) {
+	/* Return the number of online processors */
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo (&info);
+	return ((info.dwNumberOfProcessors > 0) ? (unsigned int)info.dwNumberOfProcessors : 1U);
+#elif defined (_SC_NPROCESSORS_ONLN)
+	long n = sysconf (_SC_NPROCESSORS_ONLN);
+	return ((n > 0) ? (unsigned int)n : 1U);
+#else
+	return (1U);
+#endif
+}
+
+double custom_wall_time (void) {
+	/* Return seconds since some arbitrary start; only differences between two calls are meaningful */
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency (&freq);
+	QueryPerformanceCounter (&count);
+	return ((double)count.QuadPart / (double)freq.QuadPart);
+#elif defined (CLOCK_MONOTONIC)
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return ((double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec);
+#else
+	return ((double)clock () / CLOCKS_PER_SEC);	/* Processor time is the best we can do */
+#endif
+}
+
+unsigned int custom_get_n_threads (const char *arg) {
+	/* Decode -x[[-]<n>]: No argument means all cores, <n> means n cores,
+	 * and -<n> means all but n cores.  We always return at least one */
+	int n, n_cores = (int)custom_n_cores ();
+
+	if (!arg || !arg[0]) return ((unsigned int)n_cores);
+	n = atoi (arg);
+	if (n < 0) n += n_cores;
+	if (n < 1) n = 1;
+	if (n > CUSTOM_MAX_THREADS) n = CUSTOM_MAX_THREADS;
+	return ((unsigned int)n);
+}
+
+#ifdef HAVE_PTHREAD
+struct CUSTOM_JOB {	/* Shared by all workers in a custom_parallel_for call */
+	custom_thread_func func;	/* What to do with each chunk */
+	void *arg;			/* Passed on to func */
+	uint64_t n, chunk;		/* Number of items and items per chunk */
+	uint64_t next;			/* First item not yet handed out */
+	pthread_mutex_t lock;		/* Protects next */
+};
+
+struct CUSTOM_WORKER {	/* One per thread */
+	struct CUSTOM_JOB *job;
+	unsigned int id;
+};
+
+static void *worker (void *arg) {
+	/* Keep processing the next available chunk until all items are done */
+	struct CUSTOM_WORKER *W = arg;
+	struct CUSTOM_JOB *J = W->job;
+	uint64_t start, end;
+
+	while (1) {
+		pthread_mutex_lock (&J->lock);
+		start = J->next;
+		end = (J->n - start > J->chunk) ? start + J->chunk : J->n;
+		J->next = end;
+		pthread_mutex_unlock (&J->lock);
+		if (start == end) break;	/* Nothing left */
+		J->func (J->arg, start, end, W->id);
+	}
+	return (NULL);
+}
+#endif
+
+int custom_parallel_for (unsigned int n_threads, uint64_t n, uint64_t chunk, custom_thread_func func, void *arg) {
+	/* Process items [0, n) with n_threads workers.  The calling thread acts as worker 0,
+	 * so func will be called with thread_id in 0 to n_threads-1 */
+#ifdef HAVE_PTHREAD
+	unsigned int t, n_started;
+	struct CUSTOM_JOB job;
+	struct CUSTOM_WORKER *W = NULL;
+	pthread_t *thread = NULL;
+#endif
+
+	if (n == 0) return (GMT_NOERROR);
+	if (chunk == 0) chunk = 1;
+#ifdef HAVE_PTHREAD
+	if (n_threads > 1 && n > chunk) {	/* Worth starting some threads */
+		if ((n + chunk - 1) / chunk < n_threads) n_threads = (unsigned int)((n + chunk - 1) / chunk);	/* No more workers than chunks */
+		W = calloc (n_threads, sizeof (struct CUSTOM_WORKER));
+		thread = calloc (n_threads, sizeof (pthread_t));
+		if (W == NULL || thread == NULL) {	/* Cannot afford the threads; do it all ourselves below */
+			free (W);	free (thread);
+			n_threads = 1;
+		}
+	}
+	if (n_threads > 1 && n > chunk) {
+		job.func = func;	job.arg = arg;
+		job.n = n;	job.chunk = chunk;	job.next = 0;
+		pthread_mutex_init (&job.lock, NULL);
+		for (t = 0; t < n_threads; t++) {
+			W[t].job = &job;
+			W[t].id = t;
+		}
+		for (t = n_started = 1; t < n_threads; t++) {	/* Start the helpers; we are worker 0 */
+			if (pthread_create (&thread[t], NULL, worker, &W[t])) break;	/* Could not start it; the others will take up the slack */
+			n_started++;
+		}
+		worker (&W[0]);
+		for (t = 1; t < n_started; t++) pthread_join (thread[t], NULL);
+		pthread_mutex_destroy (&job.lock);
+		free (W);
+		free (thread);
+		return (GMT_NOERROR);
+	}
+#endif
+	func (arg, 0, n, 0);	/* Do it all ourselves */
+	return (GMT_NOERROR);
+}
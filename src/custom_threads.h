@@ -0,0 +1,53 @@
+/*--------------------------------------------------------------------
+ *
+ *	Copyright (c) 1991-2020 by the GMT Team (https://www.generic-mapping-tools.org/team.html)
+ *	See LICENSE.TXT file for copying and redistribution conditions.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU Lesser General Public License as published by
+ *	the Free Software Foundation; version 3 or any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU Lesser General Public License for more details.
+ *
+ *	Contact info: www.generic-mapping-tools.org
+ *--------------------------------------------------------------------*/
+/*
+ * custom_threads.h declares the small worker pool shared by the custom
+ * modules.  Modules split their work into a range of items [0, n) and
+ * custom_parallel_for hands out chunks of that range to the workers.
+ * Without POSIX threads, or if the workers cannot be set up, everything
+ * simply runs in the calling thread.
+ */
+
+#pragma once
+#ifndef CUSTOM_THREADS_H
+#define CUSTOM_THREADS_H
+
+#ifdef __cplusplus /* Basic C++ support */
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define CUSTOM_x_OPT	"-x[[-]<n>]"	/* Synopsis for the -x option of the custom modules */
+
+/* Function that processes the items [start, end) using the scratch space of worker thread_id */
+typedef void (*custom_thread_func) (void *arg, uint64_t start, uint64_t end, unsigned int thread_id);
+
+/* Return the number of available cores */
+EXTERN_MSC unsigned int custom_n_cores (void);
+/* Return the number of threads requested via -x[[-]<n>] */
+EXTERN_MSC unsigned int custom_get_n_threads (const char *arg);
+/* Run func on all items [0, n) in chunks of (at most) chunk items using n_threads workers */
+EXTERN_MSC int custom_parallel_for (unsigned int n_threads, uint64_t n, uint64_t chunk, custom_thread_func func, void *arg);
+/* Return the wall-clock time in seconds since some arbitrary start, for timing the stages of a module */
+EXTERN_MSC double custom_wall_time (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !CUSTOM_THREADS_H */
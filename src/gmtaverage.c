@@ -17,7 +17,9 @@
  *--------------------------------------------------------------------*/
 /*
  * Program to demonstrate use of GMT API to call one of the three spatial
- * data averageing modules GMT_blockmean|median|mode.
+ * data averageing modules GMT_blockmean|median|mode.  When several values
+ * are requested per block (e.g., -Tm,e,n) we instead bin the data ourselves
+ * so that the input only needs to be read once.
  *
  * Author:	Paul Wessel
  * Date:	5-MAY-2016
@@ -26,7 +28,8 @@
  * Brief synopsis: reads records of x, y, data, [weight] and writes out one (or no)
  * value per cell, where cellular region is bounded by West East South North
  * and cell dimensions are delta_x, delta_y.  Choose value from mean, median, mode,
- * number of points, datasum, weightsum, or a specified quantile q.
+ * number of points, datasum, weightsum, or a specified quantile q, or any
+ * combination of these.
  */
 
 #include "gmt_dev.h"		/* Must include this to use GMT DEV API */
@@ -40,19 +43,89 @@
 #define THIS_MODULE_OPTIONS			"-:>RVabdefghior" "H"	/* The H is for possible compatibility with GMT4 syntax */
 
 #include "custom_version.h"	/* Must include this to use Custom_version */
+#include "custom_threads.h"	/* For our worker pool */
+#ifdef HAVE_MMAP
+#include <sys/mman.h>	/* For mapping binary input files */
+#include <sys/stat.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AVG_AVX2	/* Compilers that can build an AVX2 kernel and check for it at run time */
+#include <immintrin.h>
+#endif
+
+#define N_OPS_MAX	8	/* Max number of operators that may be given via -T */
 
 EXTERN_MSC int GMT_gmtaverage (void *API, int mode, void *args);
 
+enum enum_op {OP_MEAN = 0,	/* -Tm */
+	OP_MEDIAN,			/* -Te */
+	OP_COUNT,			/* -Tn */
+	OP_MODE,			/* -To */
+	OP_SUM,				/* -Ts */
+	OP_WSUM,			/* -Tw */
+	OP_QUANTILE};			/* -T<q> */
+
+enum enum_mode {MODE_AVE = 0,	/* -D+a: Report the average of several histogram modes */
+	MODE_LOW,			/* -D+l: Report the lowest mode */
+	MODE_HIGH};			/* -D+h: Report the highest mode */
+
 struct GMTAVERAGE_CTRL {	/* All local control options for this program (except common args) */
+	struct A {	/* -A[<error>] */
+		unsigned int active;
+		double error;		/* Max fraction of the block weight held by one centroid */
+	} A;
+	struct C {	/* -C */
+		unsigned int active;
+	} C;
+	struct D {	/* -D[<width>][+c][+a|l|h] */
+		unsigned int active;
+		unsigned int center;	/* 1 if bin centers are multiples of width */
+		unsigned int choice;	/* What to report if there are several modes */
+		double width;		/* Histogram bin width */
+	} D;
 	struct E {	/* -E[b] */
 		unsigned int active;
 		unsigned int mode;
 	} E;
-	struct T {	/* -T<quantile> */
+	struct G {	/* -G<partial> */
+		unsigned int active;
+		char *file;
+	} G;
+	struct I {	/* -I<xinc>[/<yinc>] */
+		unsigned int active;
+		unsigned int native;	/* 1 if we understood the increments and can bin with them */
+		double inc[2];
+	} I;
+	struct M {	/* -M<budget> */
+		unsigned int active;
+		uint64_t budget;	/* Memory budget in bytes */
+	} M;
+	struct N {	/* -N */
+		unsigned int active;
+	} N;
+	struct Q {	/* -Q */
+		unsigned int active;
+	} Q;
+	struct S {	/* -S<statefile> */
+		unsigned int active;
+		char *file;
+	} S;
+	struct T {	/* -T<op>[,<op>,...] */
 		unsigned int active;
 		unsigned int median;
+		unsigned int n_ops;
+		unsigned int op[N_OPS_MAX];
 		double quantile;
+		double q[N_OPS_MAX];	/* Quantile for each median or quantile operator */
 	} T;
+	struct W {	/* -W[i][o] */
+		unsigned int active;
+		unsigned int weighted[2];
+	} W;
+	struct x {	/* -x[[-]<n>] */
+		unsigned int active;
+		unsigned int n_threads;
+	} x;
 };
 
 static void * New_Ctrl () {	/* Allocate and initialize a new control structure */
@@ -61,19 +134,23 @@ static void * New_Ctrl () {	/* Allocate and initialize a new control structure *
 	C = calloc (1, sizeof (struct GMTAVERAGE_CTRL));
 	
 	/* Initialize values whose defaults are not 0/false/NULL */
+	C->A.error = 0.01;
+	C->D.width = 1.0;
 	return (C);
 }
 
 static void Free_Ctrl (struct GMTAVERAGE_CTRL *C) {	/* Deallocate control structure */
+	if (C->G.file) free (C->G.file);
+	if (C->S.file) free (C->S.file);
 	free ((void *)C);	
 }
 
 static int usage (void *API, int level) {
 	const char *name = gmt_show_name_and_purpose (API, THIS_MODULE_LIB, THIS_MODULE_CLASSIC_NAME, THIS_MODULE_PURPOSE);
 	if (level == GMT_MODULE_PURPOSE) return (GMT_NOERROR);
-	GMT_Message (API, GMT_TIME_NONE, "usage: %s [<table>] %s -Te|m|n|o|s|w|<q>\n", name, GMT_I_OPT);
-	GMT_Message (API, GMT_TIME_NONE, "\t%s [-C] [-E[b]] [-Q] [%s] [-W[i][o]]\n\t[%s] [%s] [%s]\n\t[%s] [%s] [%s]\n\t[%s]\n\t[%s] [%s] [%s]\n\n",
-		GMT_R2_OPT, GMT_V_OPT, GMT_a_OPT, GMT_b_OPT, GMT_d_OPT, GMT_e_OPT, GMT_f_OPT, GMT_h_OPT, GMT_i_OPT, GMT_o_OPT, GMT_r_OPT, GMT_colon_OPT);
+	GMT_Message (API, GMT_TIME_NONE, "usage: %s [<table>] %s -Te|m|n|o|s|w|<q>[,...]\n", name, GMT_I_OPT);
+	GMT_Message (API, GMT_TIME_NONE, "\t%s [-A[<error>]] [-C] [-D[<width>][+c][+a|l|h]] [-E[b]] [-G<partial>] [-M<budget>] [-N] [-Q] [-S<statefile>] [%s] [-W[i][o]]\n\t[%s] [%s] [%s]\n\t[%s] [%s] [%s]\n\t[%s]\n\t[%s] [%s] [%s] [%s]\n\n",
+		GMT_R2_OPT, GMT_V_OPT, GMT_a_OPT, GMT_b_OPT, GMT_d_OPT, GMT_e_OPT, GMT_f_OPT, GMT_h_OPT, GMT_i_OPT, GMT_o_OPT, GMT_r_OPT, CUSTOM_x_OPT, GMT_colon_OPT);
 
 	if (level == GMT_SYNOPSIS) return (GMT_MODULE_SYNOPSIS);
 
@@ -86,16 +163,37 @@ static int usage (void *API, int level) {
 	GMT_Message (API, GMT_TIME_NONE, "\t   s reports data sums.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t   w reports weight sums.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t   <q> reports the chosen quantile (0 < q < 1).\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   Give a comma-separated list (e.g., -Tm,e,n,o) to report several values per block\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   from a single pass over the data.  Output is then (x,y,<values>[,w]), where x,y\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   is the center of the block (i.e., -C is implied) and -E is not allowed.\n");
 	GMT_Option (API, "R");
 	GMT_Message (API, GMT_TIME_NONE, "\n\tOPTIONS:\n");
 	GMT_Option (API, "<");
+	GMT_Message (API, GMT_TIME_NONE, "\t-A For -Te|<q>: Approximate the quantiles with a fixed-size sketch per block so memory no\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   longer grows with the number of points.  Append the max rank error (0-1) [0.01].\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   Blocks with few points are still exact.  -C is implied, -Q is ignored, and -E needs -Eb.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-C Output center of block as location [Default is mean|median|mode of x and y, but see -Q].\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-D For -To: Estimate the mode as the peak of a histogram of z with bins of the given\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   <width> [1].  Append +c to center bins on multiples of <width> [bins start there].\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   If there are several peaks we report their average [+a]; append +l or +h to report\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   the lowest or highest instead [Default estimates the mode from the sorted values].\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-E Extend output with scale (s), low (l), and high (h) value per block, i.e.,\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t   output (x,y,z,s,l,h[,w]) [Default outputs (x,y,z[,w])]; see -W regarding w.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t   Here, scale is standard deviation, L1 scale, or LMS scale depending on -T.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t   For -Te|<q>: Use -Eb for box-and-whisker output (x,y,z,l,25%%q,75%%q,h[,w])\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-G Write the block sums [and -A sketches] to the binary file <partial> instead of writing\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   a table.  Partials from several runs may later be combined with -N.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-M Limit the memory used to hold points for -Te|o|<q> to <budget> bytes; append k, M, or G\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   for kilo-, mega-, or gigabytes.  If the input does not fit we sort the points into\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   temporary files for bands of blocks and process one band at the time.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   A single -To requires -D since blockmode is called otherwise.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-N Merge mode: The input files are partials written by -G, made with the same -R -I -r -A.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-Q Quicker; get median|mode z and x, y at that z [Default gets median|mode of x, y, and z.].\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t   This option is ignored for -Tm|n|s|w.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-S Keep the block sums [and -A sketches] in <statefile> between runs.  If it exists we\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   first load it, so the output covers the earlier data as well as the new input, and\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   then save the updated state.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   -G, -N, and -S are not available for -To, and -Te|<q> require -A.\n");
 	GMT_Option (API, "V");
 	GMT_Message (API, GMT_TIME_NONE, "\t-W Set Weight options.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t   -Wi reads Weighted Input (4 cols: x,y,z,w) but skips w on output.\n");
@@ -103,11 +201,95 @@ static int usage (void *API, int level) {
 	GMT_Message (API, GMT_TIME_NONE, "\t   -W with no modifier has both weighted Input and Output; Default is no weights used.\n");
 	GMT_Option (API, "a,bi");
 	GMT_Message (API, GMT_TIME_NONE, "\t   Default is 3 columns (or 4 if -W is set).\n");
-	GMT_Option (API, "bo,d,e,f,h,i,o,r,:,.");
+	GMT_Option (API, "bo,d,e,f,h,i,o,r");
+	GMT_Message (API, GMT_TIME_NONE, "\t-x Use <n> threads to compute the values of the blocks [1].  Give no <n> to use all\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   cores, or -<n> to use all but <n> cores.  This matters most for -Te|o|<q>.\n");
+	GMT_Option (API, ":,.");
 	
 	return (GMT_MODULE_USAGE);
 }
 
+static unsigned int get_budget (void *API, char *arg, uint64_t *budget) {
+	/* Convert <size>[k|M|G] to bytes.  Return 1 if there is something wrong with it */
+	char *end = NULL;
+	double size = strtod (arg, &end);
+
+	switch (*end) {
+		case 'k': case 'K': size *= 1024.0; end++; break;
+		case 'm': case 'M': size *= 1024.0 * 1024.0; end++; break;
+		case 'g': case 'G': size *= 1024.0 * 1024.0 * 1024.0; end++; break;
+	}
+	if (end == arg || *end || size < 1.0) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -M: Must give a positive memory budget, optionally followed by k, M, or G\n");
+		return (1);
+	}
+	*budget = (uint64_t)size;
+	return (0);
+}
+
+static unsigned int get_histogram (void *API, char *arg, struct GMTAVERAGE_CTRL *Ctrl) {
+	/* Decode -D[<width>][+c][+a|l|h].  Return 1 if there is something wrong with it */
+	unsigned int n_errors = 0, pos = 0;
+	char *c = NULL, p[GMT_LEN64] = {""};
+
+	if ((c = strchr (arg, '+'))) {	/* Process the modifiers */
+		while (gmt_strtok (c, "+", &pos, p)) {
+			switch (p[0]) {
+				case 'c': Ctrl->D.center = 1;		break;
+				case 'a': Ctrl->D.choice = MODE_AVE;	break;
+				case 'l': Ctrl->D.choice = MODE_LOW;	break;
+				case 'h': Ctrl->D.choice = MODE_HIGH;	break;
+				default:
+					GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -D: Bad modifier +%s\n", p);
+					n_errors++;
+					break;
+			}
+		}
+		c[0] = '\0';	/* Chop off the modifiers */
+	}
+	if (arg[0]) Ctrl->D.width = atof (arg);
+	if (c) c[0] = '+';	/* Restore the modifiers */
+	if (Ctrl->D.width <= 0.0) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -D: Bin width must be positive\n");
+		n_errors++;
+	}
+	return (n_errors);
+}
+
+static unsigned int get_inc (char *arg, double inc[]) {
+	/* Decode -I<xinc>[d|m|s][/<yinc>[d|m|s]] into degrees (or plain units).  Return 1 if we got it, or 0 if it
+	 * uses distance units or modifiers that only the GMT_block* modules know about */
+	unsigned int k;
+	char *c = arg;
+
+	for (k = 0; k < 2; k++) {
+		inc[k] = strtod (c, &c);
+		switch (*c) {
+			case 'd': c++; break;
+			case 'm': inc[k] /= 60.0;   c++; break;
+			case 's': inc[k] /= 3600.0; c++; break;
+		}
+		if (inc[k] <= 0.0) return (0);
+		if (k == 0 && *c == '/') c++;
+		else if (k == 0 && *c == '\0') {	/* Same increment in y */
+			inc[1] = inc[0];
+			return (1);
+		}
+		else break;
+	}
+	return (*c == '\0' && k == 1);
+}
+
+static unsigned int is_order_op (unsigned int op) {
+	/* Return 1 if this operator needs all the points in a block rather than just sums */
+	return (op == OP_MEDIAN || op == OP_QUANTILE || op == OP_MODE);
+}
+
+static unsigned int needs_native (struct GMTAVERAGE_CTRL *Ctrl) {
+	/* Return 1 if the options ask for something only the native binning engine can do */
+	return (Ctrl->T.n_ops > 1 || Ctrl->A.active || Ctrl->D.active || Ctrl->M.active || Ctrl->G.active || Ctrl->N.active || Ctrl->S.active || Ctrl->x.active);
+}
+
 static int parse (void *API, struct GMTAVERAGE_CTRL *Ctrl, struct GMT_OPTION *options) {
 	/* Parses the command line options provided to gmtaverage and sets parameters in CTRL.
 	 * Any GMT common options will override values set previously by other commands.
@@ -115,7 +297,8 @@ static int parse (void *API, struct GMTAVERAGE_CTRL *Ctrl, struct GMT_OPTION *op
 	 * returned when registering these sources/destinations with the API.
 	 */
 
-	unsigned int n_errors = 0;
+	unsigned int n_errors = 0, pos = 0, k;
+	char p[GMT_LEN64] = {""};
 	struct GMT_OPTION *opt = NULL;
 
 	for (opt = options; opt; opt = opt->next) {
@@ -125,42 +308,115 @@ static int parse (void *API, struct GMTAVERAGE_CTRL *Ctrl, struct GMT_OPTION *op
 			/* Skip options that will be handled by the GMT_block* functions later */
 
 			case '<':	/* Skip input files */
-			case 'C':	/* Report center of block instead */
 			case 'F':	/* Select pixel registration [gridline] */
+				break;
+
+			/* Options we must know about in case we do the binning ourselves */
+
 			case 'I':	/* Get block dimensions */
+				Ctrl->I.active = 1;
+				Ctrl->I.native = get_inc (opt->arg, Ctrl->I.inc);
+				break;
+			case 'A':	/* Approximate quantiles */
+				Ctrl->A.active = 1;
+				if (opt->arg[0]) Ctrl->A.error = atof (opt->arg);
+				if (Ctrl->A.error <= 0.0 || Ctrl->A.error >= 1.0) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -A: Rank error must be in 0-1 range\n");
+				break;
+			case 'C':	/* Report center of block instead */
+				Ctrl->C.active = 1;
+				break;
 			case 'Q':	/* Quick mode for median|mode z */
+				Ctrl->Q.active = 1;
+				break;
+			case 'S':	/* Persistent state */
+				Ctrl->S.active = 1;
+				if (opt->arg[0]) Ctrl->S.file = strdup (opt->arg);
+				else n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -S: Must give the name of a state file\n");
+				break;
 			case 'W':	/* Use in|out weights */
+				Ctrl->W.active = 1;
+				switch (opt->arg[0]) {
+					case '\0':
+						Ctrl->W.weighted[GMT_IN] = Ctrl->W.weighted[GMT_OUT] = 1; break;
+					case 'i': case 'I':
+						Ctrl->W.weighted[GMT_IN] = 1; break;
+					case 'o': case 'O':
+						Ctrl->W.weighted[GMT_OUT] = 1; break;
+					default:
+						GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: Bad modifier in -W option\n");
+						n_errors++;
+						break;
+				}
 				break;
-				
+
 			/* Processes gmtaverage-specific parameters */
 
+			case 'D':	/* Histogram mode */
+				Ctrl->D.active = 1;
+				n_errors += get_histogram (API, opt->arg, Ctrl);
+				break;
 			case 'E':	/* Report extended statistics, where blockmedian has an extra modifier */
 				Ctrl->E.active = 1;
 				if (opt->arg[0] == 'b') Ctrl->E.mode = 1;
-				break;	
-			case 'T':	/* Select a particular output value operator */
-				Ctrl->T.active = 1;		
-				switch (opt->arg[0]) {
-					case 'e':	/* Report medians [blockmedian] */
-						Ctrl->T.median = 1;
-						break;
-					case 'm':	/* Report means [blockmean] */
-					case 'n':	/* Report number of points [blockmean] */
-					case 'o':	/* Report mode [blockmode] */
-					case 's':	/* Report data sums [blockmean] */
-					case 'w':	/* Report weight sums [blockmean] */
-						break;
-					case '0':	/* Look for a number in 0 <= q <= 1 range, e.g. 0.xxx, .xxx, or 1 [blockmedian] */
-					case '1':
-					case '.':
-						Ctrl->T.quantile = atof (opt->arg);
-						Ctrl->T.median = 1;
-						break;
-					default:
-						GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: Bad modifier in -T option\n");
+				break;
+			case 'x':	/* Number of threads */
+				Ctrl->x.active = 1;
+				Ctrl->x.n_threads = custom_get_n_threads (opt->arg);
+				break;
+			case 'G':	/* Partial output */
+				Ctrl->G.active = 1;
+				if (opt->arg[0]) Ctrl->G.file = strdup (opt->arg);
+				else n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -G: Must give the name of the partial file\n");
+				break;
+			case 'N':	/* Merge partials */
+				Ctrl->N.active = 1;
+				break;
+			case 'M':	/* Memory budget for points */
+				Ctrl->M.active = 1;
+				n_errors += get_budget (API, opt->arg, &Ctrl->M.budget);
+				break;
+			case 'T':	/* Select one or more output value operators */
+				Ctrl->T.active = 1;
+				pos = Ctrl->T.n_ops = 0;
+				while (gmt_strtok (opt->arg, ",", &pos, p)) {
+					if (Ctrl->T.n_ops == N_OPS_MAX) {
+						GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -T accepts at most %d operators\n", N_OPS_MAX);
 						n_errors++;
 						break;
+					}
+					k = Ctrl->T.n_ops++;
+					switch (p[0]) {
+						case 'e':	/* Report medians [blockmedian] */
+							Ctrl->T.op[k] = OP_MEDIAN;
+							Ctrl->T.q[k] = 0.5;
+							Ctrl->T.median = 1;
+							break;
+						case 'm':	/* Report means [blockmean] */
+							Ctrl->T.op[k] = OP_MEAN;	break;
+						case 'n':	/* Report number of points [blockmean] */
+							Ctrl->T.op[k] = OP_COUNT;	break;
+						case 'o':	/* Report mode [blockmode] */
+							Ctrl->T.op[k] = OP_MODE;	break;
+						case 's':	/* Report data sums [blockmean] */
+							Ctrl->T.op[k] = OP_SUM;		break;
+						case 'w':	/* Report weight sums [blockmean] */
+							Ctrl->T.op[k] = OP_WSUM;	break;
+						case '0':	/* Look for a number in 0 <= q <= 1 range, e.g. 0.xxx, .xxx, or 1 [blockmedian] */
+						case '1':
+						case '.':
+							Ctrl->T.op[k] = OP_QUANTILE;
+							Ctrl->T.q[k] = atof (p);
+							if (Ctrl->T.q[k] <= 0.0 || Ctrl->T.q[k] >= 1.0) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: 0 < q < 1 for quantile in -T\n");
+							if (k == 0) Ctrl->T.quantile = Ctrl->T.q[k];
+							Ctrl->T.median = 1;
+							break;
+						default:
+							GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: Bad modifier in -T option\n");
+							n_errors++;
+							break;
+					}
 				}
+				if (Ctrl->T.n_ops == 0) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -T requires at least one operator\n");
 				break;
 
 			default:	/* Report bad options */
@@ -170,13 +426,1533 @@ static int parse (void *API, struct GMTAVERAGE_CTRL *Ctrl, struct GMT_OPTION *op
 		}
 	}
 	
-	if (Ctrl->T.active) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: Must specify -T option\n");
-	if (Ctrl->T.quantile < 0.0 || Ctrl->T.quantile >= 1.0) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: 0 < q < 1 for quantile in -T\n");
+	if (!Ctrl->T.active) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: Must specify -T option\n");
+	if (!Ctrl->I.active) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: Must specify -I option\n");
 	if (Ctrl->E.mode && !Ctrl->T.median) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -Eb requires -Te|<q>\n");
+	if (Ctrl->D.active) {	/* Only meaningful for the mode */
+		for (k = 0; k < Ctrl->T.n_ops && Ctrl->T.op[k] != OP_MODE; k++);
+		if (k == Ctrl->T.n_ops) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -D requires -To\n");
+	}
+	if (Ctrl->A.active) {	/* Only quantiles can be approximated */
+		for (k = 0; k < Ctrl->T.n_ops; k++) if (Ctrl->T.op[k] == OP_MODE) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -A cannot be used with -To\n");
+		if (!Ctrl->T.median) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -A requires -Te|<q>\n");
+		if (Ctrl->E.active && !Ctrl->E.mode) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -A cannot be used with -E; use -Eb\n");
+		if (!Ctrl->C.active) GMT_Report (API, GMT_MSG_VERBOSE, "-A implies -C: Values are reported at the block centers\n");
+		if (Ctrl->Q.active) GMT_Report (API, GMT_MSG_VERBOSE, "-A ignores -Q since only the distribution of z is known\n");
+		Ctrl->C.active = 1;	/* We only know the distribution of z */
+		Ctrl->Q.active = 0;
+	}
+	if (Ctrl->G.active || Ctrl->N.active || Ctrl->S.active) {	/* Only sums and sketches can be kept */
+		for (k = 0; k < Ctrl->T.n_ops; k++) {
+			if (Ctrl->T.op[k] == OP_MODE) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -G, -N, -S cannot be used with -To\n");
+			else if (is_order_op (Ctrl->T.op[k]) && !Ctrl->A.active) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -G, -N, -S require -A for -Te|<q>\n");
+		}
+	}
+	if (Ctrl->M.active && Ctrl->T.n_ops == 1 && Ctrl->T.op[0] == OP_MODE && !Ctrl->D.active)	/* Without -M we call blockmode, whose estimate may differ */
+		n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -M cannot be used with a single -To unless -D is set\n");
+	if (Ctrl->G.active && Ctrl->S.active) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -G cannot be combined with -S\n");
+	if (Ctrl->N.active && !GMT_Find_Option (API, '<', options)) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -N: Must give the partial files to merge\n");
+	if (Ctrl->E.active && Ctrl->T.n_ops > 1) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: -E requires a single -T operator\n");
+	if (Ctrl->I.active && !Ctrl->I.native && needs_native (Ctrl)) n_errors += GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -I: Only <xinc>[d|m|s][/<yinc>[d|m|s]] may be used with these options\n");
+	if (Ctrl->T.n_ops > 1 && !Ctrl->C.active) GMT_Report (API, GMT_MSG_VERBOSE, "Several -T operators imply -C: Values are reported at the block centers\n");
 
 	return (n_errors);
 }
 
+/* The native binning engine.  When several values per block are requested we read
+ * the input once, bin the points and compute all the values ourselves instead of
+ * calling blockmean|median|mode several times. */
+
+#define AVG_X	0	/* Columns in the records we keep */
+#define AVG_Y	1
+#define AVG_Z	2
+#define AVG_W	3
+
+#define AVG_CHUNK	1048576U	/* Records to allocate at the time */
+#define AVG_MAX_BANDS	64U		/* Max number of temporary band files used at the time [-M] */
+#define AVG_MIN_CAP	1024U		/* Fewest points we keep in memory, whatever the -M budget */
+#define AVG_BLOCK_CHUNK	256U		/* Blocks handed to a thread at the time [-x] */
+#define AVG_SELECT_MIN	16U		/* Ranges this short are sorted rather than partitioned */
+#define AVG_HIST_MIN	64U		/* Histogram bins we always allow per block [-D] */
+#define AVG_MODE_TOL	1.0e-10		/* Relative tolerance when looking for several equal histogram peaks [-D] */
+#define AVG_BATCH	256U		/* Points binned at the time */
+#define AVG_COUNT_FACTOR	8U	/* Bucket points by counting unless their range of blocks exceeds this many per point */
+#define AVG_SKETCH_MIN	8U		/* Centroids allocated for a new sketch [-A] */
+
+struct AVERAGE_GRID {	/* The blocks implied by -R -I [-r] */
+	unsigned int nx, ny;	/* Number of blocks in x and y */
+	unsigned int registration;	/* GMT_GRID_NODE_REG or GMT_GRID_PIXEL_REG */
+	uint64_t n_cells;	/* Total number of blocks */
+	double wesn[4];		/* Region */
+	double inc[2], i_inc[2];	/* Block dimensions and their inverse */
+	double off;		/* 0.5 for gridline and 0.0 for pixel registration */
+	unsigned int periodic;	/* 1 if x is longitude, which we wrap into the region first */
+};
+
+struct AVERAGE_SUMS {	/* Running sums for one block */
+	uint64_t n;		/* Number of points in the block */
+	double w;		/* Sum of weights */
+	double wx, wy, wz;	/* Weighted sums of x, y, and z */
+	double wz2;		/* Weighted sum of z^2 */
+	double z_min, z_max;	/* Extreme z values in the block */
+};
+
+struct AVERAGE_DATA {	/* One input point, kept when order statistics are needed */
+	uint64_t node;		/* Index of the block it falls in */
+	double a[4];		/* x, y, z, w */
+};
+
+static int set_grid (void *API, struct GMT_OPTION *options, double *inc, struct AVERAGE_GRID *B) {
+	/* Get the block layout from the current -R [-r] settings and the -I increments */
+	double wesn[4];
+	struct GMT_GRID *G = NULL;
+	struct GMT_OPTION *opt = NULL;
+
+	if (GMT_Get_Common (API, 'R', wesn) == GMT_NOTSET) return (GMT_RUNTIME_ERROR);
+	if ((G = GMT_Create_Data (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_CONTAINER_ONLY, NULL, wesn, inc, \
+		GMT_GRID_DEFAULT_REG, 0, NULL)) == NULL) return (GMT_RUNTIME_ERROR);
+	B->nx = G->header->nx;
+	B->ny = G->header->ny;
+	B->registration = G->header->registration;
+	B->n_cells = (uint64_t)B->nx * (uint64_t)B->ny;
+	memcpy (B->wesn, G->header->wesn, 4 * sizeof (double));
+	B->inc[GMT_X] = G->header->inc[GMT_X];	B->i_inc[GMT_X] = 1.0 / B->inc[GMT_X];
+	B->inc[GMT_Y] = G->header->inc[GMT_Y];	B->i_inc[GMT_Y] = 1.0 / B->inc[GMT_Y];
+	B->off = (B->registration == GMT_GRID_NODE_REG) ? 0.5 : 0.0;
+	GMT_Destroy_Data (API, &G);	/* We only needed the header information */
+	/* Longitudes are given by -fg or -f0x, or implied by -Rg or -Rd */
+	if ((opt = GMT_Find_Option (API, 'f', options)) && (strchr (opt->arg, 'g') || strstr (opt->arg, "0x"))) B->periodic = 1;
+	if ((opt = GMT_Find_Option (API, 'R', options)) && (opt->arg[0] == 'g' || opt->arg[0] == 'd') && opt->arg[1] == '\0') B->periodic = 1;
+	return (GMT_NOERROR);
+}
+
+static inline double wrap_x (struct AVERAGE_GRID *B, double x) {
+	/* Shift a longitude by multiples of 360 until it is inside the region, like the GMT_block* modules do.
+	 * Longitudes already inside or in a gap of the region are returned unchanged */
+	if (x < B->wesn[GMT_XLO])
+		x += 360.0 * ceil ((B->wesn[GMT_XLO] - x) / 360.0);
+	else if (x > B->wesn[GMT_XHI])
+		x -= 360.0 * ceil ((x - B->wesn[GMT_XHI]) / 360.0);
+	return (x);
+}
+
+static inline unsigned int get_node (struct AVERAGE_GRID *B, double x, double y, uint64_t *node) {
+	/* Return 1 and set the block index if (x,y) is inside the region, else return 0.  As in the GMT_block* modules,
+	 * points outside -R are skipped even if they are within half a block of a gridline-registered edge */
+	int64_t col, row;
+
+	if (!(x >= B->wesn[GMT_XLO] && x <= B->wesn[GMT_XHI] && y >= B->wesn[GMT_YLO] && y <= B->wesn[GMT_YHI])) return (0);	/* Also for NaN */
+	col = (int64_t)floor ((x - B->wesn[GMT_XLO]) * B->i_inc[GMT_X] + B->off);
+	row = (int64_t)floor ((B->wesn[GMT_YHI] - y) * B->i_inc[GMT_Y] + B->off);
+	if (B->registration == GMT_GRID_PIXEL_REG) {	/* Points on the east or south border belong to the last block */
+		if (col == B->nx) col--;
+		if (row == B->ny) row--;
+	}
+	if (col < 0 || col >= B->nx || row < 0 || row >= B->ny) return (0);
+	*node = (uint64_t)row * B->nx + (uint64_t)col;
+	return (1);
+}
+
+static void get_center (struct AVERAGE_GRID *B, uint64_t node, double *x, double *y) {
+	/* Return the coordinates of the center of this block */
+	uint64_t row = node / B->nx, col = node % B->nx;
+	*x = B->wesn[GMT_XLO] + (col + 0.5 - B->off) * B->inc[GMT_X];
+	*y = B->wesn[GMT_YHI] - (row + 0.5 - B->off) * B->inc[GMT_Y];
+}
+
+static inline void add_to_sums (struct AVERAGE_SUMS *S, double *a) {
+	/* Update the running sums of a block with this point */
+	double wz = a[AVG_W] * a[AVG_Z];
+	if (S->n == 0)
+		S->z_min = S->z_max = a[AVG_Z];
+	else if (a[AVG_Z] < S->z_min)
+		S->z_min = a[AVG_Z];
+	else if (a[AVG_Z] > S->z_max)
+		S->z_max = a[AVG_Z];
+	S->n++;
+	S->w   += a[AVG_W];
+	S->wx  += a[AVG_W] * a[AVG_X];
+	S->wy  += a[AVG_W] * a[AVG_Y];
+	S->wz  += wz;
+	S->wz2 += wz * a[AVG_Z];
+}
+
+static inline void add_products (struct AVERAGE_SUMS *S, double z, double w, double wx, double wy, double wz, double wz2) {
+	/* Same as add_to_sums but with the products already computed by bin_kernel */
+	if (S->n == 0)
+		S->z_min = S->z_max = z;
+	else if (z < S->z_min)
+		S->z_min = z;
+	else if (z > S->z_max)
+		S->z_max = z;
+	S->n++;
+	S->w   += w;
+	S->wx  += wx;
+	S->wy  += wy;
+	S->wz  += wz;
+	S->wz2 += wz2;
+}
+
+struct AVERAGE_BATCH {	/* Points waiting to be binned, one array per quantity */
+	unsigned int n;		/* Number of points in the batch */
+	double x[AVG_BATCH], y[AVG_BATCH], z[AVG_BATCH], w[AVG_BATCH];	/* The input values */
+	double node[AVG_BATCH];	/* Block index of each point, or -1 if it is skipped */
+	double wx[AVG_BATCH], wy[AVG_BATCH], wz[AVG_BATCH], wz2[AVG_BATCH];	/* Products for the block sums */
+};
+
+static void bin_kernel (struct AVERAGE_GRID *B, struct AVERAGE_BATCH *P, unsigned int start) {
+	/* Get the block index and the products w*x, w*y, w*z, w*z^2 for the points in the batch from start on.
+	 * Points outside the region or with NaN z or w get the index -1.  Longitudes are first wrapped into the region */
+	unsigned int i;
+	uint64_t node;
+
+	for (i = start; i < P->n; i++) {
+		if (B->periodic) P->x[i] = wrap_x (B, P->x[i]);
+		if (isnan (P->z[i]) || isnan (P->w[i]) || !get_node (B, P->x[i], P->y[i], &node))
+			P->node[i] = -1.0;
+		else
+			P->node[i] = (double)node;
+		P->wx[i]  = P->w[i] * P->x[i];
+		P->wy[i]  = P->w[i] * P->y[i];
+		P->wz[i]  = P->w[i] * P->z[i];
+		P->wz2[i] = P->wz[i] * P->z[i];
+	}
+}
+
+#ifdef AVG_AVX2
+__attribute__((target ("avx2")))
+static void bin_kernel_avx2 (struct AVERAGE_GRID *B, struct AVERAGE_BATCH *P, unsigned int start) {
+	/* Same as bin_kernel but for four points at the time.  The block index is computed exactly as in
+	 * get_node and the products are rounded the same way, so the results are identical */
+	unsigned int i;
+	__m256d west = _mm256_set1_pd (B->wesn[GMT_XLO]), north = _mm256_set1_pd (B->wesn[GMT_YHI]);
+	__m256d i_dx = _mm256_set1_pd (B->i_inc[GMT_X]), i_dy = _mm256_set1_pd (B->i_inc[GMT_Y]), off = _mm256_set1_pd (B->off);
+	__m256d nx = _mm256_set1_pd ((double)B->nx), zero = _mm256_setzero_pd (), skip = _mm256_set1_pd (-1.0);
+	__m256d col_max = _mm256_set1_pd (B->nx - 1.0), row_max = _mm256_set1_pd (B->ny - 1.0);
+	__m256d col_end = col_max, row_end = row_max;	/* Last valid col, row before clamping */
+	__m256d east = _mm256_set1_pd (B->wesn[GMT_XHI]), south = _mm256_set1_pd (B->wesn[GMT_YLO]), full = _mm256_set1_pd (360.0);
+	__m256d x, y, z, w, col, row, ok, wz, lo, hi;
+
+	if (B->registration == GMT_GRID_PIXEL_REG) {	/* Points on the east or south border belong to the last block */
+		col_end = _mm256_set1_pd ((double)B->nx);
+		row_end = _mm256_set1_pd ((double)B->ny);
+	}
+	for (i = start; i + 4 <= P->n; i += 4) {
+		x = _mm256_loadu_pd (&P->x[i]);	y = _mm256_loadu_pd (&P->y[i]);
+		z = _mm256_loadu_pd (&P->z[i]);	w = _mm256_loadu_pd (&P->w[i]);
+		if (B->periodic) {	/* As wrap_x, with the same operations */
+			lo = _mm256_cmp_pd (x, west, _CMP_LT_OQ);	hi = _mm256_cmp_pd (x, east, _CMP_GT_OQ);
+			x = _mm256_blendv_pd (x, _mm256_add_pd (x, _mm256_mul_pd (full, _mm256_ceil_pd (_mm256_div_pd (_mm256_sub_pd (west, x), full)))), lo);
+			x = _mm256_blendv_pd (x, _mm256_sub_pd (x, _mm256_mul_pd (full, _mm256_ceil_pd (_mm256_div_pd (_mm256_sub_pd (x, east), full)))), hi);
+			_mm256_storeu_pd (&P->x[i], x);
+		}
+		col = _mm256_floor_pd (_mm256_add_pd (_mm256_mul_pd (_mm256_sub_pd (x, west), i_dx), off));
+		row = _mm256_floor_pd (_mm256_add_pd (_mm256_mul_pd (_mm256_sub_pd (north, y), i_dy), off));
+		ok = _mm256_and_pd (_mm256_cmp_pd (col, zero, _CMP_GE_OQ), _mm256_cmp_pd (col, col_end, _CMP_LE_OQ));	/* Also false for NaN */
+		ok = _mm256_and_pd (ok, _mm256_and_pd (_mm256_cmp_pd (row, zero, _CMP_GE_OQ), _mm256_cmp_pd (row, row_end, _CMP_LE_OQ)));
+		ok = _mm256_and_pd (ok, _mm256_and_pd (_mm256_cmp_pd (z, z, _CMP_ORD_Q), _mm256_cmp_pd (w, w, _CMP_ORD_Q)));
+		ok = _mm256_and_pd (ok, _mm256_and_pd (_mm256_cmp_pd (x, west, _CMP_GE_OQ), _mm256_cmp_pd (x, east, _CMP_LE_OQ)));	/* Inside -R, as get_node */
+		ok = _mm256_and_pd (ok, _mm256_and_pd (_mm256_cmp_pd (y, south, _CMP_GE_OQ), _mm256_cmp_pd (y, north, _CMP_LE_OQ)));
+		col = _mm256_min_pd (col, col_max);	row = _mm256_min_pd (row, row_max);
+		_mm256_storeu_pd (&P->node[i], _mm256_blendv_pd (skip, _mm256_add_pd (_mm256_mul_pd (row, nx), col), ok));
+		wz = _mm256_mul_pd (w, z);
+		_mm256_storeu_pd (&P->wx[i],  _mm256_mul_pd (w, x));
+		_mm256_storeu_pd (&P->wy[i],  _mm256_mul_pd (w, y));
+		_mm256_storeu_pd (&P->wz[i],  wz);
+		_mm256_storeu_pd (&P->wz2[i], _mm256_mul_pd (wz, z));
+	}
+	bin_kernel (B, P, i);	/* Do the last few points the scalar way */
+}
+#endif
+
+static int compare_node (const void *p1, const void *p2) {
+	/* Sort on block only */
+	const struct AVERAGE_DATA *d1 = p1, *d2 = p2;
+	if (d1->node < d2->node) return (-1);
+	if (d1->node > d2->node) return (+1);
+	return (0);
+}
+
+static int compare_z (const void *p1, const void *p2) {
+	/* Sort on z.  We break any remaining ties on w, x, y so the order
+	 * (and hence -Q results) never depends on the order of input */
+	const struct AVERAGE_DATA *d1 = p1, *d2 = p2;
+	unsigned int k;
+	for (k = AVG_Z; k < AVG_Z + 4; k++) {	/* Check z, w, x, y in that order */
+		if (d1->a[k%4] < d2->a[k%4]) return (-1);
+		if (d1->a[k%4] > d2->a[k%4]) return (+1);
+	}
+	return (0);
+}
+
+static int compare_x (const void *p1, const void *p2) {
+	const struct AVERAGE_DATA *d1 = p1, *d2 = p2;
+	if (d1->a[AVG_X] < d2->a[AVG_X]) return (-1);
+	if (d1->a[AVG_X] > d2->a[AVG_X]) return (+1);
+	return (0);
+}
+
+static int compare_y (const void *p1, const void *p2) {
+	const struct AVERAGE_DATA *d1 = p1, *d2 = p2;
+	if (d1->a[AVG_Y] < d2->a[AVG_Y]) return (-1);
+	if (d1->a[AVG_Y] > d2->a[AVG_Y]) return (+1);
+	return (0);
+}
+
+static int compare_double (const void *p1, const void *p2) {
+	const double *v1 = p1, *v2 = p2;
+	if (*v1 < *v2) return (-1);
+	if (*v1 > *v2) return (+1);
+	return (0);
+}
+
+static inline int order_on (const struct AVERAGE_DATA *d1, const struct AVERAGE_DATA *d2, unsigned int k) {
+	/* Compare on column k, breaking ties on the following columns.  For k = AVG_Z this is compare_z */
+	unsigned int j;
+	for (j = k; j < k + 4; j++) {
+		if (d1->a[j%4] < d2->a[j%4]) return (-1);
+		if (d1->a[j%4] > d2->a[j%4]) return (+1);
+	}
+	return (0);
+}
+
+static inline void swap_data (struct AVERAGE_DATA *d1, struct AVERAGE_DATA *d2) {
+	struct AVERAGE_DATA t = *d1;	*d1 = *d2;	*d2 = t;
+}
+
+static void sort_data (struct AVERAGE_DATA *d, uint64_t n, unsigned int k) {
+	/* Insertion sort of a short range on column k */
+	uint64_t i, j;
+	struct AVERAGE_DATA t;
+	for (i = 1; i < n; i++) {
+		t = d[i];
+		for (j = i; j > 0 && order_on (&t, &d[j-1], k) < 0; j--) d[j] = d[j-1];
+		d[j] = t;
+	}
+}
+
+static uint64_t partition_data (struct AVERAGE_DATA *d, uint64_t lo, uint64_t hi, unsigned int k) {
+	/* Partition d[lo:hi-1] around the median of its first, middle, and last points.
+	 * Return the final position of that pivot */
+	uint64_t i, p, mid = lo + (hi - lo) / 2, last = hi - 1;
+
+	if (order_on (&d[mid], &d[lo], k) < 0) swap_data (&d[mid], &d[lo]);
+	if (order_on (&d[last], &d[lo], k) < 0) swap_data (&d[last], &d[lo]);
+	if (order_on (&d[mid], &d[last], k) < 0) swap_data (&d[mid], &d[last]);	/* Pivot is now in last */
+	for (i = p = lo; i < last; i++) if (order_on (&d[i], &d[last], k) < 0) swap_data (&d[i], &d[p++]);
+	swap_data (&d[p], &d[last]);
+	return (p);
+}
+
+static void select_data (struct AVERAGE_DATA *d, uint64_t lo, uint64_t hi, uint64_t r, unsigned int k) {
+	/* Introselect: Rearrange d[lo:hi-1] so that d[r] holds the point it would hold if the range
+	 * were sorted on column k, with all smaller points before it and the others after it.
+	 * If partitioning fails to shrink the range fast enough we sort what is left */
+	uint64_t p, n;
+	unsigned int depth = 0;
+
+	for (n = hi - lo; n > 1; n >>= 1) depth += 2;	/* Allow 2*log2(n) partitions */
+	while (hi - lo > AVG_SELECT_MIN) {
+		if (depth-- == 0) {	/* Bad pivots; sort the rest */
+			qsort (&d[lo], hi - lo, sizeof (struct AVERAGE_DATA), (k == AVG_Z) ? compare_z : ((k == AVG_X) ? compare_x : compare_y));
+			return;
+		}
+		p = partition_data (d, lo, hi, k);
+		if (r == p) return;
+		if (r < p) hi = p; else lo = p + 1;
+	}
+	sort_data (&d[lo], hi - lo, k);
+}
+
+static void select_next (struct AVERAGE_DATA *d, uint64_t n, uint64_t r, unsigned int k) {
+	/* All of d[r:n-1] follow d[r-1] in order; move the first of them to d[r] */
+	uint64_t i, j = r;
+	for (i = r + 1; i < n; i++) if (order_on (&d[i], &d[j], k) < 0) j = i;
+	if (j != r) swap_data (&d[j], &d[r]);
+}
+
+static double weighted_quantile (struct AVERAGE_DATA *d, uint64_t n, double wsum, double q, unsigned int k, uint64_t *i0, uint64_t *i1) {
+	/* The n points in d are sorted on column k.  Wind up the weights until we reach
+	 * the fraction q of the total weight, as blockmedian does.  If we land exactly on
+	 * the mark we average the two points (i0, i1) straddling it */
+	uint64_t i = 0;
+	double w_goal = q * wsum, w_count = d[0].a[AVG_W];
+
+	while (w_count < w_goal && i < n - 1) w_count += d[++i].a[AVG_W];
+	*i0 = *i1 = i;
+	if (w_count == w_goal && i < n - 1) *i1 = i + 1;
+	return (0.5 * (d[*i0].a[k] + d[*i1].a[k]));
+}
+
+static double select_quantile (struct AVERAGE_DATA *d, uint64_t n, double wsum, double q, unsigned int k, unsigned int weighted, uint64_t *i0, uint64_t *i1) {
+	/* Same result as weighted_quantile but without sorting d on column k first.  For unit
+	 * weights the index of the quantile follows directly from q and we select that point.
+	 * Otherwise we partition d until the point where the running weight reaches q * wsum
+	 * is in place.  Only the points on either side of the mark end up in sorted order, unless the
+	 * running weight lands within rounding of the mark, where we sort them all like blockmedian */
+	uint64_t i, lo = 0, hi = n, p = 0, r;
+	unsigned int depth = 0, found = 0;
+	double w_goal = q * wsum, w_count, w_below = 0.0, w_tol;
+
+	if (!weighted) {	/* Each point has unit weight, so w_count is simply i + 1 */
+		r = (w_goal <= 1.0) ? 0 : (uint64_t)ceil (w_goal) - 1;
+		if (r > n - 1) r = n - 1;
+		select_data (d, 0, n, r, k);
+		*i0 = *i1 = r;
+		if ((double)(r + 1) == w_goal && r < n - 1) {	/* Right on the mark; we also need the next point */
+			select_next (d, n, r + 1, k);
+			*i1 = r + 1;
+		}
+		return (0.5 * (d[*i0].a[k] + d[*i1].a[k]));
+	}
+
+	/* Weighted selection.  All points before lo precede the rest and weigh w_below < w_goal in total */
+	for (r = n; r > 1; r >>= 1) depth += 2;
+	while (!found && hi - lo > AVG_SELECT_MIN && depth) {
+		depth--;
+		p = partition_data (d, lo, hi, k);
+		for (i = lo, w_count = w_below; i < p; i++) w_count += d[i].a[AVG_W];	/* Weight up to the pivot */
+		if (p > lo && w_count >= w_goal)	/* Mark is reached before the pivot */
+			hi = p;
+		else if ((w_count += d[p].a[AVG_W]) >= w_goal || p == hi - 1)	/* The pivot is our point */
+			found = 1;
+		else {	/* Mark is reached after the pivot */
+			w_below = w_count;
+			lo = p + 1;
+		}
+	}
+	if (!found) {	/* Finish by sorting the short range left and scan it like weighted_quantile */
+		if (hi - lo > AVG_SELECT_MIN)
+			qsort (&d[lo], hi - lo, sizeof (struct AVERAGE_DATA), (k == AVG_Z) ? compare_z : ((k == AVG_X) ? compare_x : compare_y));
+		else
+			sort_data (&d[lo], hi - lo, k);
+		p = lo;
+		w_count = w_below + d[p].a[AVG_W];
+		while (w_count < w_goal && p < hi - 1) w_count += d[++p].a[AVG_W];
+	}
+	w_tol = 2.0 * n * DBL_EPSILON * wsum;	/* Bound on the rounding of the sums, which depends on their order */
+	if (fabs (w_count - w_goal) <= w_tol || fabs (w_count - d[p].a[AVG_W] - w_goal) <= w_tol) {	/* Too close to the mark to tell */
+		/* Settle it as blockmedian does: The total weight is summed in z order and the running weight in k order */
+		qsort (d, n, sizeof (struct AVERAGE_DATA), compare_z);
+		for (i = 0, wsum = 0.0; i < n; i++) wsum += d[i].a[AVG_W];
+		if (k != AVG_Z) qsort (d, n, sizeof (struct AVERAGE_DATA), (k == AVG_X) ? compare_x : compare_y);
+		return (weighted_quantile (d, n, wsum, q, k, i0, i1));
+	}
+	*i0 = *i1 = p;
+	if (w_count == w_goal && p < n - 1) {	/* Right on the mark; we also need the next point */
+		select_next (d, n, p + 1, k);
+		*i1 = p + 1;
+	}
+	return (0.5 * (d[*i0].a[k] + d[*i1].a[k]));
+}
+
+static double weighted_mode (struct AVERAGE_DATA *d, uint64_t n, double wsum, unsigned int k) {
+	/* The n points in d are sorted on column k.  Estimate the mode as the middle of the
+	 * densest interval [d[i], d[j]] that holds more than half of the total weight */
+	uint64_t i, j = 0;
+	double top = 0.0, half = 0.5 * wsum, p, p_max = -1.0, width, mode = d[0].a[k];
+
+	if (n == 1) return (d[0].a[k]);
+	for (i = 0; i < n; i++) {
+		while (j < n && top <= half) top += d[j++].a[AVG_W];	/* Wind up until [i, j-1] holds more than half the weight */
+		if (top <= half) break;	/* Not enough weight left */
+		if ((width = d[j-1].a[k] - d[i].a[k]) == 0.0) return (d[i].a[k]);	/* More than half the weight at a single value */
+		if ((p = top / width) > p_max) {
+			p_max = p;
+			mode = 0.5 * (d[i].a[k] + d[j-1].a[k]);
+		}
+		top -= d[i].a[AVG_W];
+	}
+	return (mode);
+}
+
+static void select_double (double *v, uint64_t n, uint64_t r) {
+	/* Introselect for plain values: Put the value of rank r in v[r], smaller values before it */
+	uint64_t i, p, lo = 0, hi = n, mid, last;
+	unsigned int depth = 0;
+	double t;
+
+	for (i = n; i > 1; i >>= 1) depth += 2;
+	while (hi - lo > AVG_SELECT_MIN) {
+		if (depth-- == 0) {	/* Bad pivots; sort the rest */
+			qsort (&v[lo], hi - lo, sizeof (double), compare_double);
+			return;
+		}
+		mid = lo + (hi - lo) / 2;	last = hi - 1;	/* Median of three goes to last */
+		if (v[mid] < v[lo]) {t = v[mid]; v[mid] = v[lo]; v[lo] = t;}
+		if (v[last] < v[lo]) {t = v[last]; v[last] = v[lo]; v[lo] = t;}
+		if (v[mid] < v[last]) {t = v[mid]; v[mid] = v[last]; v[last] = t;}
+		for (i = p = lo; i < last; i++) if (v[i] < v[last]) {t = v[i]; v[i] = v[p]; v[p++] = t;}
+		t = v[p]; v[p] = v[last]; v[last] = t;
+		if (r == p) return;
+		if (r < p) hi = p; else lo = p + 1;
+	}
+	qsort (&v[lo], hi - lo, sizeof (double), compare_double);
+}
+
+static double median_abs_dev (struct AVERAGE_DATA *d, uint64_t n, double center, double *work) {
+	/* Return median |z - center| of the n points in d, using work as scratch space */
+	uint64_t i;
+	double below;
+	for (i = 0; i < n; i++) work[i] = fabs (d[i].a[AVG_Z] - center);
+	select_double (work, n, n/2);
+	if (n % 2) return (work[n/2]);
+	for (i = 1, below = work[0]; i < n/2; i++) if (work[i] > below) below = work[i];	/* Largest of the lower half */
+	return (0.5 * (below + work[n/2]));
+}
+
+static double histogram_mode (struct GMTAVERAGE_CTRL *Ctrl, struct AVERAGE_DATA *d, uint64_t n, double z_min, double z_max, double *count, uint64_t n_count) {
+	/* Estimate the mode of z as the center of the histogram bin holding the most weight [-D].
+	 * count has room for n_count >= 2 * n values.  If the z-range spans more bins than that we
+	 * instead sort on z and store (weight, bin) pairs for the non-empty bins only */
+	unsigned int pass, sparse, n_modes = 0;
+	uint64_t i, j, n_bins;
+	int64_t bin, bin0;
+	double off = (Ctrl->D.center) ? 0.5 : 0.0, i_width = 1.0 / Ctrl->D.width, c, c_max = 0.0, value = 0.0;
+
+	bin0 = (int64_t)floor (z_min * i_width + off);
+	sparse = (floor (z_max * i_width + off) - bin0 + 1.0 > (double)n_count);
+	if (sparse) {	/* Sort and count the weight of consecutive bins */
+		qsort (d, n, sizeof (struct AVERAGE_DATA), compare_z);
+		for (i = n_bins = 0; i < n; i++) {
+			bin = (int64_t)floor (d[i].a[AVG_Z] * i_width + off);
+			if (n_bins == 0 || (int64_t)count[2*n_bins-1] != bin) {	/* Start a new bin */
+				count[2*n_bins] = 0.0;
+				count[2*n_bins+1] = (double)bin;
+				n_bins++;
+			}
+			count[2*n_bins-2] += d[i].a[AVG_W];
+		}
+	}
+	else {	/* Regular histogram */
+		n_bins = (uint64_t)((int64_t)floor (z_max * i_width + off) - bin0 + 1);
+		memset (count, 0, n_bins * sizeof (double));
+		for (i = 0; i < n; i++) count[(int64_t)floor (d[i].a[AVG_Z] * i_width + off) - bin0] += d[i].a[AVG_W];
+	}
+
+	for (pass = 0; pass < 2; pass++) {	/* First find the largest weight, then the bins that have it */
+		for (j = 0; j < n_bins; j++) {
+			if (sparse)
+				c = count[2*j], bin = (int64_t)count[2*j+1];
+			else
+				c = count[j], bin = bin0 + (int64_t)j;
+			if (pass == 0) {
+				if (c > c_max) c_max = c;
+				continue;
+			}
+			if (c_max - c > AVG_MODE_TOL * c_max) continue;	/* Not a peak */
+			n_modes++;
+			if (Ctrl->D.choice == MODE_LOW && n_modes > 1) break;	/* Already have the lowest */
+			if (Ctrl->D.choice == MODE_AVE)
+				value += (bin + 0.5 - off) * Ctrl->D.width;
+			else
+				value = (bin + 0.5 - off) * Ctrl->D.width;
+		}
+	}
+	if (Ctrl->D.choice == MODE_AVE) value /= n_modes;
+	return (value);
+}
+
+/* Approximate quantiles [-A].  Each block keeps a merging t-digest: a list of (z, w) centroids
+ * that is compressed whenever it fills up.  With the arcsine scale function k(q) = delta/(2 pi)
+ * asin (2q - 1), a centroid spans at most one unit of k and hence at most pi/delta of the block
+ * weight, so delta = pi/error bounds the rank error.  There are then at most delta + 1 centroids
+ * after compression, and we compress when 2 * (delta + 1) are in use.  The room for them grows
+ * as needed, so blocks with few points stay small */
+
+struct AVERAGE_CENTROID {	/* Points merged into one value */
+	double z;		/* Weighted mean z */
+	double w;		/* Sum of weights */
+};
+
+struct AVERAGE_SKETCH {	/* Merging t-digest for the z values of one block [-A] */
+	unsigned int n;		/* Number of centroids in use */
+	unsigned int n_alloc;	/* Number of centroids there is room for, up to 2 * (delta + 1) */
+	unsigned int merged;	/* 1 once some centroid holds more than one point */
+	double err;		/* Largest rank uncertainty of the quantiles reported so far */
+	struct AVERAGE_CENTROID c[];	/* Room for n_alloc centroids */
+};
+
+static int compare_centroid (const void *p1, const void *p2) {
+	const struct AVERAGE_CENTROID *c1 = p1, *c2 = p2;
+	if (c1->z < c2->z) return (-1);
+	if (c1->z > c2->z) return (+1);
+	if (c1->w < c2->w) return (-1);
+	if (c1->w > c2->w) return (+1);
+	return (0);
+}
+
+static struct AVERAGE_SKETCH *sketch_alloc (struct AVERAGE_SKETCH *K, unsigned int n_alloc) {
+	/* Allocate a new sketch, or resize K, to hold n_alloc centroids */
+	struct AVERAGE_SKETCH *tmp = NULL;
+	if ((tmp = realloc (K, sizeof (struct AVERAGE_SKETCH) + n_alloc * sizeof (struct AVERAGE_CENTROID))) == NULL) return (NULL);
+	if (K == NULL) {	/* New and empty */
+		tmp->n = tmp->merged = 0;
+		tmp->err = 0.0;
+	}
+	tmp->n_alloc = n_alloc;
+	return (tmp);
+}
+
+static void sketch_compress (struct AVERAGE_SKETCH *K, unsigned int delta) {
+	/* Sort the centroids on z and merge neighbors as long as each spans at most one unit of k */
+	unsigned int i, n = 0;
+	double w_sum = 0.0, w_before = 0.0, w_limit, k_lo, scale = 2.0 * M_PI / delta;
+
+	qsort (K->c, K->n, sizeof (struct AVERAGE_CENTROID), compare_centroid);
+	for (i = 0; i < K->n; i++) w_sum += K->c[i].w;
+	k_lo = -0.25 * delta;	/* k(0) */
+	w_limit = w_sum * 0.5 * (sin (MIN (0.5 * M_PI, (k_lo + 1.0) * scale)) + 1.0);
+	for (i = 1; i < K->n; i++) {
+		if (w_before + K->c[n].w + K->c[i].w <= w_limit) {	/* Merge this centroid into the current one */
+			K->c[n].z += (K->c[i].z - K->c[n].z) * K->c[i].w / (K->c[n].w + K->c[i].w);
+			K->c[n].w += K->c[i].w;
+			K->merged = 1;
+		}
+		else {	/* Close the current centroid and start a new one */
+			w_before += K->c[n].w;
+			k_lo = asin (MIN (1.0, 2.0 * w_before / w_sum - 1.0)) / scale;
+			w_limit = w_sum * 0.5 * (sin (MIN (0.5 * M_PI, (k_lo + 1.0) * scale)) + 1.0);
+			K->c[++n] = K->c[i];
+		}
+	}
+	K->n = (K->n) ? n + 1 : 0;
+}
+
+static int sketch_add (void *API, struct AVERAGE_SKETCH **K, unsigned int delta, double z, double w) {
+	/* Add one point to this sketch, allocating it first or giving it more room if needed */
+	unsigned int n_full = 2 * (delta + 1), n_alloc;
+	struct AVERAGE_SKETCH *tmp = NULL;
+
+	if (*K == NULL || ((*K)->n == (*K)->n_alloc && (*K)->n_alloc < n_full)) {	/* Need (more) room */
+		n_alloc = (*K) ? 2 * (*K)->n_alloc : AVG_SKETCH_MIN;
+		if (n_alloc > n_full) n_alloc = n_full;
+		if ((tmp = sketch_alloc (*K, n_alloc)) == NULL) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Unable to allocate memory for a block sketch\n");
+			return (GMT_MEMORY_ERROR);
+		}
+		*K = tmp;
+	}
+	if ((*K)->n == n_full) sketch_compress (*K, delta);	/* Full */
+	(*K)->c[(*K)->n].z = z;
+	(*K)->c[(*K)->n++].w = w;
+	return (GMT_NOERROR);
+}
+
+static void sketch_finish (struct AVERAGE_SKETCH *K, unsigned int delta) {
+	/* Prepare for quantile queries: Sketches that never filled up just hold the points, sorted */
+	if (K->merged)
+		sketch_compress (K, delta);
+	else
+		qsort (K->c, K->n, sizeof (struct AVERAGE_CENTROID), compare_centroid);
+}
+
+static double sketch_quantile (struct AVERAGE_SKETCH *K, double q, double z_min, double z_max) {
+	/* Estimate the q'th quantile from a finished sketch.  If no points were merged we follow
+	 * weighted_quantile exactly, else we interpolate between the centers of the two centroids
+	 * straddling the mark, using z_min and z_max beyond the first and last centers */
+	unsigned int i = 0;
+	double w_sum = 0.0, w_goal, w_count, left, right, err = 0.0, z;
+
+	for (i = 0; i < K->n; i++) w_sum += K->c[i].w;
+	w_goal = q * w_sum;
+	if (!K->merged) {	/* Exact, as for the points */
+		i = 0;
+		w_count = K->c[0].w;
+		while (w_count < w_goal && i < K->n - 1) w_count += K->c[++i].w;
+		if (w_count == w_goal && i < K->n - 1) return (0.5 * (K->c[i].z + K->c[i+1].z));
+		return (K->c[i].z);
+	}
+	if (w_goal < (right = 0.5 * K->c[0].w)) {	/* Below the first center */
+		z = z_min + (K->c[0].z - z_min) * w_goal / right;
+		err = 0.5 * K->c[0].w;
+	}
+	else {
+		for (i = 0, w_count = 0.0, z = z_max; i < K->n - 1; i++) {
+			left = w_count + 0.5 * K->c[i].w;
+			right = w_count + K->c[i].w + 0.5 * K->c[i+1].w;
+			if (w_goal <= right) {
+				z = K->c[i].z + (K->c[i+1].z - K->c[i].z) * (w_goal - left) / (right - left);
+				err = 0.5 * (K->c[i].w + K->c[i+1].w);
+				break;
+			}
+			w_count += K->c[i].w;
+		}
+		if (i == K->n - 1) {	/* Beyond the last center */
+			left = w_sum - 0.5 * K->c[i].w;
+			z = K->c[i].z + (z_max - K->c[i].z) * (w_goal - left) / (w_sum - left);
+			err = 0.5 * K->c[i].w;
+		}
+	}
+	err /= w_sum;
+	if (err > K->err) K->err = err;
+	return (z);
+}
+
+/* Saved block state [-S].  The file holds a header describing the blocks, then one record per
+ * non-empty block: its node, its AVERAGE_SUMS, and with -A the number of centroids, the merged
+ * flag, and the centroids.  All in native byte order */
+
+#define AVG_STATE_MAGIC	"GMTAVG01"
+
+struct AVERAGE_STATE_HEADER {	/* First bytes of a state file */
+	char magic[8];			/* AVG_STATE_MAGIC */
+	uint32_t nx, ny;		/* Number of blocks */
+	uint32_t registration;		/* GMT_GRID_NODE_REG or GMT_GRID_PIXEL_REG */
+	uint32_t delta;			/* Sketch size parameter, or 0 if there are no sketches */
+	double wesn[4], inc[2];		/* Region and block size */
+	uint64_t n_blocks;		/* Number of block records that follow */
+};
+
+static inline void merge_sums (struct AVERAGE_SUMS *S, struct AVERAGE_SUMS *T) {
+	/* Add the sums in T to those in S */
+	if (T->n == 0) return;
+	if (S->n == 0 || T->z_min < S->z_min) S->z_min = T->z_min;
+	if (S->n == 0 || T->z_max > S->z_max) S->z_max = T->z_max;
+	S->n   += T->n;
+	S->w   += T->w;
+	S->wx  += T->wx;
+	S->wy  += T->wy;
+	S->wz  += T->wz;
+	S->wz2 += T->wz2;
+}
+
+static int state_read (void *API, char *file, struct AVERAGE_GRID *B, unsigned int delta, struct AVERAGE_SUMS *sums, struct AVERAGE_SKETCH **sketch) {
+	/* Merge the blocks saved in file into sums [and sketch].  The blocks must be the same */
+	uint32_t nc[2];
+	uint64_t b, node;
+	unsigned int i;
+	struct AVERAGE_STATE_HEADER H;
+	struct AVERAGE_SUMS T;
+	struct AVERAGE_CENTROID c;
+	FILE *fp = NULL;
+
+	if ((fp = fopen (file, "rb")) == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to open state file %s\n", file);
+		return (GMT_ERROR_ON_FOPEN);
+	}
+	if (fread (&H, sizeof (struct AVERAGE_STATE_HEADER), 1, fp) != 1 || strncmp (H.magic, AVG_STATE_MAGIC, 8U)) {
+		GMT_Report (API, GMT_MSG_NORMAL, "%s is not a gmtaverage state file\n", file);
+		fclose (fp);
+		return (GMT_DATA_READ_ERROR);
+	}
+	if (H.nx != B->nx || H.ny != B->ny || H.registration != B->registration || memcmp (H.wesn, B->wesn, 4 * sizeof (double)) || memcmp (H.inc, B->inc, 2 * sizeof (double))) {
+		GMT_Report (API, GMT_MSG_NORMAL, "State file %s was made for other -R -I -r settings\n", file);
+		fclose (fp);
+		return (GMT_RUNTIME_ERROR);
+	}
+	if (H.delta != delta) {
+		GMT_Report (API, GMT_MSG_NORMAL, "State file %s was made %s\n", file, (H.delta == 0) ? "without -A" : ((delta == 0) ? "with -A" : "with another -A setting"));
+		fclose (fp);
+		return (GMT_RUNTIME_ERROR);
+	}
+	for (b = 0; b < H.n_blocks; b++) {
+		if (fread (&node, sizeof (uint64_t), 1, fp) != 1 || node >= B->n_cells || fread (&T, sizeof (struct AVERAGE_SUMS), 1, fp) != 1) break;
+		merge_sums (&sums[node], &T);
+		if (delta == 0) continue;
+		if (fread (nc, sizeof (uint32_t), 2, fp) != 2 || nc[0] == 0) break;	/* Saved blocks are never empty */
+		for (i = 0; i < nc[0]; i++) {
+			if (fread (&c, sizeof (struct AVERAGE_CENTROID), 1, fp) != 1) break;
+			if (sketch_add (API, &sketch[node], delta, c.z, c.w)) {
+				fclose (fp);
+				return (GMT_MEMORY_ERROR);
+			}
+		}
+		if (i < nc[0]) break;
+		if (nc[1]) sketch[node]->merged = 1;	/* These centroids are not single points */
+	}
+	fclose (fp);
+	if (b < H.n_blocks) {
+		GMT_Report (API, GMT_MSG_NORMAL, "State file %s is truncated or corrupt\n", file);
+		return (GMT_DATA_READ_ERROR);
+	}
+	GMT_Report (API, GMT_MSG_VERBOSE, "Loaded %" PRIu64 " blocks from state file %s\n", H.n_blocks, file);
+	return (GMT_NOERROR);
+}
+
+static int state_write (void *API, char *file, struct AVERAGE_GRID *B, unsigned int delta, struct AVERAGE_SUMS *sums, struct AVERAGE_SKETCH **sketch) {
+	/* Save all non-empty blocks to file.  We write to a temporary file first so an existing
+	 * state survives if anything goes wrong.  Sketches must have been finished */
+	int error = GMT_NOERROR;
+	char tmp_file[PATH_MAX] = {""};
+	uint32_t nc[2];
+	uint64_t node;
+	struct AVERAGE_STATE_HEADER H;
+	FILE *fp = NULL;
+
+	memset (&H, 0, sizeof (struct AVERAGE_STATE_HEADER));
+	memcpy (H.magic, AVG_STATE_MAGIC, 8U);
+	H.nx = B->nx;	H.ny = B->ny;
+	H.registration = B->registration;
+	H.delta = delta;
+	memcpy (H.wesn, B->wesn, 4 * sizeof (double));
+	memcpy (H.inc, B->inc, 2 * sizeof (double));
+	for (node = 0; node < B->n_cells; node++) if (sums[node].n) H.n_blocks++;
+
+	snprintf (tmp_file, PATH_MAX, "%s.tmp", file);
+	if ((fp = fopen (tmp_file, "wb")) == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to create state file %s\n", tmp_file);
+		return (GMT_ERROR_ON_FOPEN);
+	}
+	if (fwrite (&H, sizeof (struct AVERAGE_STATE_HEADER), 1, fp) != 1) error = GMT_DATA_WRITE_ERROR;
+	for (node = 0; !error && node < B->n_cells; node++) {
+		if (sums[node].n == 0) continue;
+		if (fwrite (&node, sizeof (uint64_t), 1, fp) != 1 || fwrite (&sums[node], sizeof (struct AVERAGE_SUMS), 1, fp) != 1) error = GMT_DATA_WRITE_ERROR;
+		if (error || delta == 0) continue;
+		nc[0] = sketch[node]->n;	nc[1] = sketch[node]->merged;
+		if (fwrite (nc, sizeof (uint32_t), 2, fp) != 2 || fwrite (sketch[node]->c, sizeof (struct AVERAGE_CENTROID), nc[0], fp) != nc[0]) error = GMT_DATA_WRITE_ERROR;
+	}
+	if (fclose (fp) && !error) error = GMT_DATA_WRITE_ERROR;
+	if (!error && rename (tmp_file, file)) {	/* Some systems will not rename onto an existing file */
+		remove (file);
+		if (rename (tmp_file, file)) error = GMT_DATA_WRITE_ERROR;
+	}
+	if (error) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Failed to write state file %s\n", file);
+		remove (tmp_file);
+	}
+	else
+		GMT_Report (API, GMT_MSG_VERBOSE, "Saved %" PRIu64 " blocks to state file %s\n", H.n_blocks, file);
+	return (error);
+}
+
+static void block_output (struct GMTAVERAGE_CTRL *Ctrl, struct AVERAGE_GRID *B, uint64_t node, struct AVERAGE_SUMS *S, struct AVERAGE_DATA *d, struct AVERAGE_SKETCH *K, unsigned int sorted, double *work, uint64_t n_work, double *out) {
+	/* Fill out the output record for one block.  S holds the block sums.  If order statistics
+	 * are needed then d holds the S->n points in this block, else d is NULL.  If sorted is 1 then
+	 * d is sorted on z, otherwise we select the quantiles we need.  work is scratch space for
+	 * n_work values.  With -A, K is the finished sketch of the block and d is NULL */
+	unsigned int k, col = 2, op = Ctrl->T.op[0], weighted = Ctrl->W.weighted[GMT_IN], placed = 0;
+	uint64_t i0 = 0, i1 = 0, j0, j1, n = S->n;
+	double value = 0.0;
+
+	for (k = 0; k < Ctrl->T.n_ops; k++) {	/* Compute the requested values */
+		switch (Ctrl->T.op[k]) {
+			case OP_MEAN:	out[col++] = S->wz / S->w;	break;
+			case OP_COUNT:	out[col++] = (double)n;		break;
+			case OP_SUM:	out[col++] = S->wz;		break;
+			case OP_WSUM:	out[col++] = S->w;		break;
+			case OP_MEDIAN: case OP_QUANTILE:
+				if (K)
+					out[col++] = sketch_quantile (K, Ctrl->T.q[k], S->z_min, S->z_max);
+				else if (sorted)
+					out[col++] = weighted_quantile (d, n, S->w, Ctrl->T.q[k], AVG_Z, &i0, &i1);
+				else
+					out[col++] = select_quantile (d, n, S->w, Ctrl->T.q[k], AVG_Z, weighted, &i0, &i1);
+				break;
+			case OP_MODE:
+				if (Ctrl->D.active)
+					out[col++] = histogram_mode (Ctrl, d, n, S->z_min, S->z_max, work, n_work);
+				else
+					out[col++] = weighted_mode (d, n, S->w, AVG_Z);
+				break;
+		}
+	}
+	value = out[2];	/* Only used when there is a single operator */
+
+	if (Ctrl->Q.active && Ctrl->T.n_ops == 1 && !Ctrl->C.active && is_order_op (op)) {	/* Location of the point(s) that gave us the z value */
+		if (op == OP_MODE) {	/* Find the point closest to the mode, and the first in z order if there are several */
+			for (i0 = 0, i1 = 1; i1 < n; i1++) {
+				if (fabs (d[i1].a[AVG_Z] - value) < fabs (d[i0].a[AVG_Z] - value)) i0 = i1;
+				else if (fabs (d[i1].a[AVG_Z] - value) == fabs (d[i0].a[AVG_Z] - value) && compare_z (&d[i1], &d[i0]) < 0) i0 = i1;
+			}
+			i1 = i0;
+		}
+		out[GMT_X] = 0.5 * (d[i0].a[AVG_X] + d[i1].a[AVG_X]);	/* Must get these before -Eb reorders d */
+		out[GMT_Y] = 0.5 * (d[i0].a[AVG_Y] + d[i1].a[AVG_Y]);
+		placed = 1;
+	}
+
+	if (Ctrl->E.active) {	/* Extended output for a single operator */
+		if (Ctrl->E.mode) {	/* Box-and-whisker: low, 25%, 75%, high */
+			out[col++] = S->z_min;
+			if (K) {
+				out[col++] = sketch_quantile (K, 0.25, S->z_min, S->z_max);
+				out[col++] = sketch_quantile (K, 0.75, S->z_min, S->z_max);
+			}
+			else if (sorted) {
+				out[col++] = weighted_quantile (d, n, S->w, 0.25, AVG_Z, &j0, &j1);
+				out[col++] = weighted_quantile (d, n, S->w, 0.75, AVG_Z, &j0, &j1);
+			}
+			else {
+				out[col++] = select_quantile (d, n, S->w, 0.25, AVG_Z, weighted, &j0, &j1);
+				out[col++] = select_quantile (d, n, S->w, 0.75, AVG_Z, weighted, &j0, &j1);
+			}
+			out[col++] = S->z_max;
+		}
+		else {	/* Scale, low, high */
+			if (n < 2)	/* Scale is undefined for a single point */
+				out[col++] = NAN;
+			else if (op == OP_MEDIAN || op == OP_QUANTILE)	/* L1 scale */
+				out[col++] = 1.4826 * median_abs_dev (d, n, value, work);
+			else if (op == OP_MODE)	/* LMS scale */
+				out[col++] = 1.4826 * (1.0 + 5.0 / (n - 1)) * median_abs_dev (d, n, value, work);
+			else	/* Standard deviation */
+				out[col++] = sqrt (fabs (S->wz2 - S->wz * S->wz / S->w) / S->w * n / (n - 1.0));
+			out[col++] = S->z_min;
+			out[col++] = S->z_max;
+		}
+	}
+	if (Ctrl->W.weighted[GMT_OUT]) out[col++] = S->w;
+
+	/* Last, determine the output location; this may reorder the points in d */
+
+	if (placed)	/* Already set via -Q */
+		return;
+	else if (Ctrl->C.active || Ctrl->T.n_ops > 1)	/* Report the center of the block */
+		get_center (B, node, &out[GMT_X], &out[GMT_Y]);
+	else if (!is_order_op (op)) {	/* Weighted mean location */
+		out[GMT_X] = S->wx / S->w;
+		out[GMT_Y] = S->wy / S->w;
+	}
+	else if (op == OP_MODE) {	/* Get mode of x and y separately */
+		qsort (d, n, sizeof (struct AVERAGE_DATA), compare_x);
+		out[GMT_X] = weighted_mode (d, n, S->w, AVG_X);
+		qsort (d, n, sizeof (struct AVERAGE_DATA), compare_y);
+		out[GMT_Y] = weighted_mode (d, n, S->w, AVG_Y);
+	}
+	else {	/* Get median of x and y separately */
+		out[GMT_X] = select_quantile (d, n, S->w, 0.5, AVG_X, weighted, &j0, &j1);
+		out[GMT_Y] = select_quantile (d, n, S->w, 0.5, AVG_Y, weighted, &j0, &j1);
+	}
+}
+
+static unsigned int need_sort (struct GMTAVERAGE_CTRL *Ctrl) {
+	/* Return 1 if the points in each block must be sorted on z, i.e., for -To without -D.
+	 * Quantiles are found by selection and the histogram mode needs no order */
+	unsigned int k;
+	for (k = 0; k < Ctrl->T.n_ops; k++) if (Ctrl->T.op[k] == OP_MODE && !Ctrl->D.active) return (1);
+	return (0);
+}
+
+struct AVERAGE_STATE {	/* Everything needed to turn sorted points into output records */
+	void *API;
+	struct GMTAVERAGE_CTRL *Ctrl;
+	struct AVERAGE_GRID B;
+	struct AVERAGE_DATA *data;	/* Buffer holding the points we currently work on */
+	struct GMT_RECORD Out;		/* Output record pointing to out */
+	double out[GMT_LEN64];
+	double *results;		/* Output values for all the blocks in data */
+	double **work;			/* Scratch space for scale estimates, one per thread */
+	int *status;			/* Error code of each thread, checked once they are done */
+	unsigned int n_out;		/* Number of output columns */
+	unsigned int n_threads;		/* Number of threads working on blocks [-x] */
+	uint64_t *n_work;		/* Number of values allocated in each work */
+	uint64_t *start;		/* Index of the first point in each block of data */
+	uint64_t n_alloc;		/* Number of points allocated in data */
+	uint64_t n_start;		/* Number of blocks allocated in start and results */
+	uint64_t cap;			/* Max number of points we may keep in memory [-M] */
+	uint64_t n_blocks;		/* Number of blocks written so far */
+	struct AVERAGE_DATA *spare;	/* Second buffer that points are bucketed into */
+	uint64_t n_spare;		/* Number of points allocated in spare */
+	double t_bin, t_bucket, t_reduce, t_output;	/* Seconds spent in each stage, for -V */
+	/* What we need while binning the input */
+	struct AVERAGE_SUMS *sums;	/* Running sums per block, unless we keep the points */
+	struct AVERAGE_SKETCH **sketch;	/* Quantile sketch per block [-A] */
+	struct AVERAGE_BANDS *bands;	/* Temporary files for points that do not fit in memory [-M] */
+	struct AVERAGE_BATCH *batch;	/* Points waiting to be binned */
+	void (*kernel) (struct AVERAGE_GRID *, struct AVERAGE_BATCH *, unsigned int);	/* bin_kernel or a faster version of it */
+	unsigned int need_data;		/* 1 if we must keep all the points */
+	unsigned int delta;		/* Sketch size parameter [-A] */
+	uint64_t n_data;		/* Number of points currently in data */
+	uint64_t n_read, n_used;	/* Number of records read and of points inside the region */
+};
+
+struct AVERAGE_BANDS {	/* Temporary files holding the points of consecutive ranges of blocks [-M] */
+	unsigned int n;		/* Number of bands */
+	uint64_t node0, node1;	/* Range of blocks [node0, node1) covered by all the bands */
+	uint64_t span;		/* Number of blocks per band */
+	uint64_t *n_points;	/* Number of points written to each band */
+	FILE **fp;		/* Temporary file for each band */
+};
+
+static void reduce_blocks (void *arg, uint64_t start, uint64_t end, unsigned int thread_id) {
+	/* Worker: Compute the output values of blocks [start, end), sorting their points on z
+	 * only if -To needs it since quantiles are found by selection */
+	unsigned int sorted;
+	uint64_t b, i, n, n_need;
+	struct AVERAGE_STATE *A = arg;
+	struct AVERAGE_DATA *d = NULL;
+	struct AVERAGE_SUMS one;
+
+	sorted = need_sort (A->Ctrl);
+
+	for (b = start; b < end; b++) {
+		d = &A->data[A->start[b]];
+		n = A->start[b+1] - A->start[b];
+		if (sorted) qsort (d, n, sizeof (struct AVERAGE_DATA), compare_z);
+		memset (&one, 0, sizeof (struct AVERAGE_SUMS));
+		for (i = 0; i < n; i++) add_to_sums (&one, d[i].a);
+		n_need = (A->Ctrl->D.active) ? 2 * n + AVG_HIST_MIN : n;	/* Histogram bins need a bit more */
+		if (n_need > A->n_work[thread_id]) {	/* Need more scratch space */
+			free (A->work[thread_id]);
+			if ((A->work[thread_id] = malloc (n_need * sizeof (double))) == NULL) {
+				A->n_work[thread_id] = 0;
+				A->status[thread_id] = GMT_MEMORY_ERROR;
+				return;
+			}
+			A->n_work[thread_id] = n_need;
+		}
+		block_output (A->Ctrl, &A->B, d->node, &one, d, NULL, sorted, A->work[thread_id], A->n_work[thread_id], &A->results[b * A->n_out]);
+	}
+}
+
+static int set_blocks (struct AVERAGE_STATE *A, uint64_t n_b) {
+	/* Make sure we have room to organize n_b blocks */
+	uint64_t *tmp_s = NULL;
+	double *tmp_r = NULL;
+
+	if (n_b <= A->n_start) return (GMT_NOERROR);
+	if ((tmp_s = realloc (A->start, (n_b + 1) * sizeof (uint64_t))) != NULL) A->start = tmp_s;
+	if ((tmp_r = realloc (A->results, n_b * A->n_out * sizeof (double))) != NULL) A->results = tmp_r;
+	if (tmp_s == NULL || tmp_r == NULL) {
+		GMT_Report (A->API, GMT_MSG_NORMAL, "Unable to allocate memory for %" PRIu64 " blocks\n", n_b);
+		return (GMT_MEMORY_ERROR);
+	}
+	A->n_start = n_b;
+	return (GMT_NOERROR);
+}
+
+static int bucket_points (struct AVERAGE_STATE *A, struct AVERAGE_DATA *data, uint64_t n, uint64_t node_min, uint64_t node_max, uint64_t *n_blocks) {
+	/* Counting sort of the n points on block index: Count the points per block, turn the counts into the first
+	 * position of each block, then copy each point to its place in the spare buffer.  Unlike qsort this is
+	 * linear in n and keeps the points of each block in input order.  On return A->data holds the points
+	 * grouped by block and A->start where each block begins */
+	int error;
+	uint64_t i, c, b, pos, n_c = node_max - node_min + 1, *count = NULL;
+	struct AVERAGE_DATA *tmp = NULL;
+
+	if ((count = calloc (n_c, sizeof (uint64_t))) == NULL) {
+		GMT_Report (A->API, GMT_MSG_NORMAL, "Unable to allocate memory for %" PRIu64 " block counts\n", n_c);
+		return (GMT_MEMORY_ERROR);
+	}
+	if (A->n_spare < A->n_alloc) {	/* Second buffer must be as large as the first since we swap them */
+		if ((tmp = realloc (A->spare, A->n_alloc * sizeof (struct AVERAGE_DATA))) == NULL) {
+			GMT_Report (A->API, GMT_MSG_NORMAL, "Unable to allocate memory for bucketing %" PRIu64 " points\n", n);
+			free (count);
+			return (GMT_MEMORY_ERROR);
+		}
+		A->spare = tmp;	A->n_spare = A->n_alloc;
+	}
+	for (i = 0; i < n; i++) count[data[i].node - node_min]++;	/* First pass: Points per block */
+	for (c = b = 0; c < n_c; c++) if (count[c]) b++;
+	if ((error = set_blocks (A, b))) {
+		free (count);
+		return (error);
+	}
+	for (c = b = pos = 0; c < n_c; c++) {	/* Turn counts into start positions */
+		if (count[c] == 0) continue;
+		A->start[b++] = pos;
+		pos += count[c];
+		count[c] = A->start[b-1];
+	}
+	A->start[b] = n;
+	for (i = 0; i < n; i++) A->spare[count[data[i].node - node_min]++] = data[i];	/* Second pass: Place the points */
+	free (count);
+
+	/* Swap the buffers (data is always A->data) so the bucketed points become the data buffer */
+
+	tmp = A->spare;	A->spare = A->data;	A->data = tmp;
+	i = A->n_spare;	A->n_spare = A->n_alloc;	A->n_alloc = i;
+	*n_blocks = b;
+	return (GMT_NOERROR);
+}
+
+static int write_blocks (struct AVERAGE_STATE *A, struct AVERAGE_DATA *data, uint64_t n) {
+	/* Group the n points by block, compute the values of all blocks (possibly
+	 * using several threads), then write one record per block in order */
+	int error;
+	unsigned int t;
+	uint64_t b, i, n_b, node_min, node_max;
+	double t0 = custom_wall_time (), t1, t2;
+
+	if (n == 0) return (GMT_NOERROR);
+	for (i = 1, node_min = node_max = data[0].node; i < n; i++) {
+		if (data[i].node < node_min) node_min = data[i].node;
+		else if (data[i].node > node_max) node_max = data[i].node;
+	}
+	if ((node_max - node_min) / AVG_COUNT_FACTOR < n) {	/* Blocks are dense enough for a counting sort */
+		if ((error = bucket_points (A, data, n, node_min, node_max, &n_b))) return (error);
+	}
+	else {	/* Very sparse blocks: Cheaper to sort the points */
+		qsort (data, n, sizeof (struct AVERAGE_DATA), compare_node);
+		for (i = n_b = 1; i < n; i++) if (data[i].node != data[i-1].node) n_b++;	/* Count the blocks */
+		if ((error = set_blocks (A, n_b))) return (error);
+		for (i = 1, b = A->start[0] = 0; i < n; i++) if (data[i].node != data[i-1].node) A->start[++b] = i;
+		A->start[n_b] = n;
+		A->data = data;
+	}
+	t1 = custom_wall_time ();
+
+	error = custom_parallel_for (A->n_threads, n_b, AVG_BLOCK_CHUNK, reduce_blocks, A);
+	for (t = 0; !error && t < A->n_threads; t++) error = A->status[t];	/* Each thread only sets its own */
+	if (error) {
+		GMT_Report (A->API, GMT_MSG_NORMAL, "Unable to allocate scratch memory for block values\n");
+		return (error);
+	}
+	t2 = custom_wall_time ();
+
+	for (b = 0; b < n_b; b++) {	/* Write the blocks in order */
+		A->Out.data = &A->results[b * A->n_out];
+		GMT_Put_Record (A->API, GMT_WRITE_DATA, &A->Out);
+	}
+	A->Out.data = A->out;
+	A->n_blocks += n_b;
+	A->t_bucket += t1 - t0;	A->t_reduce += t2 - t1;	A->t_output += custom_wall_time () - t2;
+	return (GMT_NOERROR);
+}
+
+static void bands_free (struct AVERAGE_BANDS *S) {
+	unsigned int k;
+	for (k = 0; k < S->n; k++) if (S->fp[k]) fclose (S->fp[k]);	/* This also removes the temporary files */
+	free (S->fp);
+	free (S->n_points);
+}
+
+static int bands_init (void *API, struct AVERAGE_BANDS *S, uint64_t node0, uint64_t node1, uint64_t n) {
+	/* Split the blocks [node0, node1) into (at most) n bands, each with its own temporary file */
+	unsigned int k;
+
+	S->node0 = node0;	S->node1 = node1;
+	S->span = (node1 - node0 + n - 1) / n;
+	S->n = (unsigned int)((node1 - node0 + S->span - 1) / S->span);
+	S->n_points = calloc (S->n, sizeof (uint64_t));
+	if ((S->fp = calloc (S->n, sizeof (FILE *))) == NULL || S->n_points == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to allocate memory for %u bands\n", S->n);
+		return (GMT_MEMORY_ERROR);
+	}
+	for (k = 0; k < S->n; k++) {
+		if ((S->fp[k] = tmpfile ()) == NULL) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Unable to create temporary file for band %u\n", k);
+			return (GMT_ERROR_ON_FOPEN);
+		}
+	}
+	return (GMT_NOERROR);
+}
+
+static int bands_add (void *API, struct AVERAGE_BANDS *S, struct AVERAGE_DATA *data, uint64_t n) {
+	/* Append these n points to the band files they belong in */
+	uint64_t i;
+	unsigned int k;
+
+	for (i = 0; i < n; i++) {
+		k = (unsigned int)((data[i].node - S->node0) / S->span);
+		if (fwrite (&data[i], sizeof (struct AVERAGE_DATA), 1U, S->fp[k]) != 1) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Failed writing to temporary file for band %u\n", k);
+			return (GMT_RUNTIME_ERROR);
+		}
+		S->n_points[k]++;
+	}
+	return (GMT_NOERROR);
+}
+
+static int bands_process (struct AVERAGE_STATE *A, struct AVERAGE_BANDS *S);
+
+static int band_process (struct AVERAGE_STATE *A, FILE *fp, uint64_t n, uint64_t node0, uint64_t node1) {
+	/* Write the blocks for the n points in this band file.  If they do not fit in memory
+	 * then we split the band into smaller bands and process those in turn */
+	int error;
+	uint64_t left, m;
+	struct AVERAGE_DATA *tmp = NULL;
+	struct AVERAGE_BANDS sub;
+
+	if (n == 0) return (GMT_NOERROR);
+	rewind (fp);
+	if (n <= A->cap || node1 - node0 == 1) {	/* Fits in memory (or is a single block which we cannot split) */
+		if (n > A->n_alloc) {	/* A single block holding more points than our budget allows */
+			GMT_Report (A->API, GMT_MSG_VERBOSE, "Block %" PRIu64 " holds %" PRIu64 " points which exceeds the -M memory budget\n", node0, n);
+			if ((tmp = realloc (A->data, n * sizeof (struct AVERAGE_DATA))) == NULL) {
+				GMT_Report (A->API, GMT_MSG_NORMAL, "Unable to allocate memory for %" PRIu64 " points\n", n);
+				return (GMT_MEMORY_ERROR);
+			}
+			A->data = tmp;	A->n_alloc = n;
+		}
+		if (fread (A->data, sizeof (struct AVERAGE_DATA), n, fp) != n) {
+			GMT_Report (A->API, GMT_MSG_NORMAL, "Failed reading %" PRIu64 " points from temporary file\n", n);
+			return (GMT_DATA_READ_ERROR);
+		}
+		return (write_blocks (A, A->data, n));
+	}
+
+	/* Too many points: Split this band further */
+
+	GMT_Report (A->API, GMT_MSG_LONG_VERBOSE, "Split blocks %" PRIu64 "-%" PRIu64 " holding %" PRIu64 " points\n", node0, node1 - 1, n);
+	memset (&sub, 0, sizeof (struct AVERAGE_BANDS));
+	m = 2 * (n / A->cap + 1);
+	if (m > AVG_MAX_BANDS) m = AVG_MAX_BANDS;
+	if ((error = bands_init (A->API, &sub, node0, node1, m)) == GMT_NOERROR) {
+		for (left = n; !error && left; left -= m) {
+			m = (left < A->cap) ? left : A->cap;
+			if (fread (A->data, sizeof (struct AVERAGE_DATA), m, fp) != m) {
+				GMT_Report (A->API, GMT_MSG_NORMAL, "Failed reading %" PRIu64 " points from temporary file\n", m);
+				error = GMT_DATA_READ_ERROR;
+			}
+			else
+				error = bands_add (A->API, &sub, A->data, m);
+		}
+		if (!error) error = bands_process (A, &sub);
+	}
+	bands_free (&sub);
+	return (error);
+}
+
+static int bands_process (struct AVERAGE_STATE *A, struct AVERAGE_BANDS *S) {
+	/* Write the blocks for all bands in order, closing each band file when done */
+	int error;
+	unsigned int k;
+	uint64_t node1;
+
+	for (k = 0; k < S->n; k++) {
+		node1 = S->node0 + (k + 1) * S->span;
+		if (node1 > S->node1) node1 = S->node1;
+		if ((error = band_process (A, S->fp[k], S->n_points[k], S->node0 + k * S->span, node1))) return (error);
+		fclose (S->fp[k]);
+		S->fp[k] = NULL;
+	}
+	return (GMT_NOERROR);
+}
+
+static int keep_point (struct AVERAGE_STATE *A, uint64_t node, double *a) {
+	/* Keep the point a = (x,y,z,w) of this block for later, moving the points to the band files if the buffer is full */
+	int error;
+	struct AVERAGE_DATA *tmp = NULL;
+
+	if (A->n_data == A->cap) {	/* Buffer is full: Move the points to the band files */
+		if (A->bands->n == 0) {	/* First time: set up the bands */
+			GMT_Report (A->API, GMT_MSG_VERBOSE, "Input exceeds the memory budget; using temporary band files\n");
+			if ((error = bands_init (A->API, A->bands, 0, A->B.n_cells, AVG_MAX_BANDS))) return (error);
+		}
+		if ((error = bands_add (A->API, A->bands, A->data, A->n_data))) return (error);
+		A->n_data = 0;
+	}
+	if (A->n_data == A->n_alloc) {	/* Need more memory for points */
+		A->n_alloc += AVG_CHUNK;
+		if (A->n_alloc > A->cap) A->n_alloc = A->cap;
+		if ((tmp = realloc (A->data, A->n_alloc * sizeof (struct AVERAGE_DATA))) == NULL) {
+			GMT_Report (A->API, GMT_MSG_NORMAL, "Unable to allocate memory for %" PRIu64 " points\n", A->n_alloc);
+			return (GMT_MEMORY_ERROR);
+		}
+		A->data = tmp;
+	}
+	A->data[A->n_data].node = node;
+	memcpy (A->data[A->n_data++].a, a, 4 * sizeof (double));
+	return (GMT_NOERROR);
+}
+
+static int bin_batch (struct AVERAGE_STATE *A) {
+	/* Add the points in the batch to the sums [and sketches] of their blocks, or keep them for later */
+	int error = GMT_NOERROR;
+	unsigned int i;
+	uint64_t node;
+	double a[4];
+	struct AVERAGE_BATCH *P = A->batch;
+
+	A->kernel (&A->B, P, 0);	/* Get all the block indices and products */
+	for (i = 0; !error && i < P->n; i++) {
+		if (P->node[i] < 0.0) continue;	/* Outside the region or NaN */
+		node = (uint64_t)P->node[i];
+		A->n_used++;
+		if (A->need_data) {
+			a[AVG_X] = P->x[i];	a[AVG_Y] = P->y[i];	a[AVG_Z] = P->z[i];	a[AVG_W] = P->w[i];
+			error = keep_point (A, node, a);
+		}
+		else {	/* Just update the sums [and sketch] */
+			add_products (&A->sums[node], P->z[i], P->w[i], P->wx[i], P->wy[i], P->wz[i], P->wz2[i]);
+			if (A->sketch) error = sketch_add (A->API, &A->sketch[node], A->delta, P->z[i], P->w[i]);
+		}
+	}
+	P->n = 0;
+	return (error);
+}
+
+static inline int bin_point (struct AVERAGE_STATE *A, double *a) {
+	/* Add the point a = (x,y,z,w) to the batch, binning the batch when it is full */
+	struct AVERAGE_BATCH *P = A->batch;
+	P->x[P->n] = a[AVG_X];	P->y[P->n] = a[AVG_Y];	P->z[P->n] = a[AVG_Z];	P->w[P->n] = a[AVG_W];
+	return ((++P->n == AVG_BATCH) ? bin_batch (A) : GMT_NOERROR);
+}
+
+static unsigned int binary_layout (void *API, struct GMT_OPTION *options, unsigned int n_in, unsigned int *n_cols, unsigned int *single) {
+	/* Return 1 if the input is plain binary files (-bi[<ncols>][d|f]) that we can bin directly, and set the
+	 * number of columns per record and whether they are floats.  Anything else (mixed types, byte swapping,
+	 * column selection, column types, headers, standard input, etc.) is left to GMT_Get_Record */
+	char *c = NULL;
+	const char *skip = ":adefghi";	/* Options that change which records or values we get */
+	struct GMT_OPTION *opt = NULL, *bi = NULL;
+
+	for (opt = options; opt; opt = opt->next) if (opt->option == 'b' && opt->arg[0] != 'o') bi = opt;
+	if (bi == NULL) return (0);	/* ASCII input */
+	c = (bi->arg[0] == 'i') ? &bi->arg[1] : bi->arg;
+	*n_cols = (unsigned int)strtoul (c, &c, 10);
+	if (*n_cols == 0) *n_cols = n_in;
+	*single = (c[0] == 'f');
+	if (c[0] == 'f' || c[0] == 'd') c++;
+	if (c[0] || *n_cols < n_in) return (0);	/* Some other type or modifier, or too few columns */
+	for (; *skip; skip++) if (GMT_Find_Option (API, *skip, options)) return (0);
+	if (GMT_Find_Option (API, GMT_OPT_INFILE, options) == NULL) return (0);	/* Cannot do standard input */
+	return (1);
+}
+
+static int bin_records (struct AVERAGE_STATE *A, char *buffer, uint64_t n_recs, unsigned int n_in, unsigned int n_cols, unsigned int single) {
+	/* Bin n_recs binary records of n_cols floats or doubles, of which the first n_in are x,y,z[,w] */
+	int error = GMT_NOERROR;
+	unsigned int k;
+	uint64_t r;
+	double a[4];
+	float *f = (float *)buffer;
+	double *d = (double *)buffer;
+
+	a[AVG_W] = 1.0;	/* Unless we read weights */
+	for (r = 0; !error && r < n_recs; r++) {
+		if (single)
+			for (k = 0; k < n_in; k++) a[k] = f[r * n_cols + k];
+		else
+			for (k = 0; k < n_in; k++) a[k] = d[r * n_cols + k];
+		error = bin_point (A, a);
+	}
+	A->n_read += n_recs;
+	return (error);
+}
+
+static int read_binary (struct AVERAGE_STATE *A, struct GMT_OPTION *options, unsigned int n_in, unsigned int n_cols, unsigned int single) {
+	/* Bin the plain binary input files directly, mapping each file into memory if possible and else
+	 * reading it in large chunks, rather than asking GMT_Get_Record for one record at the time */
+	int error = GMT_NOERROR;
+	size_t rec_size = n_cols * ((single) ? sizeof (float) : sizeof (double));
+	uint64_t n_recs;
+	char *buffer = NULL;
+	FILE *fp = NULL;
+	struct GMT_OPTION *opt = NULL;
+#ifdef HAVE_MMAP
+	struct stat buf;
+#endif
+
+	for (opt = options; !error && opt; opt = opt->next) {
+		if (opt->option != GMT_OPT_INFILE) continue;
+		if ((fp = fopen (opt->arg, "rb")) == NULL) {
+			GMT_Report (A->API, GMT_MSG_NORMAL, "Unable to open file %s\n", opt->arg);
+			error = GMT_ERROR_ON_FOPEN;
+			break;
+		}
+#ifdef HAVE_MMAP
+		if (fstat (fileno (fp), &buf) == 0 && (n_recs = (uint64_t)buf.st_size / rec_size) > 0) {
+			if ((uint64_t)buf.st_size % rec_size)
+				GMT_Report (A->API, GMT_MSG_NORMAL, "File %s ends with a partial record that will be skipped\n", opt->arg);
+			if ((buffer = mmap (NULL, (size_t)buf.st_size, PROT_READ, MAP_PRIVATE, fileno (fp), 0)) != MAP_FAILED) {
+				GMT_Report (A->API, GMT_MSG_LONG_VERBOSE, "Mapped %" PRIu64 " records from file %s\n", n_recs, opt->arg);
+#ifdef MADV_SEQUENTIAL
+				madvise (buffer, (size_t)buf.st_size, MADV_SEQUENTIAL);
+#endif
+				error = bin_records (A, buffer, n_recs, n_in, n_cols, single);
+				munmap (buffer, (size_t)buf.st_size);
+				buffer = NULL;
+				fclose (fp);
+				continue;
+			}
+			buffer = NULL;	/* Could not map it; read it instead */
+		}
+#endif
+		if (buffer == NULL && (buffer = malloc (AVG_CHUNK * rec_size)) == NULL) {
+			GMT_Report (A->API, GMT_MSG_NORMAL, "Unable to allocate memory for reading file %s\n", opt->arg);
+			error = GMT_MEMORY_ERROR;
+		}
+		while (!error && (n_recs = fread (buffer, rec_size, AVG_CHUNK, fp)) > 0)
+			error = bin_records (A, buffer, n_recs, n_in, n_cols, single);
+		fclose (fp);
+	}
+	free (buffer);
+	return (error);
+}
+
+static unsigned int use_native (void *API, struct GMTAVERAGE_CTRL *Ctrl, struct GMT_OPTION *options) {
+	/* Return 1 if we should bin the data ourselves rather than call a GMT_block* module */
+	unsigned int n_cols, single;
+	if (needs_native (Ctrl)) return (1);
+	if (!Ctrl->I.native) return (0);	/* Leave increments with units or modifiers to the GMT_block* modules */
+	if (Ctrl->T.median) return (1);	/* Selection is faster than the sorting in blockmedian */
+	if (Ctrl->T.op[0] == OP_MODE) return (0);	/* Leave a single -To to blockmode, whose estimate may differ from ours */
+	return (binary_layout (API, options, (Ctrl->W.weighted[GMT_IN]) ? 4 : 3, &n_cols, &single));	/* We read plain binary files of means faster */
+}
+
+static int do_native (void *API, struct GMTAVERAGE_CTRL *Ctrl, struct GMT_OPTION *options) {
+	/* Read the input once, bin it, and write all the requested values per block */
+	int error = GMT_NOERROR;
+	unsigned int k, n_in, n_cols, single, n_files = 0;
+	uint64_t node, n_merged = 0, per_point, fixed;
+	double a[4], err_max = 0.0, t0;
+	struct AVERAGE_STATE A;
+	struct AVERAGE_BANDS S;
+	struct GMT_RECORD *In = NULL;
+	struct GMT_OPTION *opt = NULL;
+
+	memset (&A, 0, sizeof (struct AVERAGE_STATE));
+	memset (&S, 0, sizeof (struct AVERAGE_BANDS));
+	A.API = API;	A.Ctrl = Ctrl;
+	A.bands = &S;
+	A.Out.data = A.out;
+	A.n_out = 2 + Ctrl->T.n_ops + Ctrl->W.weighted[GMT_OUT];
+	if (Ctrl->E.active) A.n_out += (Ctrl->E.mode) ? 4 : 3;
+	A.n_threads = (Ctrl->x.active) ? Ctrl->x.n_threads : 1;
+	A.work = calloc (A.n_threads, sizeof (double *));
+	A.status = calloc (A.n_threads, sizeof (int));
+	if ((A.n_work = calloc (A.n_threads, sizeof (uint64_t))) == NULL || A.work == NULL || A.status == NULL) {
+		free (A.work);
+		free (A.n_work);
+		free (A.status);
+		return (GMT_MEMORY_ERROR);
+	}
+	if (set_grid (API, options, Ctrl->I.inc, &A.B)) error = GMT_RUNTIME_ERROR;
+	else if (Ctrl->A.active) {	/* Quantiles come from fixed-size sketches so we only need sums */
+		A.delta = (unsigned int)ceil (M_PI / Ctrl->A.error);
+		if ((A.sketch = calloc (A.B.n_cells, sizeof (struct AVERAGE_SKETCH *))) == NULL) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Unable to allocate sketches for %" PRIu64 " blocks\n", A.B.n_cells);
+			error = GMT_MEMORY_ERROR;
+		}
+		else GMT_Report (API, GMT_MSG_VERBOSE, "Approximate quantiles use up to %u centroids (%u bytes) per block\n",
+			2 * (A.delta + 1), (unsigned int)(sizeof (struct AVERAGE_SKETCH) + 2 * (A.delta + 1) * sizeof (struct AVERAGE_CENTROID)));
+	}
+	else
+		for (k = 0; k < Ctrl->T.n_ops; k++) if (is_order_op (Ctrl->T.op[k])) A.need_data = 1;
+	if (!error && !A.need_data && (A.sums = calloc (A.B.n_cells, sizeof (struct AVERAGE_SUMS))) == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to allocate sums for %" PRIu64 " blocks\n", A.B.n_cells);
+		error = GMT_MEMORY_ERROR;
+	}
+	if (!error && Ctrl->S.active && access (Ctrl->S.file, F_OK))
+		GMT_Report (API, GMT_MSG_VERBOSE, "State file %s does not exist yet; starting afresh\n", Ctrl->S.file);
+	else if (!error && Ctrl->S.active) error = state_read (API, Ctrl->S.file, &A.B, A.delta, A.sums, A.sketch);	/* Start from the saved state */
+	if (!error) GMT_Report (API, GMT_MSG_VERBOSE, "Binning %u operators in a single pass over %u x %u blocks using %u thread(s)\n",
+		Ctrl->T.n_ops, A.B.nx, A.B.ny, A.n_threads);
+	if (!error && Ctrl->M.active) {	/* Each point kept also needs room in the bucketing buffer, the block counts [up to AVG_COUNT_FACTOR
+				 * per point], the block starts and results, and the scratch space of -D; the batch and the smallest
+				 * scratch space of each thread come off the top */
+		per_point = 2 * sizeof (struct AVERAGE_DATA) + (AVG_COUNT_FACTOR + 2) * sizeof (uint64_t) + (A.n_out + 2) * sizeof (double);
+		fixed = sizeof (struct AVERAGE_BATCH) + A.n_threads * AVG_HIST_MIN * sizeof (double);
+		A.cap = (Ctrl->M.budget > fixed) ? (Ctrl->M.budget - fixed) / per_point : 0;
+		if (A.cap < AVG_MIN_CAP) A.cap = AVG_MIN_CAP;
+		if (A.need_data)
+			GMT_Report (API, GMT_MSG_VERBOSE, "Memory budget allows %" PRIu64 " points in memory at the time\n", A.cap);
+		else
+			GMT_Report (API, GMT_MSG_VERBOSE, "-M has no effect since only block sums are needed\n");
+	}
+	else
+		A.cap = UINT64_MAX;
+	if (!error && (A.batch = calloc (1U, sizeof (struct AVERAGE_BATCH))) == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to allocate memory for binning\n");
+		error = GMT_MEMORY_ERROR;
+	}
+	A.kernel = bin_kernel;
+#ifdef AVG_AVX2
+	if (__builtin_cpu_supports ("avx2") && getenv ("GMT_AVERAGE_SCALAR") == NULL) A.kernel = bin_kernel_avx2;	/* Unless asked for the reference code */
+#endif
+	GMT_Report (API, GMT_MSG_LONG_VERBOSE, "Computing block indices with the %s kernel\n", (A.kernel == bin_kernel) ? "scalar" : "AVX2");
+
+	/* Read all the input records and bin them, or merge the partials [-N] */
+
+	t0 = custom_wall_time ();
+	n_in = (Ctrl->W.weighted[GMT_IN]) ? 4 : 3;
+	if (!error && Ctrl->N.active) {	/* Input files are partials from earlier runs */
+		for (opt = options; !error && opt; opt = opt->next) {
+			if (opt->option != GMT_OPT_INFILE) continue;
+			error = state_read (API, opt->arg, &A.B, A.delta, A.sums, A.sketch);
+			n_files++;
+		}
+		if (!error) GMT_Report (API, GMT_MSG_VERBOSE, "Merged %u partial files\n", n_files);
+	}
+	else if (!error && binary_layout (API, options, n_in, &n_cols, &single)) {	/* Skip the record-by-record reader */
+		GMT_Report (API, GMT_MSG_VERBOSE, "Reading %u-column %s records directly from the binary input files\n", n_cols, (single) ? "float" : "double");
+		error = read_binary (&A, options, n_in, n_cols, single);
+		if (!error) error = bin_batch (&A);	/* Bin the last few points */
+		if (!error && S.n) error = bands_add (API, &S, A.data, A.n_data);	/* Flush what is left in the buffer */
+	}
+	else if (!error) {
+		a[AVG_W] = 1.0;	/* Unless we read weights */
+		if (GMT_Set_Columns (API, GMT_IN, n_in, GMT_COL_FIX_NO_TEXT) != GMT_NOERROR) error = GMT_RUNTIME_ERROR;
+		if (!error && GMT_Init_IO (API, GMT_IS_DATASET, GMT_IS_POINT, GMT_IN, GMT_ADD_DEFAULT, 0, options) != GMT_NOERROR) error = GMT_RUNTIME_ERROR;
+		if (!error && GMT_Begin_IO (API, GMT_IS_DATASET, GMT_IN, GMT_HEADER_ON) != GMT_NOERROR) error = GMT_RUNTIME_ERROR;
+		else if (!error) {
+			do {	/* Keep returning records until we reach EOF */
+				if ((In = GMT_Get_Record (API, GMT_READ_DATA, NULL)) == NULL) {	/* Headers, gaps, or EOF */
+					if (GMT_Get_Status (API, GMT_IO_EOF)) break;
+					continue;
+				}
+				A.n_read++;
+				memcpy (a, In->data, n_in * sizeof (double));
+				if ((error = bin_point (&A, a))) break;
+			} while (1);
+			if (GMT_End_IO (API, GMT_IN, 0) != GMT_NOERROR && !error) error = GMT_RUNTIME_ERROR;
+		}
+		if (!error) error = bin_batch (&A);	/* Bin the last few points */
+		if (!error && S.n) error = bands_add (API, &S, A.data, A.n_data);	/* Flush what is left in the buffer */
+	}
+
+	A.t_bin = custom_wall_time () - t0;
+
+	/* Write one record per non-empty block, or the partial sums [-G] */
+
+	if (Ctrl->G.active) {	/* No table output */
+		if (error)
+			GMT_Report (API, GMT_MSG_NORMAL, "Failed to bin the input data\n");
+		else {
+			for (node = 0; node < A.B.n_cells; node++) {
+				if (A.sums[node].n == 0) continue;
+				if (A.sketch) sketch_finish (A.sketch[node], A.delta);	/* Smaller when compressed */
+				A.n_blocks++;
+			}
+			error = state_write (API, Ctrl->G.file, &A.B, A.delta, A.sums, A.sketch);
+		}
+	}
+	else {
+		if (!error && GMT_Set_Columns (API, GMT_OUT, A.n_out, GMT_COL_FIX_NO_TEXT) != GMT_NOERROR) error = GMT_RUNTIME_ERROR;
+		if (!error && GMT_Init_IO (API, GMT_IS_DATASET, GMT_IS_POINT, GMT_OUT, GMT_ADD_DEFAULT, 0, options) != GMT_NOERROR) error = GMT_RUNTIME_ERROR;
+		if (!error && GMT_Begin_IO (API, GMT_IS_DATASET, GMT_OUT, GMT_HEADER_ON) != GMT_NOERROR) error = GMT_RUNTIME_ERROR;
+		if (error)	/* Skip the output */
+			GMT_Report (API, GMT_MSG_NORMAL, "Failed to bin the input data\n");
+		else if (S.n)	/* Process one band of blocks at the time */
+			error = bands_process (&A, &S);
+		else if (A.need_data)	/* Everything fit in memory */
+			error = write_blocks (&A, A.data, A.n_data);
+		else {	/* Sums are already organized by block */
+			t0 = custom_wall_time ();
+			for (node = 0; node < A.B.n_cells; node++) {
+				if (A.sums[node].n == 0) continue;
+				if (A.sketch) sketch_finish (A.sketch[node], A.delta);
+				block_output (Ctrl, &A.B, node, &A.sums[node], NULL, (A.sketch) ? A.sketch[node] : NULL, 0, NULL, 0, A.out);
+				if (A.sketch && A.sketch[node]->merged) {	/* Keep track of the rank errors */
+					n_merged++;
+					if (A.sketch[node]->err > err_max) err_max = A.sketch[node]->err;
+				}
+				GMT_Put_Record (API, GMT_WRITE_DATA, &A.Out);
+				A.n_blocks++;
+			}
+			A.t_output = custom_wall_time () - t0;
+			if (Ctrl->S.active) error = state_write (API, Ctrl->S.file, &A.B, A.delta, A.sums, A.sketch);
+		}
+		if (GMT_End_IO (API, GMT_OUT, 0) != GMT_NOERROR && !error) error = GMT_RUNTIME_ERROR;
+	}
+
+	if (!error) GMT_Report (API, GMT_MSG_VERBOSE, "N read: %" PRIu64 " N used: %" PRIu64 " N blocks filled: %" PRIu64 "\n",
+		A.n_read, A.n_used, A.n_blocks);
+	if (!error && A.sketch && !Ctrl->G.active) GMT_Report (API, GMT_MSG_VERBOSE, "Quantiles are exact in %" PRIu64 " blocks; in the other %" PRIu64 " the largest rank error is %g (-A%g)\n",
+		A.n_blocks - n_merged, n_merged, err_max, Ctrl->A.error);
+
+	if (!error) GMT_Report (API, GMT_MSG_VERBOSE, "Seconds spent binning: %.3f bucketing: %.3f reduction: %.3f output: %.3f\n",
+		A.t_bin, A.t_bucket, A.t_reduce, A.t_output);
+
+	bands_free (&S);
+	if (A.sketch) for (node = 0; node < A.B.n_cells; node++) free (A.sketch[node]);
+	free (A.sketch);
+	free (A.sums);
+	free (A.batch);
+	free (A.data);
+	free (A.spare);
+	for (k = 0; k < A.n_threads; k++) free (A.work[k]);
+	free (A.work);
+	free (A.n_work);
+	free (A.status);
+	free (A.start);
+	free (A.results);
+	return (error);
+}
+
 /* Must free allocated memory before returning */
 #define Free_Options {if (GMT_Destroy_Options (API, &options) != GMT_NOERROR) return (EXIT_FAILURE);}
 #define Bailout(code) {Free_Options; return (code);}
@@ -203,6 +1979,11 @@ int GMT_gmtaverage (void *API, int mode, void *args) {
 	Ctrl = New_Ctrl ();							/* Allocate gmtaverage control structure */
 	if ((error = parse (API, Ctrl, options))) Bailout (EXIT_FAILURE);	/* Parse local option arguments */
 
+	if (use_native (API, Ctrl, options)) {	/* Do the binning ourselves so the input is read only once */
+		error = do_native (API, Ctrl, options);
+		Return (error);
+	}
+
 	/* Determine which value to report and use that to select the correct GMT module */
 	
 	t_ptr = GMT_Find_Option (API, 'T', options);	/* Find the required -T option */
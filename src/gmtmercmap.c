@@ -33,14 +33,46 @@
 #define THIS_MODULE_PURPOSE		"Make a Mercator color map from ETOPO 1, 2, or 5 arc min global relief grids"
 #define THIS_MODULE_KEYS		"CCi,>XO,RG-"
 #define THIS_MODULE_NEEDS		"JR"
-#define THIS_MODULE_OPTIONS		"->BKOPRUVXYcnptxy"
+#define THIS_MODULE_OPTIONS		"->BKOPRUVXYcnpty"
 
 #include "custom_version.h"	/* Must include this to use Custom_version */
+#include "custom_threads.h"
 
 #define MAP_BAR_GAP	"36p"	/* Offset color bar 36 points below map */
 #define MAP_BAR_HEIGHT	"8p"	/* Height of color bar, if used */
 #define MAP_OFFSET	"100p"	/* Start map 100p from paper edge when colorbar is requested */
 #define TOPO_INC	500.0	/* Build cpt in steps of 500 meters */
+#define PYRAMID_INDEX	"relief_index.txt"	/* Name of the tile index in the pyramid directory */
+#define PYRAMID_DPI	300.0	/* Default image resolution used to pick the pyramid level */
+#define SHADE_AZIMUTH	45.0	/* Azimuth of the illumination */
+#define SHADE_NORM	0.8	/* Amplitude of the atan-normalized intensities */
+#define FUSE_ROWS	16	/* Rows in each strip handed to a worker of the fused renderer */
+#define DIST_M_PR_DEG	111194.92664455874	/* Meters per degree on the mean Earth radius */
+#define CACHE_MB	256.0	/* Default memory cap in MB of the grids and CPTs kept between maps */
+#define SERVE_BACKLOG	16	/* Connections that may wait for the server */
+
+#ifndef gmt_mkdir
+#ifdef _WIN32
+#include <direct.h>
+#define gmt_mkdir(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define gmt_mkdir(path) mkdir(path, (mode_t)0777)
+#endif
+#endif
+
+#ifdef _WIN32
+#include <process.h>
+#include <io.h>	/* For _mktemp */
+#define getpid _getpid
+#else
+#include <unistd.h>	/* For getpid and fork */
+#include <signal.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 EXTERN_MSC int GMT_gmtmercmap (void *API, int mode, void *args);
 
@@ -48,9 +80,23 @@ enum enum_script {BASH_MODE = 0,	/* Write Bash script */
 	CSH_MODE,				/* Write C-shell script */
 	DOS_MODE};				/* Write DOS script */
 	
+struct GMTMERCMAP_MAP {	/* One map of the -L list or -Q request */
+	double wesn[4];		/* Region */
+	double width;		/* Map width */
+	char *file;		/* PostScript file to make */
+	char *cpt;		/* Color palette, or NULL for -C */
+	unsigned int scale;	/* 1 to plot the color scale */
+};
+
 /* Control structure for gmtmercmap */
 
 struct GMTMERCMAP_CTRL {
+	struct A {	/* -A<dir>[+b][+d<dpi>] */
+		unsigned int active;
+		unsigned int build;	/* 1 to build the pyramid and exit */
+		double dpi;		/* Image resolution used to pick the level */
+		char *dir;		/* Directory with the tiles and their index */
+	} A;
 	struct C {	/* -C<cptfile> */
 		unsigned int active;
 		char *file;
@@ -63,6 +109,28 @@ struct GMTMERCMAP_CTRL {
 		unsigned int active;
 		int mode;
 	} E;
+	struct F {	/* -F */
+		unsigned int active;
+	} F;
+	struct I {	/* -I<dir>[+b] */
+		unsigned int active;
+		unsigned int build;	/* 1 to fill the cache for the whole pyramid and exit */
+		char *dir;		/* Directory with the cached gradient tiles */
+	} I;
+	struct L {	/* -L<listfile> */
+		unsigned int active;
+		unsigned int n_maps;
+		char *file;		/* The list file */
+		struct GMTMERCMAP_MAP *map;
+	} L;
+	struct M {	/* -M<size> */
+		unsigned int active;
+		double size;		/* Memory cap of the cache in MB */
+	} M;
+	struct Q {	/* -Q[<socket>] */
+		unsigned int active;
+		char *socket;		/* Path of the UNIX socket, or NULL to serve stdin */
+	} Q;
 	struct W {	/* -W<width> */
 		unsigned int active;
 		double width;
@@ -70,6 +138,10 @@ struct GMTMERCMAP_CTRL {
 	struct S {	/* -S */
 		unsigned int active;
 	} S;
+	struct x {	/* -x[[-]<n>] */
+		unsigned int active;
+		unsigned int n_threads;	/* Number of threads for the fused renderer */
+	} x;
 };
 
 static void *New_Ctrl (unsigned int length_unit) {	/* Allocate and initialize a new control structure */
@@ -77,6 +149,9 @@ static void *New_Ctrl (unsigned int length_unit) {	/* Allocate and initialize a
 
 	C = calloc (1, sizeof (struct GMTMERCMAP_CTRL));
 	C->C.file = strdup ("earth");
+	C->A.dpi = PYRAMID_DPI;
+	C->x.n_threads = 1;	/* Default is a single thread */
+	C->M.size = CACHE_MB;
 	C->W.width = (length_unit == 0) ? 25.0 : ((length_unit == 1) ? 10.0 : 700);	/* 25cm (SI/A4) or 10i (US/Letter) or 700pt */
 	return (C);
 }
@@ -84,6 +159,14 @@ static void *New_Ctrl (unsigned int length_unit) {	/* Allocate and initialize a
 static void Free_Ctrl (struct GMTMERCMAP_CTRL *C) {	/* Deallocate control structure */
 	if (!C) return;
 	if (C->C.file) free (C->C.file);
+	if (C->A.dir) free (C->A.dir);
+	if (C->I.dir) free (C->I.dir);
+	if (C->Q.socket) free (C->Q.socket);
+	if (C->L.map) {
+		unsigned int k;
+		for (k = 0; k < C->L.n_maps; k++) free (C->L.map[k].file);
+		free (C->L.map);
+	}
 	free ((void*)C);
 }
 
@@ -97,25 +180,143 @@ static int usage (void *API, unsigned int length_unit, int level) {
 		strcpy (width, "10i");
 	else
 		strcpy (width, "700p");
-	GMT_Message (API, GMT_TIME_NONE, "usage: %s [-C<cpt>] [-D[b|c|d]] [-E1|2|5] [-K] [-O] [-P]\n\t[%s] [-S] [%s] [%s]\n", name, GMT_R2_OPT, GMT_U_OPT, GMT_V_OPT);
-	GMT_Message (API, GMT_TIME_NONE, "\t[-W<width>] [%s] [%s] [%s]\n\t[%s]\n\t[%s] [%s]\n\n", GMT_X_OPT, GMT_Y_OPT, GMT_c_OPT, GMT_n_OPT, GMT_p_OPT, GMT_t_OPT);
+	GMT_Message (API, GMT_TIME_NONE, "usage: %s [-A<dir>[+b][+d<dpi>]] [-C<cpt>] [-D[b|c|d]] [-E1|2|5] [-F] [-I<dir>[+b]]\n\t[-K] [-L<list>] [-M<size>] [-O] [-P] [-Q[<socket>]] [%s] [-S] [%s] [%s]\n", name, GMT_R2_OPT, GMT_U_OPT, GMT_V_OPT);
+	GMT_Message (API, GMT_TIME_NONE, "\t[-W<width>] [%s] [%s] [%s]\n\t[%s]\n\t[%s] [%s] [%s]\n\n", GMT_X_OPT, GMT_Y_OPT, GMT_c_OPT, GMT_n_OPT, GMT_p_OPT, GMT_t_OPT, CUSTOM_x_OPT);
 
 	if (level == GMT_SYNOPSIS) return (GMT_MODULE_SYNOPSIS);
 
 	GMT_Message (API, GMT_TIME_NONE, "\n\tOPTIONS:\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-A Read the relief from the tile pyramid in <dir>, only loading the tiles inside -R at the\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   resolution that matches the map width at <dpi> dots per inch (append +d<dpi>) [%g].\n", PYRAMID_DPI);
+	GMT_Message (API, GMT_TIME_NONE, "\t   Append +b to build the pyramid from the 1, 2, and 5 arc min relief grids and exit.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-C Color palette to use [relief].\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-D Dry-run: Print equivalent GMT commands instead; no map is made.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t   Append b, c, or d for Bourne shell, C-shell, or DOS syntax [Default is Bourne].\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-E Force the ETOPO resolution chosen [auto].\n");
-	GMT_Option (API, "K,O,P");
+	GMT_Message (API, GMT_TIME_NONE, "\t-F Shade and color the relief in one multithreaded pass (see -x) and plot the image, instead of\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   running grdgradient and letting grdimage do the shading and coloring.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-I Keep the illumination gradient of each pyramid tile in <dir> and reuse it for later maps (requires -A).\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   Append +b to compute the gradient of every tile in the pyramid and exit.\n");
+	GMT_Option (API, "K");
+	GMT_Message (API, GMT_TIME_NONE, "\t-L Batch mode: Make one map per record of <list>, given as <west>/<east>/<south>/<north> <width> <psfile>.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   Give - as <width> to use -W.  Grid headers, grids, and CPTs are kept between maps (see -M).\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-M Keep at most <size> MB of relief and intensity grids and CPTs between maps (-L, -Q) [%g].\n", CACHE_MB);
+	GMT_Message (API, GMT_TIME_NONE, "\t   The least recently used are dropped first.  Give -M0 to keep nothing.\n");
+	GMT_Option (API, "O,P");
+	GMT_Message (API, GMT_TIME_NONE, "\t-Q Server mode: Stay resident and make one map per request read from the UNIX socket <socket>,\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   or from stdin if not given.  A request is <west>/<east>/<south>/<north> [<width>|- [<cpt>|- [0|1]]],\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   where the last item turns the color scale off or on [-W, -C, -S].  The reply is OK <bytes> <seconds>\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   followed by the PostScript, or ERROR <message>.  The request quit stops the server.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-R sets the map region [Default is -180/180/-75/75].\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-S plot a color scale beneath the map [none].\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-W Specify the width of your map [%s].\n", width);
-	GMT_Option (API, "U,V,X,c,n,p,t,.");
+	GMT_Option (API, "U,V,X,c,n,p,t");
+	GMT_Message (API, GMT_TIME_NONE, "\t-x Use <n> threads for the rows of the fused renderer (-F) [1].  Give no <n> to use all cores,\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   or -<n> to use all but <n> cores.  With -L, <n> worker processes instead share the maps.\n");
+	GMT_Option (API, ".");
 
 	return (GMT_MODULE_USAGE);
 }
 
+static unsigned int get_pyramid (void *API, char *arg, struct GMTMERCMAP_CTRL *Ctrl)
+{	/* Decode -A<dir>[+b][+d<dpi>] */
+	char *c = NULL, *m = NULL;
+
+	if ((c = strchr (arg, '+'))) {	/* Process the modifiers and chop them off */
+		for (m = c; m && *m == '+'; m = strchr (&m[1], '+')) {
+			switch (m[1]) {
+				case 'b': Ctrl->A.build = 1; break;
+				case 'd': Ctrl->A.dpi = atof (&m[2]); break;
+				default:
+					GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -A: Unrecognized modifier +%c\n", m[1]);
+					return (1);
+			}
+		}
+		c[0] = '\0';
+	}
+	if (arg[0]) Ctrl->A.dir = strdup (arg);
+	if (c) c[0] = '+';	/* Restore the argument */
+	if (Ctrl->A.dir == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -A: Must give the pyramid directory\n");
+		return (1);
+	}
+	if (Ctrl->A.dpi <= 0.0) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -A: The dpi must be positive\n");
+		return (1);
+	}
+	return (0);
+}
+
+static unsigned int get_cache (void *API, char *arg, struct GMTMERCMAP_CTRL *Ctrl)
+{	/* Decode -I<dir>[+b] */
+	char *c = NULL;
+
+	if ((c = strstr (arg, "+b"))) {	/* Chop off the modifier */
+		Ctrl->I.build = 1;
+		c[0] = '\0';
+	}
+	if (arg[0]) Ctrl->I.dir = strdup (arg);
+	if (c) c[0] = '+';	/* Restore the argument */
+	if (Ctrl->I.dir == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -I: Must give the cache directory\n");
+		return (1);
+	}
+	return (0);
+}
+
+static unsigned int get_maps (void *API, char *arg, struct GMTMERCMAP_CTRL *Ctrl)
+{	/* Decode -L<listfile>: One <west>/<east>/<south>/<north> <width> <psfile> per record; blank records and those starting with # are skipped */
+	unsigned int n_errors = 0, line = 0;
+	size_t n_alloc = 0;
+	char record[GMT_BUFSIZ] = {""}, width[GMT_LEN64], file[GMT_BUFSIZ], *c = NULL;
+	FILE *fp = NULL;
+	struct GMTMERCMAP_MAP *M = NULL;
+
+	if ((fp = fopen (arg, "r")) == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -L: Cannot open list file %s\n", arg);
+		return (1);
+	}
+	while (fgets (record, GMT_BUFSIZ, fp)) {
+		line++;
+		for (c = record; *c == ' ' || *c == '\t'; c++);	/* Skip leading whitespace */
+		if (*c == '\0' || *c == '\n' || *c == '\r' || *c == '#') continue;
+		if (Ctrl->L.n_maps == n_alloc) {
+			n_alloc = (n_alloc) ? 2 * n_alloc : 256;
+			if ((M = realloc (Ctrl->L.map, n_alloc * sizeof (struct GMTMERCMAP_MAP))) == NULL) {
+				GMT_Report (API, GMT_MSG_NORMAL, "Unable to allocate memory for the list of maps\n");
+				n_errors++;
+				break;
+			}
+			Ctrl->L.map = M;
+		}
+		M = &Ctrl->L.map[Ctrl->L.n_maps];
+		if (sscanf (c, "%lf/%lf/%lf/%lf %63s %s", &M->wesn[GMT_XLO], &M->wesn[GMT_XHI], &M->wesn[GMT_YLO], &M->wesn[GMT_YHI], width, file) != 6 || strlen (width) == GMT_LEN64 - 1) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -L: Record %u of %s is not <west>/<east>/<south>/<north> <width> <psfile>\n", line, arg);
+			n_errors++;
+			continue;
+		}
+		if (!strcmp (width, "-"))
+			M->width = Ctrl->W.width;
+		else if (GMT_Get_Value (API, width, &M->width) != 1)
+			M->width = 0.0;	/* Rejected below */
+		if (M->wesn[GMT_XLO] >= M->wesn[GMT_XHI] || M->wesn[GMT_YLO] >= M->wesn[GMT_YHI] || M->width <= 0.0) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -L: Record %u of %s needs <west> < <east>, <south> < <north>, and a positive <width>\n", line, arg);
+			n_errors++;
+			continue;
+		}
+		M->file = strdup (file);
+		M->cpt = NULL;
+		M->scale = Ctrl->S.active;
+		Ctrl->L.n_maps++;
+	}
+	fclose (fp);
+	if (Ctrl->L.n_maps == 0 && n_errors == 0) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -L: No maps in list file %s\n", arg);
+		n_errors++;
+	}
+	return (n_errors);
+}
+
 static int parse (void *API, struct GMTMERCMAP_CTRL *Ctrl, struct GMT_OPTION *options)
 {
 	/* This parses the options provided to gmtmercmap and sets parameters in Ctrl.
@@ -134,6 +335,10 @@ static int parse (void *API, struct GMTMERCMAP_CTRL *Ctrl, struct GMT_OPTION *op
 		switch (opt->option) {
 			/* Processes program-specific parameters */
 
+			case 'A':	/* Relief tile pyramid */
+				Ctrl->A.active = 1;
+				n_errors += get_pyramid (API, opt->arg, Ctrl);
+				break;
 			case 'C':	/* CPT master file */
 				Ctrl->C.active = 1;
 				free (Ctrl->C.file);
@@ -157,6 +362,25 @@ static int parse (void *API, struct GMTMERCMAP_CTRL *Ctrl, struct GMT_OPTION *op
 					default:   n_errors++; break;
 				}
 				break;
+			case 'F':	/* Fused shading and coloring */
+				Ctrl->F.active = 1;
+				break;
+			case 'I':	/* Cache of illumination gradients */
+				Ctrl->I.active = 1;
+				n_errors += get_cache (API, opt->arg, Ctrl);
+				break;
+			case 'L':	/* List of maps to make */
+				Ctrl->L.active = 1;
+				Ctrl->L.file = opt->arg;
+				break;
+			case 'M':	/* Memory cap of the cache */
+				Ctrl->M.active = 1;
+				Ctrl->M.size = atof (opt->arg);
+				break;
+			case 'Q':	/* Server mode */
+				Ctrl->Q.active = 1;
+				if (opt->arg[0]) Ctrl->Q.socket = strdup (opt->arg);
+				break;
 			case 'W':	/* Map width */
 				Ctrl->W.active = 1;
 				GMT_Get_Value (API, opt->arg, &Ctrl->W.width);
@@ -164,6 +388,10 @@ static int parse (void *API, struct GMTMERCMAP_CTRL *Ctrl, struct GMT_OPTION *op
 			case 'S':	/* Draw scale beneath map */
 				Ctrl->S.active = 1;
 				break;
+			case 'x':	/* Number of threads */
+				Ctrl->x.active = 1;
+				Ctrl->x.n_threads = custom_get_n_threads (opt->arg);
+				break;
 
 			default:	/* Report bad options */
 				GMT_Report (API, GMT_MSG_NORMAL, "Syntax error: Unrecognized argument %c%s\n", opt->option, opt->arg);
@@ -171,6 +399,29 @@ static int parse (void *API, struct GMTMERCMAP_CTRL *Ctrl, struct GMT_OPTION *op
 				break;
 		}
 	}
+	if (Ctrl->L.active) n_errors += get_maps (API, Ctrl->L.file, Ctrl);	/* Once -W is known */
+	if (Ctrl->L.active && Ctrl->D.active) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -L: Cannot be combined with -D\n");
+		n_errors++;
+	}
+	if (Ctrl->Q.active && (Ctrl->L.active || Ctrl->D.active)) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -Q: Cannot be combined with -D or -L\n");
+		n_errors++;
+	}
+#ifdef _WIN32
+	if (Ctrl->Q.socket) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -Q: UNIX sockets are not available; give no socket to serve stdin\n");
+		n_errors++;
+	}
+#endif
+	if (Ctrl->M.size < 0.0) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -M: The size cannot be negative\n");
+		n_errors++;
+	}
+	if (Ctrl->I.active && !Ctrl->A.active) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Syntax error -I: Requires the tile pyramid given with -A\n");
+		n_errors++;
+	}
 
 	return (n_errors);
 }
@@ -204,6 +455,959 @@ void place_var (int mode, char *name, unsigned int end)
 	if (end) putchar ('\n');
 }
 
+static int pyramid_min[3] = {1, 2, 5};		/* Levels of the pyramid in arc minutes */
+static double pyramid_tile[3] = {10.0, 20.0, 45.0};	/* Tile size in degrees per level, 600 x 600, 600 x 600, and 540 x 540 nodes */
+
+static int build_pyramid (void *API, struct GMTMERCMAP_CTRL *Ctrl)
+{	/* Cut the 1, 2, and 5 arc min global relief grids into tiles of fixed size and list them in the index.
+	 * Each tile is read as a subset of the global grid and written to its own grid file */
+	unsigned int level, n_tiles = 0;
+	double lon, lat, wesn[4];
+	char file[GMT_LEN256], tile[GMT_LEN64], path[PATH_MAX];
+	FILE *fp = NULL;
+	struct GMT_GRID *G = NULL;
+
+	gmt_mkdir (Ctrl->A.dir);	/* Fails harmlessly if it exists; then fopen below tells us if we can write there */
+	snprintf (path, PATH_MAX, "%s/%s", Ctrl->A.dir, PYRAMID_INDEX);
+	if ((fp = fopen (path, "w")) == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to create the pyramid index %s\n", path);
+		return (EXIT_FAILURE);
+	}
+	fprintf (fp, "# gmtmercmap relief pyramid: arc_min west east south north file\n");
+	for (level = 0; level < 3; level++) {
+		sprintf (file, "@earth_relief_%2.2dm", pyramid_min[level]);
+		GMT_Report (API, GMT_MSG_VERBOSE, "Cut %s into %g x %g degree tiles\n", file, pyramid_tile[level], pyramid_tile[level]);
+		for (lat = -90.0; lat < 90.0; lat += pyramid_tile[level]) {
+			for (lon = -180.0; lon < 180.0; lon += pyramid_tile[level]) {
+				wesn[GMT_XLO] = lon;	wesn[GMT_XHI] = lon + pyramid_tile[level];
+				wesn[GMT_YLO] = lat;	wesn[GMT_YHI] = lat + pyramid_tile[level];
+				if ((G = GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_ALL, wesn, file, NULL)) == NULL) {
+					fclose (fp);
+					return (EXIT_FAILURE);
+				}
+				sprintf (tile, "r%2.2dm_%c%2.2d%c%3.3d.nc", pyramid_min[level], (lat < 0.0) ? 'S' : 'N', (int)fabs (lat), (lon < 0.0) ? 'W' : 'E', (int)fabs (lon));
+				snprintf (path, PATH_MAX, "%s/%s", Ctrl->A.dir, tile);
+				if (GMT_Write_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_ALL, NULL, path, G) != GMT_NOERROR) {
+					fclose (fp);
+					return (EXIT_FAILURE);
+				}
+				fprintf (fp, "%d\t%g\t%g\t%g\t%g\t%s\n", pyramid_min[level], wesn[GMT_XLO], wesn[GMT_XHI], wesn[GMT_YLO], wesn[GMT_YHI], tile);
+				GMT_Destroy_Data (API, &G);
+				n_tiles++;
+			}
+		}
+	}
+	fclose (fp);
+	GMT_Report (API, GMT_MSG_VERBOSE, "Wrote %u tiles and the index %s/%s\n", n_tiles, Ctrl->A.dir, PYRAMID_INDEX);
+	return (GMT_NOERROR);
+}
+
+static int pyramid_level (struct GMTMERCMAP_CTRL *Ctrl, double *wesn, double width, unsigned int length_unit)
+{	/* Return the coarsest level with at least one node per image pixel across the map, or the finest level */
+	static double to_inch[3] = {1.0 / 2.54, 1.0, 1.0 / 72.0};
+	int level;
+	double pixel = (wesn[GMT_XHI] - wesn[GMT_XLO]) / (width * to_inch[length_unit] * Ctrl->A.dpi);	/* Degrees per pixel */
+
+	for (level = 2; level > 0 && pyramid_min[level] / 60.0 > pixel; level--);
+	return (pyramid_min[level]);
+}
+
+static void paste_grid (void *API, struct GMT_GRID *To, struct GMT_GRID *From, double shift)
+{	/* Copy the nodes of From that lie inside To, with From moved shift degrees in longitude.  Both grids share the increments */
+	unsigned int row, col0, col1;
+	int r0, c0;
+
+	r0 = (int)lrint ((To->header->wesn[GMT_YHI] - From->header->wesn[GMT_YHI]) / To->header->inc[GMT_Y]);	/* Node of To at the upper left corner of From */
+	c0 = (int)lrint ((From->header->wesn[GMT_XLO] + shift - To->header->wesn[GMT_XLO]) / To->header->inc[GMT_X]);
+	col0 = (c0 < 0) ? -c0 : 0;	/* Range of From columns inside To */
+	col1 = MIN ((int)From->header->nx, (int)To->header->nx - c0);
+	if (col1 <= col0) return;
+	for (row = 0; row < From->header->ny; row++) {
+		if (r0 + (int)row < 0 || r0 + (int)row >= (int)To->header->ny) continue;
+		memcpy (&To->data[GMT_Get_Index (API, To->header, r0 + row, c0 + col0)], &From->data[GMT_Get_Index (API, From->header, row, col0)], (col1 - col0) * sizeof (gmt_grdfloat));
+	}
+}
+
+static int gradient_tile (void *API, struct GMTMERCMAP_CTRL *Ctrl, int min, double *wesn_t, char *tile, char *path);
+
+static struct GMT_GRID *read_pyramid (void *API, struct GMTMERCMAP_CTRL *Ctrl, double *wesn, int min, unsigned int gradient)
+{	/* Assemble the relief for the region from the tiles at the level of min arc minutes, or with gradient set its
+	 * illumination gradient from the cache.  The region is widened to whole grid increments and only the part of
+	 * each tile inside it is read.  Tiles are also tried 360 degrees east and west so regions crossing the dateline
+	 * work with either longitude convention.  Nodes no tile covers are left as NaN rather than 0 m */
+	unsigned int row, col, n_tiles = 0, k, reg = GMT_GRID_NODE_REG, error = 0;
+	int level;
+	uint64_t ij, n_nan = 0;
+	double inc[2], box[4], sub[4], shift, wesn_t[4];
+	char record[GMT_BUFSIZ], tile[GMT_LEN256], path[PATH_MAX];
+	FILE *fp = NULL;
+	struct GMT_GRID *G = NULL, *T = NULL;
+
+	snprintf (path, PATH_MAX, "%s/%s", Ctrl->A.dir, PYRAMID_INDEX);
+	if ((fp = fopen (path, "r")) == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to open the pyramid index %s\n", path);
+		return (NULL);
+	}
+	inc[GMT_X] = inc[GMT_Y] = min / 60.0;
+	box[GMT_XLO] = floor (wesn[GMT_XLO] / inc[GMT_X] + GMT_CONV8_LIMIT) * inc[GMT_X];	/* Snap the region outward to whole increments */
+	box[GMT_XHI] = ceil  (wesn[GMT_XHI] / inc[GMT_X] - GMT_CONV8_LIMIT) * inc[GMT_X];
+	box[GMT_YLO] = MAX (-90.0, floor (wesn[GMT_YLO] / inc[GMT_Y] + GMT_CONV8_LIMIT) * inc[GMT_Y]);
+	box[GMT_YHI] = MIN (+90.0, ceil  (wesn[GMT_YHI] / inc[GMT_Y] - GMT_CONV8_LIMIT) * inc[GMT_Y]);
+	while (!error && fgets (record, GMT_BUFSIZ, fp)) {
+		if (record[0] == '#' || sscanf (record, "%d %lf %lf %lf %lf %255s", &level, &wesn_t[GMT_XLO], &wesn_t[GMT_XHI], &wesn_t[GMT_YLO], &wesn_t[GMT_YHI], tile) != 6) continue;
+		if (level != min || wesn_t[GMT_YLO] >= box[GMT_YHI] || wesn_t[GMT_YHI] <= box[GMT_YLO]) continue;
+		for (k = 0, shift = -360.0; !error && k < 3; k++, shift += 360.0) {	/* The tile as is and moved a turn either way */
+			if (wesn_t[GMT_XLO] + shift >= box[GMT_XHI] || wesn_t[GMT_XHI] + shift <= box[GMT_XLO]) continue;
+			sub[GMT_XLO] = MAX (box[GMT_XLO], wesn_t[GMT_XLO] + shift) - shift;	/* Part of the tile inside the region, in tile coordinates */
+			sub[GMT_XHI] = MIN (box[GMT_XHI], wesn_t[GMT_XHI] + shift) - shift;
+			sub[GMT_YLO] = MAX (box[GMT_YLO], wesn_t[GMT_YLO]);
+			sub[GMT_YHI] = MIN (box[GMT_YHI], wesn_t[GMT_YHI]);
+			if (gradient)	/* Get the cached gradient of this tile, computing it first if needed */
+				error = gradient_tile (API, Ctrl, min, wesn_t, tile, path);
+			else
+				snprintf (path, PATH_MAX, "%s/%s", Ctrl->A.dir, tile);
+			if (error || (T = GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_ALL, sub, path, NULL)) == NULL) {
+				error = 1;
+				continue;
+			}
+			if (G == NULL) {	/* Now we know the registration of the tiles */
+				reg = T->header->registration;
+				if ((G = GMT_Create_Data (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_GRID_ALL, NULL, box, inc, reg, GMT_NOTSET, NULL)) == NULL)
+					error = 1;
+				else {	/* The new grid is all zeros, which would pass for sea level where no tile lands */
+					for (row = 0; row < G->header->ny; row++)
+						for (col = 0, ij = GMT_Get_Index (API, G->header, row, 0); col < G->header->nx; col++, ij++) G->data[ij] = NAN;
+				}
+			}
+			if (!error) {
+				paste_grid (API, G, T, shift);	/* Paste the rows into place */
+				n_tiles++;
+			}
+			GMT_Destroy_Data (API, &T);
+		}
+	}
+	fclose (fp);
+	if (error) {
+		if (G) GMT_Destroy_Data (API, &G);
+		return (NULL);
+	}
+	if (G == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "No %d arc min tiles in %s cover the region\n", min, Ctrl->A.dir);
+		return (NULL);
+	}
+	G->header->z_min = DBL_MAX;	G->header->z_max = -DBL_MAX;	/* Update the range for the CPT */
+	for (row = 0; row < G->header->ny; row++) {
+		for (col = 0, ij = GMT_Get_Index (API, G->header, row, 0); col < G->header->nx; col++, ij++) {
+			if (isnan (G->data[ij])) {
+				n_nan++;
+				continue;
+			}
+			if (G->data[ij] < G->header->z_min) G->header->z_min = G->data[ij];
+			if (G->data[ij] > G->header->z_max) G->header->z_max = G->data[ij];
+		}
+	}
+	if (n_nan) GMT_Report (API, GMT_MSG_NORMAL, "%" PRIu64 " of %" PRIu64 " nodes have no data from the %d arc min tiles in %s and are set to NaN\n", n_nan, (uint64_t)G->header->nx * G->header->ny, min, Ctrl->A.dir);
+	GMT_Report (API, GMT_MSG_VERBOSE, "Assembled %u x %u nodes from %u tiles at %d arc min\n", G->header->nx, G->header->ny, n_tiles, min);
+	return (G);
+}
+
+static int gradient_tile (void *API, struct GMTMERCMAP_CTRL *Ctrl, int min, double *wesn_t, char *tile, char *path)
+{	/* Set path to the cached gradient of this relief tile, computing it first if it is not there yet.  We keep the
+	 * gradient before -Nt normalization since that depends on the statistics of each map.  It is found for the tile
+	 * widened by one node on all sides so the derivatives along the tile edges use the real neighbours, and only the
+	 * tile itself is kept.  The file is written under a temporary name and then renamed so that other processes
+	 * sharing the cache never see a partial tile */
+	unsigned int z_open = 0, i_open = 0;
+	int error = GMT_NOERROR;
+	double halo[4], inc = min / 60.0;
+	char z_file[GMT_STR16] = {""}, i_file[GMT_STR16] = {""}, cmd[GMT_BUFSIZ], tmp[PATH_MAX];
+	FILE *fp = NULL;
+	struct GMT_GRID *Z = NULL, *D = NULL, *T = NULL;
+
+	snprintf (path, PATH_MAX, "%s/a%g_%s", Ctrl->I.dir, SHADE_AZIMUTH, tile);	/* Azimuth, level and tile id make the key */
+	if ((fp = fopen (path, "r"))) {	/* Cache hit */
+		fclose (fp);
+		return (GMT_NOERROR);
+	}
+	GMT_Report (API, GMT_MSG_VERBOSE, "Compute the illumination gradient of tile %s\n", tile);
+	halo[GMT_XLO] = wesn_t[GMT_XLO] - inc;	halo[GMT_XHI] = wesn_t[GMT_XHI] + inc;
+	halo[GMT_YLO] = wesn_t[GMT_YLO] - inc;	halo[GMT_YHI] = wesn_t[GMT_YHI] + inc;	/* Clipped at the poles by read_pyramid */
+	if ((Z = read_pyramid (API, Ctrl, halo, min, 0)) == NULL) return (EXIT_FAILURE);
+	if (GMT_Open_VirtualFile (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_IN,     Z, z_file) == GMT_NOERROR) z_open = 1;
+	if (z_open && GMT_Open_VirtualFile (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_OUT, NULL, i_file) == GMT_NOERROR) i_open = 1;
+	sprintf (cmd, "%s -G%s -A%g -fg", z_file, i_file, SHADE_AZIMUTH);	/* The grdgradient command line, without -N */
+	if (!i_open || GMT_Call_Module (API, "grdgradient", GMT_MODULE_CMD, cmd) != GMT_NOERROR || (D = GMT_Read_VirtualFile (API, i_file)) == NULL) error = EXIT_FAILURE;
+	if (z_open && GMT_Close_VirtualFile (API, z_file) != GMT_NOERROR) error = EXIT_FAILURE;
+	if (i_open && GMT_Close_VirtualFile (API, i_file) != GMT_NOERROR) error = EXIT_FAILURE;
+	if (!error && (T = GMT_Create_Data (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_GRID_ALL, NULL, wesn_t, D->header->inc, D->header->registration, GMT_NOTSET, NULL)) == NULL) error = EXIT_FAILURE;
+	if (!error) {
+		paste_grid (API, T, D, 0.0);	/* Drop the halo */
+		snprintf (tmp, PATH_MAX, "%s/tmp%d_%s", Ctrl->I.dir, (int)getpid (), tile);
+		if (GMT_Write_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_ALL, NULL, tmp, T) != GMT_NOERROR) {
+			remove (tmp);	/* Do not leave a partial tile behind */
+			error = EXIT_FAILURE;
+		}
+		else if (rename (tmp, path)) {	/* Not allowed on some systems if another process put it there first */
+			remove (tmp);
+			if ((fp = fopen (path, "r")) == NULL) {
+				GMT_Report (API, GMT_MSG_NORMAL, "Unable to place %s in the cache\n", path);
+				error = EXIT_FAILURE;
+			}
+			else
+				fclose (fp);
+		}
+	}
+	if (T) GMT_Destroy_Data (API, &T);
+	if (D) GMT_Destroy_Data (API, &D);
+	GMT_Destroy_Data (API, &Z);
+	return (error);
+}
+
+static int fill_gradient_cache (void *API, struct GMTMERCMAP_CTRL *Ctrl)
+{	/* Make sure the cache holds the gradient of every tile in the pyramid */
+	unsigned int n_tiles = 0;
+	int level;
+	double wesn_t[4];
+	char record[GMT_BUFSIZ], tile[GMT_LEN256], path[PATH_MAX];
+	FILE *fp = NULL;
+
+	snprintf (path, PATH_MAX, "%s/%s", Ctrl->A.dir, PYRAMID_INDEX);
+	if ((fp = fopen (path, "r")) == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to open the pyramid index %s\n", path);
+		return (EXIT_FAILURE);
+	}
+	while (fgets (record, GMT_BUFSIZ, fp)) {
+		if (record[0] == '#' || sscanf (record, "%d %lf %lf %lf %lf %255s", &level, &wesn_t[GMT_XLO], &wesn_t[GMT_XHI], &wesn_t[GMT_YLO], &wesn_t[GMT_YHI], tile) != 6) continue;
+		if (gradient_tile (API, Ctrl, level, wesn_t, tile, path)) {
+			fclose (fp);
+			return (EXIT_FAILURE);
+		}
+		n_tiles++;
+	}
+	fclose (fp);
+	GMT_Report (API, GMT_MSG_VERBOSE, "The gradients of all %u tiles are in %s\n", n_tiles, Ctrl->I.dir);
+	return (GMT_NOERROR);
+}
+
+static void normalize_gradient (void *API, struct GMT_GRID *I, double amp)
+{	/* Turn the gradients into intensities like grdgradient -Nt<amp>: (2 amp / pi) * atan ((g - mean) / sigma),
+	 * with sigma the rms deviation from the mean */
+	unsigned int row, col;
+	uint64_t ij, n = 0;
+	double sum = 0.0, sum2 = 0.0, mean, sigma, scale = 2.0 * amp / M_PI;
+
+	for (row = 0; row < I->header->ny; row++) {
+		for (col = 0, ij = GMT_Get_Index (API, I->header, row, 0); col < I->header->nx; col++, ij++) {
+			if (isnan (I->data[ij])) continue;
+			sum += I->data[ij];
+			n++;
+		}
+	}
+	if (n == 0) return;
+	mean = sum / n;
+	for (row = 0; row < I->header->ny; row++) {
+		for (col = 0, ij = GMT_Get_Index (API, I->header, row, 0); col < I->header->nx; col++, ij++)
+			if (!isnan (I->data[ij])) sum2 += (I->data[ij] - mean) * (I->data[ij] - mean);
+	}
+	if ((sigma = sqrt (sum2 / n)) == 0.0) sigma = 1.0;	/* Flat region: all intensities become zero */
+	I->header->z_min = DBL_MAX;	I->header->z_max = -DBL_MAX;
+	for (row = 0; row < I->header->ny; row++) {
+		for (col = 0, ij = GMT_Get_Index (API, I->header, row, 0); col < I->header->nx; col++, ij++) {
+			if (isnan (I->data[ij])) continue;
+			I->data[ij] = (gmt_grdfloat)(scale * atan ((I->data[ij] - mean) / sigma));
+			if (I->data[ij] < I->header->z_min) I->header->z_min = I->data[ij];
+			if (I->data[ij] > I->header->z_max) I->header->z_max = I->data[ij];
+		}
+	}
+}
+
+struct GMTMERCMAP_FUSE {	/* Shared by the workers of the fused renderer */
+	unsigned int nx, ny, period;	/* Nodes per row and column, and columns per turn if global [0] */
+	unsigned int n_threads;
+	unsigned int pass;	/* 0 to sum the gradients, 1 to sum their squared deviations from the mean */
+	uint64_t z0, g0, r0;	/* Index of the first node in the relief, gradient, and image */
+	uint64_t z_mx, g_mx, r_mx;	/* Row strides of the three arrays */
+	uint64_t band;		/* Distance between the bands of the image */
+	double north, dlat;	/* Latitude of the first row and the row spacing */
+	double dx, dy;		/* Node spacing in meters, dx at the Equator */
+	double sin_az, cos_az;	/* Direction of the illumination */
+	double mean, sigma, scale;	/* -Nt normalization */
+	double hsv[4];		/* COLOR_HSV_MAX_S, COLOR_HSV_MAX_V, COLOR_HSV_MIN_S, COLOR_HSV_MIN_V */
+	double *sum;		/* Count, sum, and sum of squared deviations of the gradients per strip of FUSE_ROWS rows */
+	gmt_grdfloat *z;	/* The relief */
+	gmt_grdfloat *g;	/* Cached gradients (-I) or NULL to compute them here */
+	unsigned char *rgb;	/* The image */
+	struct GMT_PALETTE *P;
+};
+
+static double fuse_gradient (struct GMTMERCMAP_FUSE *F, unsigned int row, unsigned int col, double cos_lat)
+{	/* Gradient in the direction of the illumination at this node, like grdgradient -A<azimuth> -fg.  Central
+	 * differences inside, one-sided differences along the edges, and wrapping around for global grids */
+	int cl = (int)col - 1, cr = (int)col + 1, rn = (int)row - 1, rs = (int)row + 1;
+	double dzdx = 0.0, dzdy = 0.0;
+	gmt_grdfloat *z = &F->z[F->z0 + row * F->z_mx];
+
+	if (F->g) return (F->g[F->g0 + row * F->g_mx + col]);
+	if (cl < 0) cl = (F->period) ? cl + (int)F->period : 0;
+	if (cr >= (int)F->nx) cr = (F->period) ? cr - (int)F->period : (int)F->nx - 1;
+	if (rn < 0) rn = 0;
+	if (rs >= (int)F->ny) rs = (int)F->ny - 1;
+	if (cl != cr && cos_lat > GMT_CONV8_LIMIT)	/* No east-west derivative at the poles */
+		dzdx = (z[cr] - z[cl]) / ((F->period ? 2 : cr - cl) * F->dx * cos_lat);
+	if (rn != rs)
+		dzdy = (F->z[F->z0 + rn * F->z_mx + col] - F->z[F->z0 + rs * F->z_mx + col]) / ((rs - rn) * F->dy);
+	return (-(dzdx * F->sin_az + dzdy * F->cos_az));	/* Positive on slopes facing the light */
+}
+
+static void fuse_stats (void *arg, uint64_t start, uint64_t end, unsigned int thread_id)
+{	/* Count and sum the gradients of the rows [start, end), or with F->pass = 1 sum their squared deviations from
+	 * F->mean.  The sums are kept per strip rather than per thread so that adding them up in strip order gives the
+	 * same statistics however the strips were shared out */
+	struct GMTMERCMAP_FUSE *F = arg;
+	unsigned int row, col;
+	double g, cos_lat, *sum = NULL;
+
+	for (row = (unsigned int)start; row < end; row++) {
+		sum = &F->sum[3 * (row / FUSE_ROWS)];
+		cos_lat = cos ((F->north - row * F->dlat) * M_PI / 180.0);
+		for (col = 0; col < F->nx; col++) {
+			if (isnan (g = fuse_gradient (F, row, col, cos_lat))) continue;
+			if (F->pass)
+				sum[2] += (g - F->mean) * (g - F->mean);
+			else {
+				sum[0] += 1.0;	sum[1] += g;
+			}
+		}
+	}
+}
+
+static void fuse_color (struct GMT_PALETTE *P, double z, double rgb[])
+{	/* Look up the color of z in the CPT, interpolating within the slice as gmt_get_rgb_from_z does for RGB palettes */
+	unsigned int lo = 0, hi = P->n_colors - 1, k, i;
+	double rel;
+	const double *c = NULL;
+
+	if (isnan (z)) c = P->bfn[GMT_NAN].rgb;
+	else if (z < P->data[0].z_low) c = P->bfn[GMT_BGD].rgb;
+	else if (z > P->data[hi].z_high) c = P->bfn[GMT_FGD].rgb;
+	if (c) {
+		for (i = 0; i < 3; i++) rgb[i] = c[i];
+		return;
+	}
+	while (lo < hi) {	/* Binary search for the slice with z_low <= z < z_high */
+		k = (lo + hi + 1) / 2;
+		if (z < P->data[k].z_low) hi = k - 1; else lo = k;
+	}
+	rel = (P->data[lo].z_high > P->data[lo].z_low) ? (z - P->data[lo].z_low) / (P->data[lo].z_high - P->data[lo].z_low) : 0.0;
+	for (i = 0; i < 3; i++) rgb[i] = P->data[lo].rgb_low[i] + rel * P->data[lo].rgb_diff[i];
+}
+
+static void fuse_illuminate (double *hsv_lim, double intensity, double rgb[])
+{	/* Lighten or darken the color in HSV space, as gmt_illuminate does */
+	int i;
+	double di, f, p, q, t, h, s, v, max_c, min_c, diff;
+
+	if (isnan (intensity) || intensity == 0.0) return;
+	if (fabs (intensity) > 1.0) intensity = copysign (1.0, intensity);
+	max_c = MAX (MAX (rgb[0], rgb[1]), rgb[2]);	/* To HSV */
+	min_c = MIN (MIN (rgb[0], rgb[1]), rgb[2]);
+	diff = max_c - min_c;
+	h = 0.0;	s = (max_c == 0.0) ? 0.0 : diff / max_c;	v = max_c;
+	if (s != 0.0) {
+		if (rgb[0] == max_c) h = ((max_c - rgb[2]) - (max_c - rgb[1])) / diff;
+		else if (rgb[1] == max_c) h = 2.0 + ((max_c - rgb[0]) - (max_c - rgb[2])) / diff;
+		else h = 4.0 + ((max_c - rgb[1]) - (max_c - rgb[0])) / diff;
+		h *= 60.0;
+		if (h < 0.0) h += 360.0;
+	}
+	if (intensity > 0.0) {	/* Lighten the color */
+		di = 1.0 - intensity;
+		if (s != 0.0) s = di * s + intensity * hsv_lim[0];
+		v = di * v + intensity * hsv_lim[1];
+	}
+	else {	/* Darken the color */
+		di = 1.0 + intensity;
+		if (s != 0.0) s = di * s - intensity * hsv_lim[2];
+		v = di * v - intensity * hsv_lim[3];
+	}
+	s = MAX (0.0, MIN (1.0, s));	v = MAX (0.0, MIN (1.0, v));
+	if (s == 0.0) {	/* Back to RGB */
+		rgb[0] = rgb[1] = rgb[2] = v;
+		return;
+	}
+	while (h >= 360.0) h -= 360.0;
+	h /= 60.0;
+	i = (int)floor (h);
+	f = h - i;
+	p = v * (1.0 - s);
+	q = v * (1.0 - s * f);
+	t = v * (1.0 - s * (1.0 - f));
+	switch (i) {
+		case 0:  rgb[0] = v; rgb[1] = t; rgb[2] = p; break;
+		case 1:  rgb[0] = q; rgb[1] = v; rgb[2] = p; break;
+		case 2:  rgb[0] = p; rgb[1] = v; rgb[2] = t; break;
+		case 3:  rgb[0] = p; rgb[1] = q; rgb[2] = v; break;
+		case 4:  rgb[0] = t; rgb[1] = p; rgb[2] = v; break;
+		default: rgb[0] = v; rgb[1] = p; rgb[2] = q; break;
+	}
+}
+
+static void fuse_rows (void *arg, uint64_t start, uint64_t end, unsigned int thread_id)
+{	/* Second pass: shade and color the rows [start, end) and write them to the image */
+	struct GMTMERCMAP_FUSE *F = arg;
+	unsigned int row, col, b;
+	uint64_t ij;
+	double cos_lat, intensity, rgb[3];
+
+	for (row = (unsigned int)start; row < end; row++) {
+		cos_lat = cos ((F->north - row * F->dlat) * M_PI / 180.0);
+		for (col = 0; col < F->nx; col++) {
+			intensity = F->scale * atan ((fuse_gradient (F, row, col, cos_lat) - F->mean) / F->sigma);
+			fuse_color (F->P, F->z[F->z0 + row * F->z_mx + col], rgb);
+			fuse_illuminate (F->hsv, intensity, rgb);
+			ij = F->r0 + row * F->r_mx + col;
+			for (b = 0; b < 3; b++) F->rgb[ij + b * F->band] = (unsigned char)lrint (255.0 * rgb[b]);
+		}
+	}
+}
+
+static struct GMT_IMAGE *fused_image (void *API, struct GMTMERCMAP_CTRL *Ctrl, struct GMT_GRID *G, struct GMT_GRID *D, struct GMT_PALETTE *P)
+{	/* Compute the illumination, look up the colors, and shade them in one pass over strips of rows, giving the
+	 * image grdimage would have made from G, the -Nt0.8 -A45 intensities, and P.  Two passes first collect the
+	 * mean of the gradients and then their rms deviation from it, as in normalize_gradient, so no intensity grid is
+	 * kept.  D holds the cached gradients of -I, or is NULL to find them from G as we go */
+	unsigned int k, n_strips;
+	int error;
+	uint64_t dim[3] = {0, 0, 3};	/* Three bands */
+	double n = 0.0, sum = 0.0, sum2 = 0.0;
+	char value[GMT_LEN64];
+	static char *hsv_key[4] = {"COLOR_HSV_MAX_S", "COLOR_HSV_MAX_V", "COLOR_HSV_MIN_S", "COLOR_HSV_MIN_V"};
+	struct GMTMERCMAP_FUSE F;
+	struct GMT_IMAGE *R = NULL;
+
+	if ((R = GMT_Create_Data (API, GMT_IS_IMAGE, GMT_IS_SURFACE, GMT_CONTAINER_AND_DATA, dim, G->header->wesn, G->header->inc, G->header->registration, 0, NULL)) == NULL) return (NULL);
+	memset (&F, 0, sizeof (struct GMTMERCMAP_FUSE));
+	F.nx = G->header->nx;	F.ny = G->header->ny;
+	F.n_threads = Ctrl->x.n_threads;
+	F.north = G->header->wesn[GMT_YHI] - 0.5 * G->header->registration * G->header->inc[GMT_Y];
+	F.dlat = G->header->inc[GMT_Y];
+	if (fabs (G->header->wesn[GMT_XHI] - G->header->wesn[GMT_XLO] - 360.0) < GMT_CONV8_LIMIT)	/* Global grid, the first and last columns are neighbours */
+		F.period = F.nx - (G->header->registration == GMT_GRID_NODE_REG);
+	F.dx = DIST_M_PR_DEG * G->header->inc[GMT_X];	F.dy = DIST_M_PR_DEG * G->header->inc[GMT_Y];
+	F.sin_az = sin (SHADE_AZIMUTH * M_PI / 180.0);	F.cos_az = cos (SHADE_AZIMUTH * M_PI / 180.0);
+	F.z = G->data;	F.z0 = GMT_Get_Index (API, G->header, 0, 0);	F.z_mx = G->header->mx;
+	if (D) {
+		F.g = D->data;	F.g0 = GMT_Get_Index (API, D->header, 0, 0);	F.g_mx = D->header->mx;
+	}
+	F.rgb = R->data;	F.r0 = GMT_Get_Index (API, R->header, 0, 0);	F.r_mx = R->header->mx;
+	F.band = R->header->size;	/* GMT images keep the bands one after the other */
+	F.P = P;
+	for (k = 0; k < 4; k++) {	/* How far shading may change the saturation and value of the colors */
+		GMT_Get_Default (API, hsv_key[k], value);
+		F.hsv[k] = atof (value);
+	}
+	n_strips = (F.ny + FUSE_ROWS - 1) / FUSE_ROWS;
+	if ((F.sum = calloc (3 * (size_t)n_strips, sizeof (double))) == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to allocate memory for the gradient statistics\n");
+		GMT_Destroy_Data (API, &R);
+		return (NULL);
+	}
+
+	error = custom_parallel_for (F.n_threads, F.ny, FUSE_ROWS, fuse_stats, &F);
+	for (k = 0; !error && k < n_strips; k++) {	/* Add up the sums of the strips in order */
+		n += F.sum[3*k];	sum += F.sum[3*k+1];
+	}
+	if (!error && n > 0.0) {	/* Second pass for the rms deviation from the mean */
+		F.mean = sum / n;
+		F.pass = 1;
+		if ((error = custom_parallel_for (F.n_threads, F.ny, FUSE_ROWS, fuse_stats, &F)) == GMT_NOERROR) {
+			for (k = 0; k < n_strips; k++) sum2 += F.sum[3*k+2];
+			F.sigma = sqrt (sum2 / n);
+		}
+	}
+	free (F.sum);
+	if (F.sigma == 0.0) F.sigma = 1.0;	/* Flat region: all intensities become zero */
+	F.scale = 2.0 * SHADE_NORM / M_PI;
+	if (!error) {
+		GMT_Report (API, GMT_MSG_LONG_VERBOSE, "Shade and color %u x %u nodes using %u threads\n", F.nx, F.ny, F.n_threads);
+		error = custom_parallel_for (F.n_threads, F.ny, FUSE_ROWS, fuse_rows, &F);
+	}
+	if (error) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to allocate memory for the workers of the fused renderer\n");
+		GMT_Destroy_Data (API, &R);
+		return (NULL);
+	}
+	return (R);
+}
+
+static int map_resolution (struct GMTMERCMAP_CTRL *Ctrl, double *wesn, double width, unsigned int length_unit)
+{	/* Unless -E, determine approximate map area in degrees squared (just dlon * dlat), and use it to select which ETOPO?m.nc grid to use.
+	 * With a pyramid we instead pick the level from the number of image pixels across the map */
+	double area;
+
+	if (Ctrl->E.active)	/* Specified the exact resolution to use */
+		return (Ctrl->E.mode);
+	if (Ctrl->A.active)	/* Match the node spacing to the pixel size */
+		return (pyramid_level (Ctrl, wesn, width, length_unit));
+	area = (wesn[GMT_XHI] - wesn[GMT_XLO]) * (wesn[GMT_YHI] - wesn[GMT_YLO]);	/* Determine resolution automatically from map area */
+	return ((area < ETOPO1M_LIMIT) ? 1 : ((area < ETOPO2M_LIMIT) ? 2 : 5));	/* Use earth_relief_[1,2,5]m.grd depending on area */
+}
+
+struct GMTMERCMAP_ITEM {	/* An object kept for later maps */
+	char key[GMT_LEN256];	/* What it is, e.g. "relief 2 -30/10/0/30" */
+	void *data;		/* The grid or CPT */
+	size_t bytes;		/* Memory it uses */
+	uint64_t used;		/* Number of the map that last used it */
+};
+
+struct GMTMERCMAP_CACHE {	/* What a session keeps from one map to the next */
+	struct GMT_GRID *header[3];	/* Headers of the 1, 2, and 5 arc min global grids, read when first needed */
+	unsigned int n_items, n_alloc;
+	size_t bytes, max_bytes;	/* Memory used by the items and the most we may use (-M) */
+	uint64_t map;		/* Number of the current map */
+	struct GMTMERCMAP_ITEM *item;	/* Relief and intensity grids and CPTs of earlier maps */
+};
+
+struct GMTMERCMAP_PS {	/* Which of the PostScript options -K -O -P -X -Y were given */
+	unsigned int K, O, P, X, Y;
+};
+
+static void init_cache (struct GMTMERCMAP_CTRL *Ctrl, struct GMTMERCMAP_CACHE *Cache)
+{
+	memset (Cache, 0, sizeof (struct GMTMERCMAP_CACHE));
+	Cache->max_bytes = (size_t)(Ctrl->M.size * 1024.0 * 1024.0);
+}
+
+static void free_cache (void *API, struct GMTMERCMAP_CACHE *Cache)
+{
+	unsigned int k;
+	for (k = 0; k < 3; k++) if (Cache->header[k]) GMT_Destroy_Data (API, &Cache->header[k]);
+	for (k = 0; k < Cache->n_items; k++) GMT_Destroy_Data (API, &Cache->item[k].data);
+	free (Cache->item);
+	Cache->item = NULL;
+	Cache->n_items = Cache->n_alloc = 0;
+	Cache->bytes = 0;
+}
+
+static void *cache_get (struct GMTMERCMAP_CACHE *Cache, char *key)
+{	/* Return the object kept under key and mark it as used by the current map, or NULL if we do not have it */
+	unsigned int k;
+	for (k = 0; k < Cache->n_items; k++) {
+		if (strcmp (Cache->item[k].key, key)) continue;
+		Cache->item[k].used = Cache->map;
+		return (Cache->item[k].data);
+	}
+	return (NULL);
+}
+
+static unsigned int cache_put (void *API, struct GMTMERCMAP_CACHE *Cache, char *key, void *data, size_t bytes)
+{	/* Keep data under key, first destroying the least recently used objects until it fits under the memory cap.
+	 * Objects used by the current map are never evicted.  Return 1 if kept, or 0 if the caller must free it */
+	unsigned int k, lru;
+	struct GMTMERCMAP_ITEM *item = NULL;
+
+	while (Cache->bytes + bytes > Cache->max_bytes) {	/* Make room */
+		for (k = 0, lru = Cache->n_items; k < Cache->n_items; k++)
+			if (Cache->item[k].used < Cache->map && (lru == Cache->n_items || Cache->item[k].used < Cache->item[lru].used)) lru = k;
+		if (lru == Cache->n_items) return (0);	/* Nothing left we may evict */
+		GMT_Destroy_Data (API, &Cache->item[lru].data);
+		Cache->bytes -= Cache->item[lru].bytes;
+		Cache->item[lru] = Cache->item[--Cache->n_items];
+	}
+	if (Cache->n_items == Cache->n_alloc) {
+		Cache->n_alloc = (Cache->n_alloc) ? 2 * Cache->n_alloc : 16;
+		if ((item = realloc (Cache->item, Cache->n_alloc * sizeof (struct GMTMERCMAP_ITEM))) == NULL) {
+			Cache->n_alloc = Cache->n_items;
+			return (0);
+		}
+		Cache->item = item;
+	}
+	item = &Cache->item[Cache->n_items++];
+	strncpy (item->key, key, GMT_LEN256 - 1);
+	item->key[GMT_LEN256 - 1] = '\0';
+	item->data = data;
+	item->bytes = bytes;
+	item->used = Cache->map;
+	Cache->bytes += bytes;
+	return (1);
+}
+
+static struct GMT_GRID *source_grid (void *API, struct GMTMERCMAP_CACHE *Cache, int min, char *file)
+{	/* Return a new grid with the header of the global grid file of min arc minutes, ready to read a subset into */
+	unsigned int k = (min == 1) ? 0 : ((min == 2) ? 1 : 2);
+
+	if (Cache->header[k] == NULL && (Cache->header[k] = GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_HEADER_ONLY, NULL, file, NULL)) == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to locate file %s in the GMT search directories\n", file);
+		return (NULL);
+	}
+	return (GMT_Duplicate_Data (API, GMT_IS_GRID, GMT_DUPLICATE_NONE, Cache->header[k]));
+}
+
+static struct GMT_PALETTE *get_cpt (void *API, struct GMTMERCMAP_CACHE *Cache, char *cpt, double z, unsigned int *keep)
+{	/* Return the CPT for -z/z made by makecpt from cpt, reusing the one made for an earlier map if we still have it.
+	 * keep is set to 1 if the cache holds on to the CPT and 0 if the caller must free it */
+	char c_file[GMT_STR16], cmd[BUFSIZ], key[GMT_LEN256];
+	struct GMT_PALETTE *P = NULL;
+
+	snprintf (key, GMT_LEN256, "cpt %s %g", cpt, z);
+	if ((P = cache_get (Cache, key))) {
+		*keep = 1;
+		return (P);
+	}
+	/* Register the output CPT file to a memory location */
+	if (GMT_Open_VirtualFile (API, GMT_IS_PALETTE, GMT_IS_NONE, GMT_OUT, NULL, c_file) != GMT_NOERROR) return (NULL);
+	memset (cmd, 0, BUFSIZ);
+	sprintf (cmd, "-C%s -T%g/%g ->%s", cpt, -z, z, c_file);	/* The makecpt command line */
+	if (GMT_Call_Module (API, "makecpt", GMT_MODULE_CMD, cmd) == GMT_NOERROR)	/* This will write the output CPT to memory */
+		P = GMT_Read_VirtualFile (API, c_file);	/* Get the CPT */
+	if (GMT_Close_VirtualFile (API, c_file) != GMT_NOERROR && P) GMT_Destroy_Data (API, &P);	/* Done with this virtual file */
+	if (P == NULL) return (NULL);
+	*keep = cache_put (API, Cache, key, P, sizeof (struct GMT_PALETTE) + P->n_colors * sizeof (struct GMT_LUT));
+	return (P);
+}
+
+static int make_map (void *API, struct GMTMERCMAP_CTRL *Ctrl, struct GMTMERCMAP_CACHE *Cache, struct GMTMERCMAP_MAP *M, struct GMTMERCMAP_PS *PS, unsigned int length_unit)
+{	/* Make the map M, writing the PostScript to its file or to stdout if there is none.  The relief and intensity
+	 * grids and the CPT are taken from the cache if an earlier map left them there, and offered to it otherwise.
+	 * A failure closes the virtual files and frees what the cache did not take, so a server can go on to the next map */
+	int min, error = GMT_NOERROR;
+	unsigned int keep_G = 1, keep_I = 1, keep_P = 1, z_open = 0, i_open = 0, c_open = 0;
+	double z, z_min, z_max, *wesn = M->wesn, width = M->width;
+	char file[256], z_file[GMT_STR16], i_file[GMT_STR16], c_file[GMT_STR16], cmd[BUFSIZ], key[GMT_LEN256];
+	char *ps_file = M->file, *cpt = (M->cpt) ? M->cpt : Ctrl->C.file;
+	static char unit[3] = "cip";
+	struct GMT_GRID *G = NULL, *H = NULL, *I = NULL;
+	struct GMT_IMAGE *R = NULL;
+	struct GMT_PALETTE *P = NULL;
+
+	/* 2. Select the resolution */
+
+	Cache->map++;	/* Objects used from here on are needed by this map */
+	min = map_resolution (Ctrl, wesn, width, length_unit);
+	
+	GMT_Report (API, GMT_MSG_VERBOSE, "Create Mercator map of area %g/%g/%g/%g with width %g%c\n",
+		wesn[GMT_XLO], wesn[GMT_XHI], wesn[GMT_YLO], wesn[GMT_YHI], 
+		width, unit[length_unit]);
+		
+	/* 3. Load in the subset from the selected etopo?m.nc grid, or assemble it from the tiles of the pyramid */
+	
+	if (Ctrl->A.active)	/* Name the source of the relief, also for the illumination message below */
+		snprintf (file, 256, "the %d arc min tiles in %s", min, Ctrl->A.dir);
+	else
+		snprintf (file, 256, "@earth_relief_%2.2dm", min);
+	snprintf (key, GMT_LEN256, "relief %d %.12g/%.12g/%.12g/%.12g", min, wesn[GMT_XLO], wesn[GMT_XHI], wesn[GMT_YLO], wesn[GMT_YHI]);
+	if ((G = cache_get (Cache, key)))
+		GMT_Report (API, GMT_MSG_VERBOSE, "Reuse the %d arc min relief of an earlier map\n", min);
+	else {
+		if (Ctrl->A.active) {
+			GMT_Report (API, GMT_MSG_VERBOSE, "Read %d arc min tiles from pyramid %s\n", min, Ctrl->A.dir);
+			G = read_pyramid (API, Ctrl, wesn, min, 0);
+		}
+		else {	/* Start from a copy of the header we already have */
+			GMT_Report (API, GMT_MSG_VERBOSE, "Read subset from %s\n", file);
+			if ((H = source_grid (API, Cache, min, file)) && (G = GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_DATA_ONLY, wesn, file, H)) == NULL)
+				GMT_Destroy_Data (API, &H);
+		}
+		if (G == NULL) return (EXIT_FAILURE);	/* Nothing else to undo yet */
+		keep_G = cache_put (API, Cache, key, G, G->header->size * sizeof (gmt_grdfloat));
+	}
+
+	/* 4. Compute the illumination grid via GMT_grdgradient, or assemble the gradients from the cache and normalize them here.
+	 *    The fused renderer (-F) finds and normalizes the gradients itself, or takes the raw gradients from the cache */
+	
+	if (!Ctrl->F.active) {	/* Register the topography as read-only input */
+		if (GMT_Open_VirtualFile (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_IN, G, z_file) == GMT_NOERROR) z_open = 1; else error = EXIT_FAILURE;
+	}
+	snprintf (key, GMT_LEN256, "%s %d %.12g/%.12g/%.12g/%.12g", (Ctrl->F.active) ? "gradient" : "intensity", min, wesn[GMT_XLO], wesn[GMT_XHI], wesn[GMT_YLO], wesn[GMT_YHI]);
+	if (!error) {
+		if (Ctrl->F.active && !Ctrl->I.active)
+			GMT_Report (API, GMT_MSG_VERBOSE, "Artificial illumination is left to the fused renderer\n");
+		else if ((I = cache_get (Cache, key)))
+			GMT_Report (API, GMT_MSG_VERBOSE, "Reuse the illumination of an earlier map\n");
+		else {
+			if (Ctrl->I.active) {
+				GMT_Report (API, GMT_MSG_VERBOSE, "Read the illumination gradients from cache %s\n", Ctrl->I.dir);
+				if ((I = read_pyramid (API, Ctrl, wesn, min, 1)) == NULL)
+					error = EXIT_FAILURE;
+				else if (!Ctrl->F.active)
+					normalize_gradient (API, I, SHADE_NORM);
+			}
+			else {
+				GMT_Report (API, GMT_MSG_VERBOSE, "Compute artificial illumination grid from %s\n", file);
+				/* Register the output intensity surface to a memory location */
+				if (GMT_Open_VirtualFile (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_OUT, NULL, i_file) == GMT_NOERROR) i_open = 1;
+				memset (cmd, 0, BUFSIZ);
+				sprintf (cmd, "%s -G%s -Nt%g -A%g -fg", z_file, i_file, SHADE_NORM, SHADE_AZIMUTH);	/* The grdgradient command line */
+				if (!i_open || GMT_Call_Module (API, "grdgradient", GMT_MODULE_CMD, cmd) != GMT_NOERROR) error = EXIT_FAILURE;	/* This will write the intensity grid to an internal allocated container */
+				else if ((I = GMT_Read_VirtualFile (API, i_file)) == NULL) error = EXIT_FAILURE;	/* Get the intensity grid */
+				if (i_open && GMT_Close_VirtualFile (API, i_file) != GMT_NOERROR) error = EXIT_FAILURE;	/* Done with this virtual file */
+				i_open = 0;
+			}
+			if (I) keep_I = cache_put (API, Cache, key, I, I->header->size * sizeof (gmt_grdfloat));
+		}
+	}
+	
+	/* 5. Determine a reasonable color range based on TOPO_INC m intervals and retrieve a CPT */
+	
+	if (!error) {
+		GMT_Report (API, GMT_MSG_VERBOSE, "Determine suitable color range and build CPT file\n");
+		/* Round off to nearest TOPO_INC m and make a symmetric scale about zero */
+		z_min = floor (G->header->z_min/TOPO_INC)*TOPO_INC;
+		z_max = floor (G->header->z_max/TOPO_INC)*TOPO_INC;
+		z = fabs (z_min);
+		if (fabs (z_max) > z) z = fabs (z_max);	/* Make it symmetrical about zero */
+		if ((P = get_cpt (API, Cache, cpt, z, &keep_P)) == NULL) error = EXIT_FAILURE;
+	}
+	
+	/* 6. Now make the map */
+	
+	if (!error) {
+		GMT_Report (API, GMT_MSG_VERBOSE, "Generate the Mercator map\n");
+		memset (cmd, 0, BUFSIZ);
+		if (Ctrl->F.active) {	/* Shade and color the relief here and let grdimage plot the image */
+			/* Register the image in place of the relief, and the CPT for the color scale; output is PS that goes to ps_file or stdout */
+			if ((R = fused_image (API, Ctrl, G, I, P)) == NULL) error = EXIT_FAILURE;
+			else if (GMT_Open_VirtualFile (API, GMT_IS_IMAGE, GMT_IS_SURFACE, GMT_IN, R, z_file) == GMT_NOERROR) z_open = 1;
+			else error = EXIT_FAILURE;
+		}
+		else {
+			/* Register the three input sources (2 grids and 1 CPT); output is PS that goes to ps_file or stdout */
+			if (GMT_Init_VirtualFile (API, 0, z_file) != GMT_NOERROR) error = EXIT_FAILURE;	/* Reset the grid for reading again */
+			else if (GMT_Open_VirtualFile (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_IN, I, i_file) == GMT_NOERROR) i_open = 1;
+			else error = EXIT_FAILURE;
+		}
+		if (!error) {
+			if (GMT_Open_VirtualFile (API, GMT_IS_PALETTE, GMT_IS_NONE, GMT_IN, P, c_file) == GMT_NOERROR) c_open = 1; else error = EXIT_FAILURE;
+		}
+	}
+	if (!error) {	/* The grdimage command line */
+		if (Ctrl->F.active)
+			sprintf (cmd, "%s -JM%g%c -Ba -BWSne", z_file, width, unit[length_unit]);
+		else
+			sprintf (cmd, "%s -I%s -C%s -JM%g%c -Ba -BWSne", z_file, i_file, c_file, width, unit[length_unit]);
+		if (PS->O) strcat (cmd, " -O");	/* Add optional user options */
+		if (PS->P) strcat (cmd, " -P");	/* Add optional user options */
+		if (M->scale || PS->K) strcat (cmd, " -K");	/* Either gave -K or it is implicit via -S */
+		if (!PS->X && !PS->O) strcat (cmd, " -Xc");	/* User gave neither -X nor -O so we center the map */
+		if (M->scale) {	/* May need to add some vertical offset to account for the color scale */
+			if (!PS->Y && !PS->K) strcat (cmd, " -Y" MAP_OFFSET);	/* User gave neither -K nor -Y so we add 0.75i offset to fit the scale */
+		}
+		if (ps_file) strcat (cmd, " ->"), strcat (cmd, ps_file);
+		if (GMT_Call_Module (API, "grdimage", GMT_MODULE_CMD, cmd) != GMT_NOERROR) error = EXIT_FAILURE;	/* Lay down the Mercator image */
+	}
+	
+	/* 7. Plot the optional color scale */
+	
+	if (!error && M->scale) {
+		GMT_Report (API, GMT_MSG_VERBOSE, "Append color scale bar\n");
+		/* Register the CPT to be used by psscale */
+		if (GMT_Init_VirtualFile (API, 0, c_file) != GMT_NOERROR) error = EXIT_FAILURE;	/* Reset the CPT for reading again */
+		else {
+			memset (cmd, 0, BUFSIZ);
+			sprintf (cmd, "-C%s -R -J -DJCB+w%g%c/%s+h+o0/%s -Bxa -By+lm -O", c_file, 0.9*width, unit[length_unit], MAP_BAR_HEIGHT, MAP_BAR_GAP);	/* The psscale command line */
+			if (PS->K) strcat (cmd, " -K");		/* Add optional user options */
+			if (ps_file) strcat (cmd, " ->>"), strcat (cmd, ps_file);	/* Append to the map */
+			if (GMT_Call_Module (API, "psscale", GMT_MODULE_CMD, cmd) != GMT_NOERROR) error = EXIT_FAILURE;	/* Place the color bar */
+		}
+	}
+
+	/* 8. Close the virtual files and free what the cache did not take, whether or not we got this far */
+
+	if (z_open && GMT_Close_VirtualFile (API, z_file) != GMT_NOERROR) error = EXIT_FAILURE;
+	if (i_open && GMT_Close_VirtualFile (API, i_file) != GMT_NOERROR) error = EXIT_FAILURE;
+	if (c_open && GMT_Close_VirtualFile (API, c_file) != GMT_NOERROR) error = EXIT_FAILURE;
+	if (!keep_G) GMT_Destroy_Data (API, &G);
+	if (I && !keep_I) GMT_Destroy_Data (API, &I);
+	if (P && !keep_P) GMT_Destroy_Data (API, &P);
+	if (R) GMT_Destroy_Data (API, &R);
+	return (error);
+}
+
+static unsigned int batch_worker (void *API, struct GMTMERCMAP_CTRL *Ctrl, struct GMTMERCMAP_PS *PS, unsigned int length_unit, unsigned int first, unsigned int stride)
+{	/* Make maps first, first + stride, ... of the -L list and return how many failed */
+	unsigned int k, n_failed = 0;
+	double t0;
+	struct GMTMERCMAP_CACHE Cache;
+
+	init_cache (Ctrl, &Cache);
+	for (k = first; k < Ctrl->L.n_maps; k += stride) {
+		t0 = custom_wall_time ();
+		if (make_map (API, Ctrl, &Cache, &Ctrl->L.map[k], PS, length_unit)) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Failed to make map %u (%s)\n", k, Ctrl->L.map[k].file);
+			n_failed++;
+		}
+		else
+			GMT_Report (API, GMT_MSG_VERBOSE, "Map %u (%s) took %.3f s\n", k, Ctrl->L.map[k].file, custom_wall_time () - t0);
+	}
+	free_cache (API, &Cache);
+	return (n_failed);
+}
+
+static int batch_maps (void *API, struct GMTMERCMAP_CTRL *Ctrl, struct GMTMERCMAP_PS *PS, unsigned int length_unit)
+{	/* Make all the maps in the -L list.  The GMT API cannot be used from several threads, so with -x<n> we fork n worker
+	 * processes instead, each with its own copy of this session and its own cache, and hand them every n'th map */
+	unsigned int w, n_workers = MIN (Ctrl->x.n_threads, Ctrl->L.n_maps), n_failed = 0;
+	double t0 = custom_wall_time (), dt;
+
+	Ctrl->x.n_threads = 1;	/* The workers share the maps, not the rows of one map */
+#ifndef _WIN32
+	if (n_workers > 1) {
+		int status;
+		pid_t pid;
+		fflush (NULL);	/* So the workers do not inherit buffered output */
+		for (w = 0; w < n_workers; w++) {
+			if ((pid = fork ()) == 0) {	/* The worker reports how many of its maps failed */
+				n_failed = batch_worker (API, Ctrl, PS, length_unit, w, n_workers);
+				_exit ((int)MIN (n_failed, 255U));
+			}
+			if (pid < 0) {	/* Let the workers we have do their share, but the rest of the maps are not made */
+				GMT_Report (API, GMT_MSG_NORMAL, "Unable to start worker %u of %u\n", w, n_workers);
+				n_failed += (Ctrl->L.n_maps - w + n_workers - 1) / n_workers;
+			}
+		}
+		while (wait (&status) > 0) {
+			if (!WIFEXITED (status))
+				n_failed++;
+			else
+				n_failed += WEXITSTATUS (status);
+		}
+	}
+	else
+#endif
+		n_failed = batch_worker (API, Ctrl, PS, length_unit, 0, 1);
+	dt = custom_wall_time () - t0;
+	GMT_Report (API, GMT_MSG_VERBOSE, "Made %u maps in %.3f s using %u workers: %.3f s of worker time per map, %.2f maps per second\n",
+		Ctrl->L.n_maps - n_failed, dt, n_workers, dt * n_workers / Ctrl->L.n_maps, Ctrl->L.n_maps / dt);
+	if (n_failed) GMT_Report (API, GMT_MSG_NORMAL, "%u of %u maps failed\n", n_failed, Ctrl->L.n_maps);
+	return ((n_failed) ? EXIT_FAILURE : GMT_NOERROR);
+}
+
+static int temp_file (char *file)
+{	/* Replace the trailing XXXXXX of file to make a new, empty file that only we can read and write, and return 0 on success */
+#ifdef _WIN32
+	FILE *fp = NULL;
+	if (_mktemp (file) == NULL || (fp = fopen (file, "wb")) == NULL) return (1);
+	fclose (fp);
+#else
+	int fd;
+	if ((fd = mkstemp (file)) < 0) return (1);
+	close (fd);
+#endif
+	return (0);
+}
+
+static unsigned int serve_stream (void *API, struct GMTMERCMAP_CTRL *Ctrl, struct GMTMERCMAP_CACHE *Cache, struct GMTMERCMAP_PS *PS, unsigned int length_unit, char *ps_file, FILE *in, FILE *out)
+{	/* Answer the -Q requests read from in on out until the input ends, and return 1 if asked to quit.
+	 * Each map is made in ps_file, which grdimage overwrites for every map, and sent back after an OK <bytes> <seconds> line */
+	int n;
+	unsigned int quit = 0;
+	size_t n_read, n_bytes;
+	double t0, dt;
+	char record[GMT_BUFSIZ] = {""}, width[GMT_LEN64], cpt[GMT_BUFSIZ], scale[GMT_LEN64], buffer[GMT_BUFSIZ], *c = NULL;
+	FILE *fp = NULL;
+	struct GMTMERCMAP_MAP Map;
+
+	while (!quit && fgets (record, GMT_BUFSIZ, in)) {
+		for (c = record; *c == ' ' || *c == '\t'; c++);	/* Skip leading whitespace */
+		if (*c == '\0' || *c == '\n' || *c == '\r' || *c == '#') continue;
+		if (!strncmp (c, "quit", 4U)) {
+			quit = 1;
+			continue;
+		}
+		t0 = custom_wall_time ();
+		n = sscanf (c, "%lf/%lf/%lf/%lf %63s %s %63s", &Map.wesn[GMT_XLO], &Map.wesn[GMT_XHI], &Map.wesn[GMT_YLO], &Map.wesn[GMT_YHI], width, cpt, scale);
+		Map.width = Ctrl->W.width;
+		if (n > 4 && strcmp (width, "-")) GMT_Get_Value (API, width, &Map.width);
+		Map.cpt = (n > 5 && strcmp (cpt, "-")) ? cpt : NULL;
+		Map.scale = (n > 6) ? (atoi (scale) != 0) : Ctrl->S.active;
+		Map.file = ps_file;
+		if (n < 4 || Map.wesn[GMT_XLO] >= Map.wesn[GMT_XHI] || Map.wesn[GMT_YLO] >= Map.wesn[GMT_YHI] || Map.width <= 0.0 || (n > 4 && strlen (width) == GMT_LEN64 - 1)) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Bad request %s", c);
+			fprintf (out, "ERROR Request is not <west>/<east>/<south>/<north> [<width>|- [<cpt>|- [0|1]]]\n");
+		}
+		else if (make_map (API, Ctrl, Cache, &Map, PS, length_unit) || (fp = fopen (ps_file, "rb")) == NULL) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Failed to make the map for request %s", c);
+			fprintf (out, "ERROR Failed to make the map\n");
+		}
+		else {	/* Send the size and the time it took, then the PostScript itself */
+			fseek (fp, 0L, SEEK_END);
+			n_bytes = (size_t)ftell (fp);
+			rewind (fp);
+			dt = custom_wall_time () - t0;
+			fprintf (out, "OK %lu %.6f\n", (unsigned long)n_bytes, dt);
+			while ((n_read = fread (buffer, 1U, GMT_BUFSIZ, fp)) > 0) fwrite (buffer, 1U, n_read, out);
+			fclose (fp);
+			GMT_Report (API, GMT_MSG_VERBOSE, "Made map in %.3f s; the cache holds %u objects in %.1f MB\n", dt, Cache->n_items, Cache->bytes / 1048576.0);
+		}
+		fflush (out);
+	}
+	return (quit);
+}
+
+static int serve_maps (void *API, struct GMTMERCMAP_CTRL *Ctrl, struct GMTMERCMAP_PS *PS, unsigned int length_unit)
+{	/* Stay resident and make maps on request, so the relief, intensity grids and CPTs of earlier maps can be reused.
+	 * Requests are read from stdin and answered on stdout, or read from the clients of the -Q socket, one at a time */
+	unsigned int quit = 0;
+	int error = GMT_NOERROR;
+	char ps_file[GMT_BUFSIZ], *tmp = getenv ("TMPDIR");
+	struct GMTMERCMAP_CACHE Cache;
+
+	snprintf (ps_file, GMT_BUFSIZ, "%s/gmtmercmap_XXXXXX", (tmp) ? tmp : "/tmp");
+	if (temp_file (ps_file)) {	/* Create it now under a name nobody can guess or claim before us */
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to create a temporary file in %s\n", (tmp) ? tmp : "/tmp");
+		return (EXIT_FAILURE);
+	}
+	init_cache (Ctrl, &Cache);
+#ifndef _WIN32
+	if (Ctrl->Q.socket) {
+		int s_fd, c_fd, o_fd;
+		struct sockaddr_un addr;
+		FILE *in = NULL, *out = NULL;
+
+		if (strlen (Ctrl->Q.socket) >= sizeof (addr.sun_path)) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Socket path %s is too long\n", Ctrl->Q.socket);
+			remove (ps_file);
+			return (EXIT_FAILURE);
+		}
+		memset (&addr, 0, sizeof (struct sockaddr_un));
+		addr.sun_family = AF_UNIX;
+		strcpy (addr.sun_path, Ctrl->Q.socket);
+		unlink (Ctrl->Q.socket);	/* Remove the socket of an earlier server, if any */
+		if ((s_fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0 || bind (s_fd, (struct sockaddr *)&addr, sizeof (struct sockaddr_un)) || listen (s_fd, SERVE_BACKLOG)) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Unable to listen on socket %s\n", Ctrl->Q.socket);
+			if (s_fd >= 0) close (s_fd);
+			remove (ps_file);
+			return (EXIT_FAILURE);
+		}
+		signal (SIGPIPE, SIG_IGN);	/* A client that hangs up must not take the server down */
+		GMT_Report (API, GMT_MSG_VERBOSE, "Serving maps on socket %s\n", Ctrl->Q.socket);
+		while (!quit) {
+			if ((c_fd = accept (s_fd, NULL, NULL)) < 0) {
+				if (errno == EINTR || errno == ECONNABORTED) continue;	/* Interrupted by a signal, or the client hung up while waiting */
+				GMT_Report (API, GMT_MSG_NORMAL, "Unable to accept connections on socket %s\n", Ctrl->Q.socket);
+				error = EXIT_FAILURE;
+				break;
+			}
+			in = fdopen (c_fd, "r");
+			out = ((o_fd = dup (c_fd)) >= 0) ? fdopen (o_fd, "w") : NULL;
+			if (in && out) quit = serve_stream (API, Ctrl, &Cache, PS, length_unit, ps_file, in, out);
+			if (in) fclose (in); else close (c_fd);
+			if (out) fclose (out); else if (o_fd >= 0) close (o_fd);
+		}
+		close (s_fd);
+		unlink (Ctrl->Q.socket);
+	}
+	else
+#endif
+	{
+		GMT_Report (API, GMT_MSG_VERBOSE, "Serving maps on stdin\n");
+		serve_stream (API, Ctrl, &Cache, PS, length_unit, ps_file, stdin, stdout);
+	}
+	free_cache (API, &Cache);
+	remove (ps_file);
+	return (error);
+}
+
 #define M_free_options(mode) {if (mode >= 0 && GMT_Destroy_Options (API, &options) != GMT_OK) exit (GMT_MEMORY_ERROR);}
 #define bailout(code) {M_free_options (mode); return (code);}
 #define Return(code) {Free_Ctrl (Ctrl); bailout (code);}
@@ -213,15 +1417,15 @@ int GMT_gmtmercmap (void *API, int mode, void *args) {
 	unsigned int B_active, K_active, O_active, P_active, X_active, Y_active;
 	unsigned int length_unit = 0;	/* cm */
 	
-	double area, z, z_min, z_max, wesn[4];
+	double wesn[4];
 	
-	char file[256], z_file[GMT_STR16], i_file[GMT_STR16];
-	char cmd[BUFSIZ], c_file[GMT_STR16], t_file[GMT_STR16], def_unit[16];
-	static char unit[3] = "cip";
+	char file[256], cmd[BUFSIZ], t_file[GMT_STR16], def_unit[16];
 
-	struct GMT_GRID *G = NULL, *I = NULL;
-	struct GMT_PALETTE *P = NULL;
+	struct GMT_GRID *G = NULL;
 	struct GMT_DATASET *T = NULL;
+	struct GMTMERCMAP_MAP Map;
+	struct GMTMERCMAP_CACHE Cache;
+	struct GMTMERCMAP_PS PS;
 	struct GMTMERCMAP_CTRL *Ctrl = NULL;
 	struct GMT_OPTION *options = NULL;
 
@@ -248,6 +1452,14 @@ int GMT_gmtmercmap (void *API, int mode, void *args) {
 
 	/*---------------------------- This is the gmtmercmap main code ----------------------------*/
 
+	if (Ctrl->A.build || Ctrl->I.build) {	/* Just cut the relief grids into the tile pyramid and/or fill the gradient cache */
+		if (Ctrl->I.active) gmt_mkdir (Ctrl->I.dir);
+		if (Ctrl->A.build && (error = build_pyramid (API, Ctrl))) Return (error);
+		if (Ctrl->I.build) error = fill_gradient_cache (API, Ctrl);
+		Return (error);
+	}
+	if (Ctrl->I.active && !Ctrl->D.active) gmt_mkdir (Ctrl->I.dir);	/* Fails harmlessly if it exists */
+
 	/* 1. If -R is not given, we must set a default map region, here -R-180/+180/-75/+75 */
 	
 	if (GMT_Get_Common (API, 'R', wesn) == GMT_NOTSET){	/* Get or set default world region */
@@ -261,17 +1473,11 @@ int GMT_gmtmercmap (void *API, int mode, void *args) {
 	X_active = (GMT_Get_Common (API, 'X', NULL) == 0);	/* 1 if -X was specified */
 	Y_active = (GMT_Get_Common (API, 'Y', NULL) == 0);	/* 1 if -Y was specified */
 	
-	/* 2. Unless -E, determine approximate map area in degrees squared (just dlon * dlat), and use it to select which ETOPO?m.nc grid to use */
-	
-	if (Ctrl->E.active)	/* Specified the exact resolution to use */
-		min = Ctrl->E.mode;
-	else {	/* Determine resolution automatically from map area */
-		area = (wesn[GMT_XHI] - wesn[GMT_XLO]) * (wesn[GMT_YHI] - wesn[GMT_YLO]);
-		min = (area < ETOPO1M_LIMIT) ? 1 : ((area < ETOPO2M_LIMIT) ? 2 : 5);	/* Use earth_relief_[1,2,5]m.grd depending on area */
-	}
+	/* 2. Select the resolution for the script; make_map selects it for each map it makes */
 
+	min = map_resolution (Ctrl, wesn, Ctrl->W.width, length_unit);
 	sprintf (file, "@earth_relief_%2.2dm", min);	/* Make the selected file name and make sure it is accessible */
-	if ((G = GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_HEADER_ONLY, NULL, file, NULL)) == NULL) {
+	if (Ctrl->D.active && (G = GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_HEADER_ONLY, NULL, file, NULL)) == NULL) {
 		GMT_Report (API, GMT_MSG_NORMAL, "Unable to locate file %s in the GMT search directories\n", file);
 		Return (EXIT_FAILURE);
 	}
@@ -380,79 +1586,25 @@ int GMT_gmtmercmap (void *API, int mode, void *args) {
 		Return (EXIT_SUCCESS);
 	}
 	
-	/* Here we actuallly make the map */
-	
-	GMT_Report (API, GMT_MSG_VERBOSE, "Create Mercator map of area %g/%g/%g/%g with width %g%c\n",
-		wesn[GMT_XLO], wesn[GMT_XHI], wesn[GMT_YLO], wesn[GMT_YHI], 
-		Ctrl->W.width, unit[length_unit]);
-		
-	/* 3. Load in the subset from the selected etopo?m.nc grid */
-	
-	GMT_Report (API, GMT_MSG_VERBOSE, "Read subset from %s\n", file);
-	if ((G = GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_DATA_ONLY, wesn, file, G)) == NULL) Return (EXIT_FAILURE);
+	/* Here we actuallly make the map, or all the maps in the list */
 
-	/* 4. Compute the illumination grid via GMT_grdgradient */
-	
-	GMT_Report (API, GMT_MSG_VERBOSE, "Compute artificial illumination grid from %s\n", file);
-	/* Register the topography as read-only input and register the output intensity surface to a memory location */
-	if (GMT_Open_VirtualFile (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_IN,     G, z_file) != GMT_NOERROR) exit (EXIT_FAILURE);
-	if (GMT_Open_VirtualFile (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_OUT, NULL, i_file) != GMT_NOERROR) exit (EXIT_FAILURE);
-	memset (cmd, 0, BUFSIZ);
-	sprintf (cmd, "%s -G%s -Nt0.8 -A45 -fg", z_file, i_file);			/* The grdgradient command line */
-	if (GMT_Call_Module (API, "grdgradient", GMT_MODULE_CMD, cmd) != GMT_NOERROR) Return (EXIT_FAILURE);	/* This will write the intensity grid to an internal allocated container */
-	if ((I = GMT_Read_VirtualFile (API, i_file)) == NULL) Return (EXIT_FAILURE);	/* Get the intensity grid */
-	if (GMT_Close_VirtualFile (API, i_file) != GMT_NOERROR) Return (EXIT_FAILURE);	/* Done with this virtual file */
-	
-	/* 5. Determine a reasonable color range based on TOPO_INC m intervals and retrieve a CPT */
-	
-	GMT_Report (API, GMT_MSG_VERBOSE, "Determine suitable color range and build CPT file\n");
-	/* Round off to nearest TOPO_INC m and make a symmetric scale about zero */
-	z_min = floor (G->header->z_min/TOPO_INC)*TOPO_INC;
-	z_max = floor (G->header->z_max/TOPO_INC)*TOPO_INC;
-	z = fabs (z_min);
-	if (fabs (z_max) > z) z = fabs (z_max);	/* Make it symmetrical about zero */
-	/* Register the output CPT file to a memory location */
-	if (GMT_Open_VirtualFile (API, GMT_IS_PALETTE, GMT_IS_NONE, GMT_OUT, NULL, c_file) != GMT_NOERROR) exit (EXIT_FAILURE);
-	memset (cmd, 0, BUFSIZ);
-	sprintf (cmd, "-C%s -T%g/%g ->%s", Ctrl->C.file, -z, z, c_file);	/* The makecpt command line */
-	if (GMT_Call_Module (API, "makecpt", GMT_MODULE_CMD, cmd) != GMT_NOERROR) Return (EXIT_FAILURE);	/* This will write the output CPT to memory */
-	if ((P = GMT_Read_VirtualFile (API, c_file)) == NULL) Return (EXIT_FAILURE);	/* Get the CPT */
-	if (GMT_Close_VirtualFile (API, c_file) != GMT_NOERROR) Return (EXIT_FAILURE);	/* Done with this virtual file */
-	
-	/* 6. Now make the map */
-	
-	GMT_Report (API, GMT_MSG_VERBOSE, "Generate the Mercator map\n");
-	/* Register the three input sources (2 grids and 1 CPT); output is PS that goes to stdout */
-	if (GMT_Init_VirtualFile (API, 0, z_file) != GMT_NOERROR) Return (EXIT_FAILURE);	/* Reset the grid for reading again */
-	if (GMT_Open_VirtualFile (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_IN, I, i_file) != GMT_NOERROR) exit (EXIT_FAILURE);
-	if (GMT_Open_VirtualFile (API, GMT_IS_PALETTE, GMT_IS_NONE, GMT_IN, P, c_file) != GMT_NOERROR) exit (EXIT_FAILURE);
-	memset (cmd, 0, BUFSIZ);
-	sprintf (cmd, "%s -I%s -C%s -JM%g%c -Ba -BWSne", z_file, i_file, c_file, Ctrl->W.width, unit[length_unit]);	/* The grdimage command line */
-	if (O_active) strcat (cmd, " -O");	/* Add optional user options */
-	if (P_active) strcat (cmd, " -P");	/* Add optional user options */
-	if (Ctrl->S.active || K_active) strcat (cmd, " -K");	/* Either gave -K or it is implicit via -S */
-	if (!X_active && !O_active) strcat (cmd, " -Xc");	/* User gave neither -X nor -O so we center the map */
-	if (Ctrl->S.active) {	/* May need to add some vertical offset to account for the color scale */
-		if (!Y_active && !K_active) strcat (cmd, " -Y" MAP_OFFSET);	/* User gave neither -K nor -Y so we add 0.75i offset to fit the scale */
-	}
-	if (GMT_Call_Module (API, "grdimage", GMT_MODULE_CMD, cmd) != GMT_NOERROR) Return (EXIT_FAILURE);	/* Lay down the Mercator image */
-	
-	/* 7. Plot the optional color scale */
-	
-	if (Ctrl->S.active) {
-		GMT_Report (API, GMT_MSG_VERBOSE, "Append color scale bar\n");
-		/* Register the CPT to be used by psscale */
-		if (GMT_Init_VirtualFile (API, 0, c_file) != GMT_NOERROR) Return (EXIT_FAILURE);	/* Reset the CPT for reading again */
-		memset (cmd, 0, BUFSIZ);
-		sprintf (cmd, "-C%s -R -J -DJCB+w%g%c/%s+h+o0/%s -Bxa -By+lm -O", c_file, 0.9*Ctrl->W.width, unit[length_unit], MAP_BAR_HEIGHT, MAP_BAR_GAP);	/* The psscale command line */
-		if (K_active) strcat (cmd, " -K");		/* Add optional user options */
-		if (GMT_Call_Module (API, "psscale", GMT_MODULE_CMD, cmd) != GMT_NOERROR) Return (EXIT_FAILURE);	/* Place the color bar */
+	PS.K = K_active;	PS.O = O_active;	PS.P = P_active;	PS.X = X_active;	PS.Y = Y_active;
+	if (Ctrl->L.active)
+		error = batch_maps (API, Ctrl, &PS, length_unit);
+	else if (Ctrl->Q.active)
+		error = serve_maps (API, Ctrl, &PS, length_unit);
+	else {
+		memcpy (Map.wesn, wesn, 4 * sizeof (double));
+		Map.width = Ctrl->W.width;
+		Map.file = Map.cpt = NULL;
+		Map.scale = Ctrl->S.active;
+		init_cache (Ctrl, &Cache);
+		error = make_map (API, Ctrl, &Cache, &Map, &PS, length_unit);
+		free_cache (API, &Cache);
 	}
-	if (GMT_Close_VirtualFile (API, z_file) != GMT_NOERROR) Return (EXIT_FAILURE);	/* Done with this virtual file */
-	if (GMT_Close_VirtualFile (API, i_file) != GMT_NOERROR) Return (EXIT_FAILURE);	/* Done with this virtual file */
-	if (GMT_Close_VirtualFile (API, c_file) != GMT_NOERROR) Return (EXIT_FAILURE);	/* Done with this virtual file */
-	
-	/* 8. Let the GMT API garbage collection free the memory used */
+	if (error) Return (EXIT_FAILURE);
+
+	/* 8. Let the GMT API garbage collection free the rest of the memory used */
 	GMT_Report (API, GMT_MSG_VERBOSE, "Mapping completed\n");
 	
 	Return (EXIT_SUCCESS);
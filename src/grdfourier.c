@@ -38,22 +38,44 @@
 #define THIS_MODULE_OPTIONS		"-VRIfr"	/* List the GMT options your program may need */
 
 #define MY_FFT_DIM	2	/* Dimension of FFT needed */
+#define MY_HALO		1.5	/* Extra rows on each side of a strip [-T], in filter widths */
+#define MY_BLOCK	1024	/* Columns done together in the y pass of the spatial convolution [-E] */
+#define MY_ROWS		16	/* Rows handed to a worker at a time in the spatial convolution [-E] */
 
 #include "custom_version.h"	/* Must include this to use Custom_version */
+#include "custom_threads.h"	/* For our worker pool */
 
 /* Add any other include files needed by your program */
 #include <math.h>
 #include <string.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_FFTW3F
+#include <fftw3.h>	/* To load, check, and save the FFTW wisdom ourselves [-W] */
+#endif
 #ifndef M_PI
 #define M_PI          3.14159265358979323846
 #endif
 
 EXTERN_MSC int GMT_grdfourier (void *API, int mode, void *args);
 
+struct GRDFOURIER_STAGE {	/* One filter in the chain applied to the spectrum [-S] */
+	char type;	/* g (Gaussian from -F), b (Butterworth), c (cosine taper), or u (continuation) */
+	unsigned int order;	/* Order of the Butterworth filter */
+	double k[4];	/* Cutoff wavenumbers, 0 for a side not filtered, or the continuation level in k[0] */
+};
+
 struct GMT_GRDFOURIER_CTRL {	/* Here is where you collect your programs specific options */
-	struct In {	/* Input grid file */
+	struct In {	/* Input grid file(s) */
 		unsigned int active;	/* 1 if this option was specified */
-		char *file;	/* Name of input grid file */
+		unsigned int n_files;	/* Number of input grids, given as arguments or listed in -L<file> */
+		char **files;	/* Names of the input grid files */
+		char *file;	/* Name of the input grid file being filtered (one of files) */
 	} In;
 	struct A {	/* -A<row/col> specifies location where a spike will be added */
 		unsigned int active;	/* 1 if this option was specified */
@@ -63,18 +85,55 @@ struct GMT_GRDFOURIER_CTRL {	/* Here is where you collect your programs specific
 		unsigned int active;	/* 1 if this option was specified */
 		char dir;	/* 0, 1, or 2 */
 	} D;
-	struct F {	/* -F<width> sets Gaussian filter width */
+	struct E {	/* -E[a|f|s] selects the engine: automatic, FFT, or spatial convolution */
+		unsigned int active;	/* 1 if this option was specified */
+		unsigned int geographic;	/* 1 if -fg was given, which only the FFT handles */
+		char mode;	/* a, f, or s */
+		char engine;	/* f or s, as chosen for the grid being filtered */
+	} E;
+	struct F {	/* -F<width>[,<width>,...] sets Gaussian filter width(s) */
 		unsigned int active;	/* 1 if this option was specified */
+		unsigned int n_widths;	/* Number of widths; more than one gives one output grid per width */
 		double width;	/* Width Gaussian filter */
+		double *widths;	/* All the widths given */
 	} F;
 	struct G {	/* -G<outfile> sets the output file name */
 		unsigned int active;	/* 1 if this option was specified */
 		char *file;	/* The filename */
 	} G;
+	struct H {	/* -H uses a half-spectrum (real-to-complex) transform */
+		unsigned int active;	/* 1 if this option was specified */
+	} H;
+	struct S {	/* -Sb<short>/<long>[/<order>] | -Sc<l0>/<l1>/<l2>/<l3> | -Su<z>, repeatable */
+		unsigned int active;	/* 1 if this option was specified */
+		unsigned int n_stages;	/* Number of filters in the chain */
+		struct GRDFOURIER_STAGE *stage;	/* The filters, applied together in one pass over the spectrum */
+	} S;
+	struct T {	/* -T<rows> filters the grid in strips of this many rows */
+		unsigned int active;	/* 1 if this option was specified */
+		unsigned int rows;	/* Rows per strip */
+	} T;
+	struct W {	/* -W<file>[+p<planner>] keeps the FFTW wisdom in <file> */
+		unsigned int active;	/* 1 if this option was specified */
+		char *file;	/* The FFTW wisdom file */
+		char *planner;	/* FFTW planner: measure, patient, or exhaustive */
+	} W;
+	struct M {	/* -M does the filter math in single precision */
+		unsigned int active;	/* 1 if this option was specified */
+	} M;
 	struct N {	/* -N[f|q|s<nx>/<ny>][+e|m|n][+t<width>][+w[<suffix>]][+z[p]] */
 		unsigned int active;	/* 1 if this option was specified */
 		void *info;	/* Provided by the API */
 	} N;
+	struct x {	/* -x[[-]<n>] */
+		unsigned int active;	/* 1 if this option was specified */
+		unsigned int n_threads;	/* Number of threads to use */
+	} x;
+	struct work {	/* Not an option: Scratch space for -Es, kept between grids and strips */
+		gmt_grdfloat *tmp;	/* The grid after the x pass */
+		double *acc;	/* Accumulators for all threads */
+		uint64_t n_tmp, n_acc;	/* Allocated lengths of tmp and acc */
+	} work;
 };
 
 static struct GMT_GRDFOURIER_CTRL * New_Ctrl (void *API) {	/* Allocate and initialize a new control structure for your program*/
@@ -85,14 +144,24 @@ static struct GMT_GRDFOURIER_CTRL * New_Ctrl (void *API) {	/* Allocate and initi
 	/* Initialize values whose defaults are not 0/false/NULL */
 
 	C->D.dir = 'r';		/* Default is radial wavenumbers */
+	C->E.mode = 'f';	/* Default is to filter in the frequency domain */
 	C->F.width = 100000.0;	/* Default for -F is 100 km */
+	C->F.n_widths = 1;
+	C->x.n_threads = 1;	/* Default is a single thread */
 	return (C);
 }
 
 static void Free_Ctrl (void *API, struct GMT_GRDFOURIER_CTRL *C) {	/* Free memory used by Ctrl and deallocate it */
+	unsigned int k;
 	if (!C) return;
-	if (C->In.file) free (C->In.file);	
+	for (k = 0; k < C->In.n_files; k++) free (C->In.files[k]);
+	if (C->In.files) free (C->In.files);
 	if (C->G.file)  free (C->G.file);	
+	if (C->F.widths) free (C->F.widths);
+	if (C->S.stage) free (C->S.stage);
+	if (C->W.file)  free (C->W.file);
+	if (C->work.tmp) free (C->work.tmp);
+	if (C->work.acc) free (C->work.acc);
 	if (C->N.info)  GMT_FFT_Destroy (API, C->N.info);
 	free (C);	
 }
@@ -101,27 +170,255 @@ static int usage (void *API, int level) {
 	const char *name = gmt_show_name_and_purpose (API, THIS_MODULE_LIB, THIS_MODULE_CLASSIC_NAME, THIS_MODULE_PURPOSE);
 	/* Specifies the full usage message from the program when no argument are given */
 	if (level == GMT_MODULE_PURPOSE) return (GMT_NOERROR);
-	GMT_Message (API, GMT_TIME_NONE, "usage: %s -G<outgrid> [<ingrid> ][-I<xinc>[/<yinc>]]\n", name);
-	GMT_Message (API, GMT_TIME_NONE, "	[-R<xmin/xmax/ymin/ymax>] [-A<row/col>] [-D<dir>] [-F<width>]\n\n");
+	GMT_Message (API, GMT_TIME_NONE, "usage: %s -G<outgrid> [<ingrid> ...] [-I<xinc>[/<yinc>]] [-L<list>]\n", name);
+	GMT_Message (API, GMT_TIME_NONE, "	[-R<xmin/xmax/ymin/ymax>] [-A<row/col>] [-D<dir>] [-E[a|f|s]] [-F<width>[,<width>,...]] [-H] [-M]\n");
+	GMT_Message (API, GMT_TIME_NONE, "	[-Sb|c|u<params>] [-T<rows>] [-W<file>[+p<planner>]] [%s]\n\n", CUSTOM_x_OPT);
 
 	if (level == GMT_SYNOPSIS) return (GMT_MODULE_SYNOPSIS);	/* Stop here when only a hyphen is given as argument */
 
-	GMT_Message (API, GMT_TIME_NONE, "\t-G filename for output netCDF grid file.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-G filename for output netCDF grid file.  With several -F widths, give a template with a\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   single floating-point format (%%e, %%f, or %%g) for the width, e.g., -Gfilt_%%g.nc.  With several input grids, give a\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   template with %%s for the name of each input grid without its extension, e.g., -G%%s_filt.nc.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\tOPTIONS:\n");
-	GMT_Message (API, GMT_TIME_NONE, "\t<ingrid> is an optional grid file to start with instead of -R -I [-r].\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t<ingrid> is an optional grid file to start with instead of -R -I [-r].  Give several grids to\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   filter them one after the other in the same session.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-A Specify a row,col pair indicating where to place a unit impulse [in the middle].\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-D Direction for filter: x, y, or r [r]\n");
-	GMT_Message (API, GMT_TIME_NONE, "\t-F Specify width for Gaussian filter exp {-(x/width)^2} [100k]\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-E Select the filter engine: f for the FFT, s for a direct convolution with the Gaussian\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   in x and y, or a to pick the cheaper of the two for this grid and width [f, or a if just -E].\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-F Specify width for Gaussian filter exp {-(x/width)^2} [100k].  Give a comma-separated\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   list of widths to filter the same spectrum several times and write one grid per width.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-H Use a half-spectrum transform of the real grid, which needs half the memory and work.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   The grid is transformed as is (no -N settings) and x and y must be Cartesian.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-M Multiply the spectrum by the filter response in single instead of double precision.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   This is faster and changes the result by about 1e-7 of its largest value.\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-I To create a new grid, specify increments <xinc>[/<yinc>].\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-L Read the names of more input grids from <list>, one per record.\n");
 	/* All programs needing the GMT FFT machinery must display the FFT option. Call it N unless taken.
 	 * Pass the dimension of the FFT work (1 for tables, 2 for grids) */
 	GMT_FFT_Option (API, 'N', MY_FFT_DIM, "Choose or inquire about suitable grid dimensions for FFT, and set modifiers:");
 	GMT_Message (API, GMT_TIME_NONE, "\t-R To create a new grid, specify region <xmin/xmax/ymin/ymax>.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-S Add a filter to the chain applied to the spectrum in one pass; repeat for more filters.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   There is no -Sg: the Gaussian is set by -F only.  Wavelengths may have units; give -\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   for a side that should not be cut:\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   b Butterworth filter passing wavelengths between <short> and <long>, i.e., -Sb<short>/-\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t     is a low-pass and -Sb-/<long> a high-pass.  Append /<order> [2].\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   c Cosine-tapered band-pass: Cut wavelengths above <l0> and below <l3>, pass <l1> to <l2>.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   u Continuation to <z> above the grid (below if negative) by exp (-k*z).\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-T Filter the grid in strips of <rows> rows so it need not fit in memory (implies -H).\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   Each strip is read with %g filter widths of extra rows on either side.\n", MY_HALO);
+	GMT_Message (API, GMT_TIME_NONE, "\t-W Use FFTW and keep its planner results (wisdom) between runs in <file>; -V reports whether\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   the wisdom already held a plan for each transform.  Append +p<planner> to select the\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   FFTW planner: measure, patient, or exhaustive [measure].\n");
 	GMT_Message (API, GMT_TIME_NONE, "\t-r Select pixel registration for new grid.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t-x Use <n> threads to apply the filter or convolution over rows, or to filter several -F widths\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   at the same time [1].  Give no <n> to use all cores, or -<n> to use all but <n> cores.\n");
+	GMT_Message (API, GMT_TIME_NONE, "\t   The FFTs themselves are done by GMT and are not threaded by -x.\n");
 
 	return (GMT_MODULE_USAGE);
 }
 
+static unsigned int get_widths (void *API, char *arg, struct GMT_GRDFOURIER_CTRL *Ctrl) {
+	/* Decode -F<width>[,<width>,...].  We split the list ourselves since GMT_Get_Value would
+	 * return all the widths at once */
+	unsigned int n_errors = 0;
+	size_t len;
+	double value[2];
+	char *c = arg, word[GMT_LEN64] = {""};
+
+	Ctrl->F.n_widths = 0;
+	while (*c) {
+		if ((len = strcspn (c, ",")) >= GMT_LEN64) len = GMT_LEN64 - 1;
+		strncpy (word, c, len);	word[len] = '\0';
+		c += strcspn (c, ",");
+		if (*c) c++;	/* Skip the comma */
+		if (GMT_Get_Value (API, word, value) != 1 || value[0] <= 0.0) {
+			GMT_Message (API, GMT_TIME_NONE, "Syntax error -F: Bad width %s\n", word);
+			n_errors++;
+		}
+		else if ((Ctrl->F.widths = realloc (Ctrl->F.widths, (Ctrl->F.n_widths + 1) * sizeof (double))) == NULL)
+			return (n_errors + 1);
+		else
+			Ctrl->F.widths[Ctrl->F.n_widths++] = value[0];
+	}
+	if (Ctrl->F.n_widths == 0) {
+		GMT_Message (API, GMT_TIME_NONE, "Syntax error -F: Must specify a positive width\n");
+		return (n_errors + 1);
+	}
+	Ctrl->F.width = Ctrl->F.widths[0];
+	return (n_errors);
+}
+
+static unsigned int width_format (char *file) {
+	/* Return 1 if the -G template holds exactly one floating-point conversion, %[flags][width][.precision]e|f|g,
+	 * and no other conversions (%% is fine), so it can safely be handed to snprintf with a width */
+	unsigned int n_formats = 0;
+	char *c = file;
+
+	while ((c = strchr (c, '%'))) {
+		if (c[1] == '%') {	/* A literal % */
+			c += 2;
+			continue;
+		}
+		c++;
+		c += strspn (c, "-+ #0");	/* Flags */
+		c += strspn (c, "0123456789");	/* Field width */
+		if (*c == '.') {	/* Precision */
+			c++;
+			c += strspn (c, "0123456789");
+		}
+		if (*c == '\0' || !strchr ("eEfFgG", *c)) return (0);	/* Not a floating-point conversion */
+		n_formats++;
+		c++;
+	}
+	return (n_formats == 1);
+}
+
+static unsigned int get_wisdom (void *API, char *arg, struct GMT_GRDFOURIER_CTRL *Ctrl) {
+	/* Decode -W<file>[+p<planner>] */
+	static char *planners[3] = {"measure", "patient", "exhaustive"};
+	unsigned int k;
+	char *c = NULL;
+
+	Ctrl->W.planner = planners[0];
+	if ((c = strstr (arg, "+p"))) {	/* Select the planner; a unique abbreviation will do */
+		for (k = 0; k < 3 && (c[2] == '\0' || strncmp (&c[2], planners[k], strlen (&c[2]))); k++);
+		if (k == 3) {
+			GMT_Message (API, GMT_TIME_NONE, "Syntax error -W: Planner must be measure, patient, or exhaustive\n");
+			return (1);
+		}
+		Ctrl->W.planner = planners[k];
+		c[0] = '\0';	/* Chop off the modifier */
+	}
+	if (arg[0]) Ctrl->W.file = strdup (arg);
+	if (c) c[0] = '+';	/* Restore the argument */
+	if (Ctrl->W.file == NULL) {
+		GMT_Message (API, GMT_TIME_NONE, "Syntax error -W: Must give the name of the FFTW wisdom file\n");
+		return (1);
+	}
+	return (0);
+}
+
+static unsigned int get_wavenumber (void *API, char *word, double *k) {
+	/* Convert the wavelength in word (with optional unit) to the wavenumber 2 pi / wavelength, or 0 if word is - */
+	double value[2];
+
+	if (!strcmp (word, "-")) {
+		*k = 0.0;
+		return (0);
+	}
+	if (GMT_Get_Value (API, word, value) != 1 || value[0] <= 0.0) {
+		GMT_Message (API, GMT_TIME_NONE, "Syntax error -S: Bad wavelength %s\n", word);
+		return (1);
+	}
+	*k = 2.0 * M_PI / value[0];
+	return (0);
+}
+
+static unsigned int get_stage (void *API, char *arg, unsigned int gauss, struct GMT_GRDFOURIER_CTRL *Ctrl) {
+	/* Decode -Sb<short>/<long>[/<order>], -Sc<l0>/<l1>/<l2>/<l3>, or -Su<z> and append it to the chain of filters.
+	 * The Gaussian of -F is added as g<width> with gauss set; users cannot give -Sg.  We split the arguments
+	 * ourselves since some may be - */
+	static unsigned int n_args[4][2] = {{1, 1}, {2, 3}, {4, 4}, {1, 1}};	/* Range of arguments for g, b, c, u */
+	unsigned int n = 0, k, n_errors = 0;
+	size_t len;
+	double value[2], k_arg[4];
+	char *types = "gbcu", *c = NULL, word[4][GMT_LEN64];
+	struct GRDFOURIER_STAGE *S = NULL;
+
+	if (arg[0] == '\0' || (c = strchr (types, arg[0])) == NULL || (arg[0] == 'g' && !gauss)) {
+		GMT_Message (API, GMT_TIME_NONE, "Syntax error -S: Filter must be b, c, or u (use -F for a Gaussian)\n");
+		return (1);
+	}
+	k = (unsigned int)(c - types);
+	c = &arg[1];
+	while (*c && n < 4) {
+		if ((len = strcspn (c, "/")) >= GMT_LEN64) len = GMT_LEN64 - 1;
+		strncpy (word[n], c, len);	word[n++][len] = '\0';
+		c += strcspn (c, "/");
+		if (*c) c++;	/* Skip the slash */
+	}
+	if (*c || n < n_args[k][0] || n > n_args[k][1]) {
+		GMT_Message (API, GMT_TIME_NONE, "Syntax error -S%c: Wrong number of arguments\n", arg[0]);
+		return (1);
+	}
+	if ((S = realloc (Ctrl->S.stage, (Ctrl->S.n_stages + 1) * sizeof (struct GRDFOURIER_STAGE))) == NULL) return (1);
+	Ctrl->S.stage = S;
+	S = &Ctrl->S.stage[Ctrl->S.n_stages];
+	memset (S, 0, sizeof (struct GRDFOURIER_STAGE));
+	S->type = arg[0];
+	switch (S->type) {
+		case 'g':	/* k_ref = 2 pi / width, as for -F */
+			n_errors += get_wavenumber (API, word[0], &S->k[0]);
+			break;
+		case 'b':	/* Low-pass wavenumber from the short wavelength, high-pass wavenumber from the long one */
+			n_errors += get_wavenumber (API, word[0], &S->k[1]);
+			n_errors += get_wavenumber (API, word[1], &S->k[0]);
+			S->order = (n == 3) ? (unsigned int)atoi (word[2]) : 2;
+			if (S->order == 0 || S->order > 64) GMT_Message (API, GMT_TIME_NONE, "Syntax error -Sb: Order must be 1-64\n"), n_errors++;
+			if (S->k[1] > 0.0 && S->k[1] <= S->k[0]) GMT_Message (API, GMT_TIME_NONE, "Syntax error -Sb: Short wavelength must be less than the long\n"), n_errors++;
+			break;
+		case 'c':	/* Taper up from k[0] to k[1] and down from k[2] to k[3] */
+			for (k = 0; k < 4; k++) n_errors += get_wavenumber (API, word[k], &k_arg[k]);
+			memcpy (S->k, k_arg, 4 * sizeof (double));
+			if ((S->k[0] == 0.0) != (S->k[1] == 0.0) || (S->k[2] == 0.0) != (S->k[3] == 0.0))
+				GMT_Message (API, GMT_TIME_NONE, "Syntax error -Sc: Give both or neither of <l0>/<l1> and of <l2>/<l3>\n"), n_errors++;
+			else if (S->k[0] >= S->k[1] && S->k[1] > 0.0)
+				GMT_Message (API, GMT_TIME_NONE, "Syntax error -Sc: Must have <l0> > <l1>\n"), n_errors++;
+			else if (S->k[2] >= S->k[3] && S->k[3] > 0.0)
+				GMT_Message (API, GMT_TIME_NONE, "Syntax error -Sc: Must have <l2> > <l3>\n"), n_errors++;
+			else if (S->k[1] > S->k[2] && S->k[2] > 0.0)
+				GMT_Message (API, GMT_TIME_NONE, "Syntax error -Sc: Must have <l1> >= <l2>\n"), n_errors++;
+			break;
+		case 'u':	/* Level z, negative below the grid */
+			if (GMT_Get_Value (API, word[0], value) != 1)
+				GMT_Message (API, GMT_TIME_NONE, "Syntax error -Su: Bad level %s\n", word[0]), n_errors++;
+			else
+				S->k[0] = value[0];
+			break;
+	}
+	Ctrl->S.n_stages++;
+	return (n_errors);
+}
+
+static unsigned int add_file (void *API, char *file, struct GMT_GRDFOURIER_CTRL *Ctrl) {
+	/* Append one more input grid to the list */
+	char **files = NULL;
+
+	if ((files = realloc (Ctrl->In.files, (Ctrl->In.n_files + 1) * sizeof (char *))) == NULL || (files[Ctrl->In.n_files] = strdup (file)) == NULL) {
+		if (files) Ctrl->In.files = files;
+		GMT_Message (API, GMT_TIME_NONE, "Unable to allocate memory for the list of input grids\n");
+		return (1);
+	}
+	Ctrl->In.files = files;
+	Ctrl->In.file = files[0];
+	Ctrl->In.n_files++;
+	return (0);
+}
+
+static unsigned int get_list (void *API, char *arg, struct GMT_GRDFOURIER_CTRL *Ctrl) {
+	/* Decode -L<listfile>: One input grid per record; blank records and those starting with # are skipped */
+	unsigned int n_errors = 0;
+	size_t len;
+	char record[GMT_BUFSIZ] = {""}, *c = NULL;
+	FILE *fp = NULL;
+
+	if ((fp = fopen (arg, "r")) == NULL) {
+		GMT_Message (API, GMT_TIME_NONE, "Syntax error -L: Cannot open list file %s\n", arg);
+		return (1);
+	}
+	while (fgets (record, GMT_BUFSIZ, fp)) {
+		for (c = record; *c == ' ' || *c == '\t'; c++);	/* Skip leading whitespace */
+		len = strcspn (c, "\r\n");
+		while (len && (c[len-1] == ' ' || c[len-1] == '\t')) len--;	/* and trailing whitespace */
+		c[len] = '\0';
+		if (len == 0 || c[0] == '#') continue;
+		n_errors += add_file (API, c, Ctrl);
+	}
+	fclose (fp);
+	return (n_errors);
+}
+
 static int parse (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_OPTION *options) {
 	/* This parses the options provided to grdfourier and sets parameters in Ctrl.
 	 * Note: Ctrl has already been initialized and non-zero default values set.
@@ -135,15 +432,9 @@ static int parse (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_OPTION
 	for (opt = options; opt; opt = opt->next) {	/* Process all the options given */
 		if (strchr (THIS_MODULE_OPTIONS, opt->option)) continue;	/* Skip GMT common options */
 		switch (opt->option) {
-			case '<':	/* Input file */
-				if (Ctrl->In.active) {
-					GMT_Message (API, GMT_TIME_NONE, "Syntax error: Only one input file allowed\n");
-				}
-				else {
-					Ctrl->In.active = 1;
-					Ctrl->In.file = malloc (strlen (opt->arg) + 1);
-					strcpy (Ctrl->In.file, opt->arg);
-				}
+			case '<':	/* Input file(s) */
+				Ctrl->In.active = 1;
+				n_errors += add_file (API, opt->arg, Ctrl);
 				break;
 			case 'A':	/* Location of spike */
 				Ctrl->A.active = 1;
@@ -160,19 +451,54 @@ static int parse (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_OPTION
 				Ctrl->D.active = 1;
 				Ctrl->D.dir = opt->arg[0];
 				break;
-			case 'F':	/* Gaussian filter width */
+			case 'E':	/* Select the engine */
+				Ctrl->E.active = 1;
+				Ctrl->E.mode = (opt->arg[0]) ? opt->arg[0] : 'a';
+				break;
+			case 'F':	/* Gaussian filter width(s) */
 				Ctrl->F.active = 1;
-				if ((ret = GMT_Get_Value (API, opt->arg, value)) == 1) Ctrl->F.width = value[0];
+				n_errors += get_widths (API, opt->arg, Ctrl);
 				break;
 			case 'G':	/* Output file */
 				Ctrl->G.active = 1;
 				Ctrl->G.file = malloc (strlen (opt->arg) + 1);
 				strcpy (Ctrl->G.file, opt->arg);
 				break;
+			case 'H':	/* Half-spectrum transform */
+				Ctrl->H.active = 1;
+				break;
+			case 'S':	/* Add a filter to the chain */
+				Ctrl->S.active = 1;
+				n_errors += get_stage (API, opt->arg, 0, Ctrl);
+				break;
+			case 'T':	/* Filter in strips */
+				Ctrl->T.active = 1;
+				if ((ret = atoi (opt->arg)) > 0)
+					Ctrl->T.rows = (unsigned int)ret;
+				else {
+					GMT_Message (API, GMT_TIME_NONE, "Syntax error -T: Must give a positive number of rows\n");
+					n_errors ++;
+				}
+				break;
+			case 'L':	/* List of input files */
+				Ctrl->In.active = 1;
+				n_errors += get_list (API, opt->arg, Ctrl);
+				break;
+			case 'M':	/* Single precision */
+				Ctrl->M.active = 1;
+				break;
 			case 'N':	/* Grid dimension setting or inquiery */
 				Ctrl->N.active = 1;
 				if ((Ctrl->N.info = GMT_FFT_Parse (API, 'N', MY_FFT_DIM, opt->arg)) == NULL) n_errors ++;
 				break;
+			case 'W':	/* Keep FFTW wisdom */
+				Ctrl->W.active = 1;
+				n_errors += get_wisdom (API, opt->arg, Ctrl);
+				break;
+			case 'x':	/* Number of threads */
+				Ctrl->x.active = 1;
+				Ctrl->x.n_threads = custom_get_n_threads (opt->arg);
+				break;
 			default:	/* Report bad options */
 				GMT_Message (API, GMT_TIME_NONE, "Syntax error: Unrecognized option %c%s\n", opt->option, opt->arg);
 				n_errors ++;
@@ -181,11 +507,1027 @@ static int parse (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_OPTION
 	}
 
 	if (!Ctrl->G.active) GMT_Message (API, GMT_TIME_NONE, "Syntax error: Must specify output file\n"), n_errors++;
-	if (Ctrl->F.active && Ctrl->F.width <= 0.0) GMT_Message (API, GMT_TIME_NONE, "Syntax error -F: Must specify a positive width\n"), n_errors++;
+	if (Ctrl->T.active) Ctrl->H.active = 1;	/* Strips are filtered with the half-spectrum transform */
+	if (Ctrl->H.active && Ctrl->N.active) GMT_Message (API, GMT_TIME_NONE, "Syntax error -H: Cannot be combined with -N\n"), n_errors++;
+	if ((opt = GMT_Find_Option (API, 'f', options)) && strchr (opt->arg, 'g')) Ctrl->E.geographic = 1;
+	if (Ctrl->H.active && Ctrl->E.geographic) GMT_Message (API, GMT_TIME_NONE, "Syntax error -H: Requires Cartesian x and y\n"), n_errors++;
+	if (!strchr ("afs", Ctrl->E.mode)) GMT_Message (API, GMT_TIME_NONE, "Syntax error -E: Engine must be a, f, or s\n"), n_errors++;
+	if (Ctrl->E.mode == 's' && Ctrl->E.geographic) GMT_Message (API, GMT_TIME_NONE, "Syntax error -Es: Requires Cartesian x and y\n"), n_errors++;
+	if (Ctrl->E.mode == 's' && Ctrl->N.active) GMT_Message (API, GMT_TIME_NONE, "Syntax error -Es: Cannot be combined with -N\n"), n_errors++;
+	if (Ctrl->M.active && (Ctrl->H.active || Ctrl->E.mode == 's')) GMT_Message (API, GMT_TIME_NONE, "Syntax error -M: Only applies to the full complex transform (not -Es, -H, or -T)\n"), n_errors++;
+	if (Ctrl->E.mode == 's' && Ctrl->F.n_widths > 1) GMT_Message (API, GMT_TIME_NONE, "Syntax error -Es: Only one -F width can be used\n"), n_errors++;
+	if (!strchr ("xyr", Ctrl->D.dir)) GMT_Message (API, GMT_TIME_NONE, "Syntax error -D: Direction must be x, y, or r\n"), n_errors++;
+	if (Ctrl->F.n_widths > 1 && Ctrl->G.active && !width_format (Ctrl->G.file)) GMT_Message (API, GMT_TIME_NONE, "Syntax error -G: Several -F widths need a file name template with a single floating-point format (e.g., %%g) for the width\n"), n_errors++;
+	if (Ctrl->F.n_widths > 1 && Ctrl->T.active) GMT_Message (API, GMT_TIME_NONE, "Syntax error -T: Cannot filter several -F widths\n"), n_errors++;
+	if (Ctrl->S.active && Ctrl->F.n_widths > 1) GMT_Message (API, GMT_TIME_NONE, "Syntax error -S: Cannot be combined with several -F widths\n"), n_errors++;
+	if (Ctrl->S.active && (Ctrl->T.active || Ctrl->E.mode == 's' || Ctrl->M.active)) GMT_Message (API, GMT_TIME_NONE, "Syntax error -S: Cannot be combined with -Es, -M, or -T\n"), n_errors++;
+	if (Ctrl->S.active && Ctrl->F.active && !n_errors) {	/* Apply the Gaussian as part of the chain */
+		char arg[GMT_LEN64] = {""};
+		snprintf (arg, GMT_LEN64, "g%.17g", Ctrl->F.width);
+		n_errors += get_stage (API, arg, 1, Ctrl);
+	}
+	if (Ctrl->x.n_threads > 1 && Ctrl->E.mode != 's') GMT_Report (API, GMT_MSG_VERBOSE, "-x: %u threads apply the filter, but the FFTs are done by GMT and stay single-threaded unless GMT threads them\n", Ctrl->x.n_threads);
+	if (Ctrl->In.active && Ctrl->In.n_files == 0) GMT_Message (API, GMT_TIME_NONE, "Syntax error -L: No grid files listed\n"), n_errors++;
+	if (Ctrl->In.n_files > 1 && Ctrl->F.n_widths > 1) GMT_Message (API, GMT_TIME_NONE, "Syntax error: Several input grids cannot be combined with several -F widths\n"), n_errors++;
+	if (Ctrl->In.n_files > 1 && Ctrl->G.active && !strstr (Ctrl->G.file, "%s")) GMT_Message (API, GMT_TIME_NONE, "Syntax error -G: Several input grids need a file name template with %%s for the input name\n"), n_errors++;
 
 	return (n_errors);
 }
 
+static double *get_response (void *API, void *FFT_info, unsigned int n, uint64_t stride, unsigned int mode, double k_ref, unsigned int active) {
+	/* Return the Gaussian response exp (-(k/k_ref)^2) for the n wavenumbers along x (mode 0) or y (mode 1)
+	 * of the complex grid, where stride is the distance between consecutive columns or rows in the array
+	 * of {real, imag} pairs.  Each value is stored twice so it lines up with both the real and imaginary
+	 * component.  If this direction is not filtered (active = 0) the response is 1 */
+	unsigned int i;
+	double k, *f = NULL;
+
+	if ((f = malloc (2 * n * sizeof (double))) == NULL) return (NULL);
+	for (i = 0; i < n; i++) {
+		k = (active) ? GMT_FFT_Wavenumber (API, i * stride, mode, FFT_info) / k_ref : 0.0;
+		f[2*i] = f[2*i+1] = exp (-k * k);
+	}
+	return (f);
+}
+
+static void apply_response (gmt_grdfloat *data, unsigned int nx, unsigned int ny, double *f_x, double *f_y) {
+	/* Multiply the complex grid by the separable response f_x[col] * f_y[row].  Since the Gaussian
+	 * exp (-(kx^2+ky^2)/k_ref^2) = exp (-(kx/k_ref)^2) * exp (-(ky/k_ref)^2) this is exact for all
+	 * directions.  The inner loop runs over the interleaved {real, imag} values without branches or
+	 * function calls so the compiler can vectorize it */
+	unsigned int row, i, n = 2 * nx;
+	double f_row;
+	gmt_grdfloat *z = NULL;
+
+	for (row = 0; row < ny; row++) {
+		z = &data[(uint64_t)row * n];
+		f_row = f_y[2*row];
+		for (i = 0; i < n; i++) z[i] *= f_row * f_x[i];
+	}
+}
+
+static float *get_response_f (double *f, unsigned int n) {
+	/* Return a single precision copy of the 2*n values of a response from get_response, or NULL if there is none */
+	unsigned int i;
+	float *g = NULL;
+
+	if (f == NULL || (g = malloc (2 * n * sizeof (float))) == NULL) return (NULL);
+	for (i = 0; i < 2 * n; i++) g[i] = (float)f[i];
+	return (g);
+}
+
+static void apply_response_f (gmt_grdfloat *data, unsigned int nx, unsigned int ny, float *f_x, float *f_y) {
+	/* Same as apply_response but in single precision, which lets the compiler do twice as many values per
+	 * vector instruction and halves the memory traffic for f_x.  The product f_row * f_x[i] is rounded once
+	 * more than in double precision, so the result changes by about one unit in the last place */
+	unsigned int row, i, n = 2 * nx;
+	float f_row;
+	gmt_grdfloat *z = NULL;
+
+	for (row = 0; row < ny; row++) {
+		z = &data[(uint64_t)row * n];
+		f_row = f_y[2*row];
+		for (i = 0; i < n; i++) z[i] *= f_row * f_x[i];
+	}
+}
+
+struct GRDFOURIER_CHAIN {	/* The -S filters and the wavenumbers of the spectrum they apply to */
+	unsigned int n_stages;	/* Number of filters */
+	struct GRDFOURIER_STAGE *stage;	/* The filters */
+	double *kx2, *ky2;	/* Squared wavenumbers along x and y, 0 in a direction not filtered [-D] */
+	double scale;		/* Factor for the response, e.g., to undo the FFT scaling of -H */
+};
+
+static void chain_response (struct GRDFOURIER_CHAIN *C, unsigned int row, unsigned int n, double *k, double *h) {
+	/* Set h to the product of the responses of all filters in the chain at the n wavenumbers of this row.  The
+	 * filters are functions of |k| only, which unlike the Gaussian are not separable in kx and ky, so we get |k|
+	 * once per node in k and then let each filter scale h in turn.  The caller then visits the spectrum once */
+	unsigned int i, s, p;
+	double r, q;
+	struct GRDFOURIER_STAGE *S = NULL;
+
+	for (i = 0; i < n; i++) {
+		k[i] = sqrt (C->kx2[i] + C->ky2[row]);
+		h[i] = C->scale;
+	}
+	for (s = 0; s < C->n_stages; s++) {
+		S = &C->stage[s];
+		switch (S->type) {
+			case 'g':	/* Gaussian exp (-(k/k_ref)^2) */
+				for (i = 0; i < n; i++) {
+					r = k[i] / S->k[0];
+					h[i] *= exp (-r * r);
+				}
+				break;
+			case 'b':	/* Butterworth low-pass 1/sqrt (1 + (k/k[1])^2n) and high-pass 1/sqrt (1 + (k[0]/k)^2n) */
+				for (i = 0; i < n; i++) {
+					if (S->k[1] > 0.0) {
+						r = k[i] / S->k[1];	r *= r;
+						for (p = 1, q = r; p < S->order; p++) q *= r;
+						h[i] /= sqrt (1.0 + q);
+					}
+					if (S->k[0] > 0.0 && k[i] == 0.0)	/* The mean is removed */
+						h[i] = 0.0;
+					else if (S->k[0] > 0.0) {
+						r = S->k[0] / k[i];	r *= r;
+						for (p = 1, q = r; p < S->order; p++) q *= r;
+						h[i] /= sqrt (1.0 + q);
+					}
+				}
+				break;
+			case 'c':	/* Cosine taper up from k[0] to k[1] and down from k[2] to k[3] */
+				for (i = 0; i < n; i++) {
+					if (S->k[1] > 0.0) {
+						if (k[i] <= S->k[0]) h[i] = 0.0;
+						else if (k[i] < S->k[1]) h[i] *= 0.5 * (1.0 - cos (M_PI * (k[i] - S->k[0]) / (S->k[1] - S->k[0])));
+					}
+					if (S->k[3] > 0.0) {
+						if (k[i] >= S->k[3]) h[i] = 0.0;
+						else if (k[i] > S->k[2]) h[i] *= 0.5 * (1.0 + cos (M_PI * (k[i] - S->k[2]) / (S->k[3] - S->k[2])));
+					}
+				}
+				break;
+			case 'u':	/* Continuation exp (-k z) */
+				for (i = 0; i < n; i++) h[i] *= exp (-k[i] * S->k[0]);
+				break;
+		}
+	}
+}
+
+static void apply_chain (gmt_grdfloat *data, unsigned int nx, unsigned int row0, unsigned int row1, struct GRDFOURIER_CHAIN *C, double *buf) {
+	/* Multiply the rows [row0, row1) of the complex grid of nx columns by the response of the chain of filters,
+	 * using buf for 2*nx values */
+	unsigned int row, i;
+	double *h = &buf[nx];
+	gmt_grdfloat *z = NULL;
+
+	for (row = row0; row < row1; row++) {
+		chain_response (C, row, nx, buf, h);
+		z = &data[2 * (uint64_t)row * nx];
+		for (i = 0; i < nx; i++) {
+			z[2*i] *= h[i];
+			z[2*i+1] *= h[i];
+		}
+	}
+}
+
+static double *get_wavenumbers (void *API, void *FFT_info, unsigned int n, uint64_t stride, unsigned int mode, unsigned int active) {
+	/* Return the squared wavenumbers along x (mode 0) or y (mode 1) of the complex grid, with stride as for
+	 * get_response, or zeros if this direction is not filtered (active = 0) */
+	unsigned int i;
+	double k, *k2 = NULL;
+
+	if ((k2 = malloc (n * sizeof (double))) == NULL) return (NULL);
+	for (i = 0; i < n; i++) {
+		k = (active) ? GMT_FFT_Wavenumber (API, i * stride, mode, FFT_info) : 0.0;
+		k2[i] = k * k;
+	}
+	return (k2);
+}
+
+static double *get_half_wavenumbers (unsigned int n, double inc, unsigned int active) {
+	/* Return the squared wavenumbers of a transform of length n with spacing inc, in the order used by
+	 * get_half_response, or zeros if this direction is not filtered (active = 0) */
+	unsigned int i;
+	double k, f_k = 2.0 * M_PI / (n * inc), *k2 = NULL;
+
+	if ((k2 = malloc (n * sizeof (double))) == NULL) return (NULL);
+	for (i = 0; i < n; i++) {
+		k = (active) ? f_k * ((i <= n / 2) ? (double)i : (double)i - n) : 0.0;
+		k2[i] = k * k;
+	}
+	return (k2);
+}
+
+static double *get_half_response (unsigned int n, double inc, double k_ref, unsigned int active, double scale) {
+	/* Return scale * exp (-(k/k_ref)^2) for the n wavenumbers of a transform of length n with spacing inc,
+	 * in the usual FFT order (0, 1, ..., n/2, -(n/2-1), ..., -1) * 2 pi / (n * inc).  If this direction is
+	 * not filtered (active = 0) the response is just scale */
+	unsigned int i;
+	double k, f_k = 2.0 * M_PI / (n * inc * k_ref), *f = NULL;
+
+	if ((f = malloc (n * sizeof (double))) == NULL) return (NULL);
+	for (i = 0; i < n; i++) {
+		k = (active) ? f_k * ((i <= n / 2) ? (double)i : (double)i - n) : 0.0;
+		f[i] = scale * exp (-k * k);
+	}
+	return (f);
+}
+
+static void apply_half_response (gmt_grdfloat *z, unsigned int nc, unsigned int ny, unsigned int row0, unsigned int row1, double *f_x, double *f_y, double *w, struct GRDFOURIER_CHAIN *C, double *buf) {
+	/* z holds the forward transform Z of the real ny by 2*nc grid packed as ny rows of nc complex values, i.e.,
+	 * the even columns as the real and the odd columns as the imaginary parts.  With E and O the transforms of
+	 * the even and odd columns we have Z = E + iO, and the transform of the real grid is F(k) = E(k) + W^k O(k)
+	 * and F(k+nc) = E(k) - W^k O(k) for k < nc, where W^k = exp (-2 pi i k / (2 nc)) is stored in w.  Rather than
+	 * forming F we apply the response H to E and O directly:
+	 *	E' = P E + Q W^k O and O' = Q W^-k E + P O, with P = (H(k) + H(k+nc)) / 2 and Q = (H(k) - H(k+nc)) / 2,
+	 * so that z becomes the packed transform of the filtered real grid.  E and O follow from Z(k) and Z(-k);
+	 * since E(-k) and O(-k) are their complex conjugates we do each pair of (k, -k) nodes together.  The response
+	 * for x wavenumber k and row j is f_x[k] * f_y[j], with f_x of length 2*nc.  We only do the rows [row0, row1)
+	 * and their partners, so different workers can take different rows as long as these are <= ny/2.  With a
+	 * chain of filters C the response comes from chain_response for both rows instead, using buf for 6*nc values */
+	unsigned int row, row2, col, col2, pass, c, j;
+	uint64_t a, b;
+	double *h[2] = {NULL, NULL}, e_re, e_im, o_re, o_im, h_a, h_b, p, q, w_re, w_im, wo_re, wo_im, we_re, we_im, sign, out[4];
+
+	if (C) {	/* Rows k and -k of the response follow the scratch space for |k| */
+		h[0] = &buf[2*nc];	h[1] = &buf[4*nc];
+	}
+	for (row = row0; row < row1; row++) {
+		row2 = (ny - row) % ny;
+		if (row2 < row) continue;	/* Already done as the partner of row2 */
+		if (C) {	/* Evaluate the chain along both rows */
+			chain_response (C, row, 2 * nc, buf, h[0]);
+			chain_response (C, row2, 2 * nc, buf, h[1]);
+		}
+		for (col = 0; col < nc; col++) {
+			col2 = (nc - col) % nc;
+			if (row2 == row && col2 < col) continue;	/* Already done as the partner of col2 */
+			a = 2 * ((uint64_t)row * nc + col);	b = 2 * ((uint64_t)row2 * nc + col2);
+			e_re = 0.5 * (z[a] + z[b]);	e_im = 0.5 * (z[a+1] - z[b+1]);	/* E = (Z(k) + conj (Z(-k))) / 2 */
+			o_re = 0.5 * (z[a+1] + z[b+1]);	o_im = 0.5 * (z[b] - z[a]);	/* O = (Z(k) - conj (Z(-k))) / 2i */
+			for (pass = 0, sign = 1.0; pass < 2; pass++, sign = -1.0) {	/* Node k, then node -k which has the conjugate E and O */
+				c = (pass) ? col2 : col;	j = (pass) ? row2 : row;
+				if (C) {
+					h_a = h[pass][c];	h_b = h[pass][c+nc];
+				}
+				else {
+					h_a = f_x[c] * f_y[j];	h_b = f_x[c+nc] * f_y[j];
+				}
+				p = 0.5 * (h_a + h_b);	q = 0.5 * (h_a - h_b);
+				w_re = w[2*c];	w_im = w[2*c+1];
+				wo_re = w_re * o_re - w_im * sign * o_im;	wo_im = w_re * sign * o_im + w_im * o_re;	/* W^k O */
+				we_re = w_re * e_re + w_im * sign * e_im;	we_im = w_re * sign * e_im - w_im * e_re;	/* W^-k E */
+				out[2*pass]   = p * e_re + q * wo_re - (q * we_im + p * sign * o_im);	/* Real part of E' + i O' */
+				out[2*pass+1] = p * sign * e_im + q * wo_im + (q * we_re + p * o_re);	/* Imag part of E' + i O' */
+			}
+			z[a] = (gmt_grdfloat)out[0];	z[a+1] = (gmt_grdfloat)out[1];
+			z[b] = (gmt_grdfloat)out[2];	z[b+1] = (gmt_grdfloat)out[3];	/* Same node if k = -k */
+		}
+	}
+}
+
+struct GRDFOURIER_FILTER {	/* What the workers share when multiplying one spectrum by the response */
+	unsigned int nx, ny;	/* Dimensions of the complex spectrum */
+	double *f_x, *f_y;	/* The response along x and y */
+	float *g_x, *g_y;	/* The same in single precision [-M], else NULL */
+	double *w;		/* Twiddle factors for the half-spectrum transform, else NULL */
+	struct GRDFOURIER_CHAIN *chain;	/* The -S filters to apply instead of f_x, f_y, else NULL */
+	double *buf;		/* Scratch space for the -S response, n_buf values per worker */
+	uint64_t n_buf;
+	gmt_grdfloat *z;	/* The spectrum */
+};
+
+static void filter_rows (void *arg, uint64_t start, uint64_t end, unsigned int thread_id) {
+	/* Apply the response to the rows [start, end) of the spectrum */
+	struct GRDFOURIER_FILTER *F = arg;
+	double *buf = (F->chain) ? &F->buf[thread_id * F->n_buf] : NULL;
+	if (F->w)	/* Row start also does its partner ny - start */
+		apply_half_response (F->z, F->nx, F->ny, (unsigned int)start, (unsigned int)end, F->f_x, F->f_y, F->w, F->chain, buf);
+	else if (F->chain)
+		apply_chain (F->z, F->nx, (unsigned int)start, (unsigned int)end, F->chain, buf);
+	else if (F->g_x)
+		apply_response_f (&F->z[2 * start * F->nx], F->nx, (unsigned int)(end - start), F->g_x, &F->g_y[2 * start]);
+	else
+		apply_response (&F->z[2 * start * F->nx], F->nx, (unsigned int)(end - start), F->f_x, &F->f_y[2 * start]);
+}
+
+static int threaded_response (unsigned int n_threads, gmt_grdfloat *z, unsigned int nx, unsigned int ny, double *f_x, double *f_y, float *g_x, float *g_y, double *w, struct GRDFOURIER_CHAIN *chain) {
+	/* Multiply the spectrum by the response using n_threads workers, each taking MY_ROWS rows at a time.  Pass
+	 * the single precision response in g_x, g_y to use that instead [-M], or the chain of -S filters to apply
+	 * those.  With the half-spectrum transform each row is done with its partner, so only rows 0 to ny/2 are
+	 * handed out */
+	int error;
+	struct GRDFOURIER_FILTER F;
+
+	memset (&F, 0, sizeof (struct GRDFOURIER_FILTER));
+	F.z = z;	F.nx = nx;	F.ny = ny;	F.f_x = f_x;	F.f_y = f_y;	F.g_x = g_x;	F.g_y = g_y;	F.w = w;
+	if ((F.chain = chain)) {	/* Each worker needs room for |k| and the response along one row, or two with -H */
+		F.n_buf = (w) ? 6 * (uint64_t)nx : 2 * (uint64_t)nx;
+		if ((F.buf = malloc (n_threads * F.n_buf * sizeof (double))) == NULL) return (EXIT_FAILURE);
+	}
+	error = custom_parallel_for (n_threads, (w) ? ny / 2 + 1 : ny, MY_ROWS, filter_rows, &F);
+	free (F.buf);
+	return (error);
+}
+
+#ifdef HAVE_FFTW3F
+static unsigned int planner_flags (char *planner) {
+	/* Return the FFTW flags for the -W planner */
+	if (!strcmp (planner, "exhaustive")) return (FFTW_EXHAUSTIVE);
+	if (!strcmp (planner, "patient")) return (FFTW_PATIENT);
+	return (FFTW_MEASURE);
+}
+#endif
+
+static void wisdom_load (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl) {
+	/* With -W, add the FFTW wisdom in Ctrl->W.file to that of this process, which GMT plans its transforms with */
+#ifdef HAVE_FFTW3F
+	FILE *fp = NULL;
+
+	if (!Ctrl->W.active) return;
+	if ((fp = fopen (Ctrl->W.file, "r")) == NULL) {
+		GMT_Report (API, GMT_MSG_VERBOSE, "FFTW wisdom file %s does not exist yet\n", Ctrl->W.file);
+		return;
+	}
+	fclose (fp);
+	if (!fftwf_import_wisdom_from_filename (Ctrl->W.file))
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to read the FFTW wisdom in %s; transforms will be planned afresh\n", Ctrl->W.file);
+#else
+	if (Ctrl->W.active) GMT_Report (API, GMT_MSG_VERBOSE, "Built without FFTW: Only GMT keeps the wisdom, and %s is not used\n", Ctrl->W.file);
+#endif
+}
+
+static void wisdom_save (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl) {
+	/* With -W, write the FFTW wisdom of this process to Ctrl->W.file.  We first merge in what other runs may
+	 * have saved since we loaded it, then write a temporary file and rename it so readers never see half a file */
+#ifdef HAVE_FFTW3F
+	int error = 0;
+	char tmp_file[GMT_BUFSIZ] = {""};
+
+	if (!Ctrl->W.active) return;
+	fftwf_import_wisdom_from_filename (Ctrl->W.file);	/* Fails harmlessly if there is no such file */
+	snprintf (tmp_file, GMT_BUFSIZ, "%s.%d", Ctrl->W.file, (int)getpid ());
+	if (!fftwf_export_wisdom_to_filename (tmp_file))
+		error = 1;
+	else if (rename (tmp_file, Ctrl->W.file)) {	/* Some systems will not rename onto an existing file */
+		remove (Ctrl->W.file);
+		if (rename (tmp_file, Ctrl->W.file)) error = 1;
+	}
+	if (error) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to save the FFTW wisdom in %s\n", Ctrl->W.file);
+		remove (tmp_file);
+	}
+#endif
+}
+
+static void plan_cache (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, unsigned int nx, unsigned int ny) {
+	/* With -W, report whether the FFTW wisdom already holds plans for the in-place forward and inverse transforms
+	 * of ny rows of nx complex values with the -W planner, i.e., whether GMT will skip planning them.  We ask FFTW
+	 * itself by planning with FFTW_WISDOM_ONLY, which fails unless the wisdom has the answer */
+#ifdef HAVE_FFTW3F
+	static char *dir[2] = {"forward", "inverse"};
+	int sign[2] = {FFTW_FORWARD, FFTW_BACKWARD};
+	unsigned int k;
+	fftwf_complex *data = NULL;
+	fftwf_plan plan;
+
+	if (!Ctrl->W.active || (data = fftwf_malloc ((size_t)nx * ny * sizeof (fftwf_complex))) == NULL) return;	/* Never touched */
+	for (k = 0; k < 2; k++) {
+		plan = fftwf_plan_dft_2d ((int)ny, (int)nx, data, data, sign[k], planner_flags (Ctrl->W.planner) | FFTW_WISDOM_ONLY);
+		GMT_Report (API, GMT_MSG_VERBOSE, "FFT plan cache %s for %s transform of %u x %u [%s]\n",
+			(plan) ? "hit" : "miss", dir[k], nx, ny, Ctrl->W.planner);
+		if (plan) fftwf_destroy_plan (plan);
+	}
+	fftwf_free (data);
+#else
+	if (Ctrl->W.active) GMT_Report (API, GMT_MSG_LONG_VERBOSE, "Transform of %u x %u [%s]; built without FFTW so plan reuse is not known\n", nx, ny, Ctrl->W.planner);
+#endif
+}
+
+static gmt_grdfloat *half_pack (void *API, struct GMT_GRID *Grid) {
+	/* Return the rows of the real grid, less the pad, moved together so that each row of nx values becomes
+	 * nc = nx/2 complex values.  An odd nx gets one more column that repeats the last one.  This usually
+	 * happens in place since the grid pad leaves room; otherwise we return a separate array */
+	unsigned int row, nx = Grid->header->nx, ny = Grid->header->ny, n2 = 2 * ((nx + 1) / 2);
+	uint64_t node;
+	gmt_grdfloat *z = NULL;
+
+	if ((uint64_t)n2 * ny <= (uint64_t)Grid->header->mx * Grid->header->my)	/* Room in the grid itself */
+		z = Grid->data;
+	else if ((z = malloc ((uint64_t)n2 * ny * sizeof (gmt_grdfloat))) == NULL) {
+		GMT_Message (API, GMT_TIME_CLOCK, "Unable to allocate memory for the half-spectrum transform\n");
+		return (NULL);
+	}
+	for (row = 0; row < ny; row++) {	/* Pack the rows; moving them forward in the array is safe */
+		node = GMT_Get_Index (API, Grid->header, row, 0);
+		memmove (&z[(uint64_t)row * n2], &Grid->data[node], nx * sizeof (gmt_grdfloat));
+		if (n2 > nx) z[(uint64_t)row * n2 + nx] = z[(uint64_t)row * n2 + nx - 1];
+	}
+	return (z);
+}
+
+static void half_unpack (void *API, struct GMT_GRID *Grid, gmt_grdfloat *z) {
+	/* Move the packed rows in z back to their place in the grid, in reverse order since they move back */
+	unsigned int row, nx = Grid->header->nx, n2 = 2 * ((nx + 1) / 2);
+	uint64_t node;
+
+	for (row = Grid->header->ny; row > 0; row--) {
+		node = GMT_Get_Index (API, Grid->header, row - 1, 0);
+		memmove (&Grid->data[node], &z[(uint64_t)(row - 1) * n2], nx * sizeof (gmt_grdfloat));
+	}
+}
+
+static int half_tables (struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_GRID_HEADER *h, double width, double **f_x, double **f_y, double **w) {
+	/* Set the x and y responses for this filter width and the twiddle factors W^k used by apply_half_response.
+	 * Pass w = NULL if the twiddle factors are not needed, or f_x = NULL if only they are */
+	unsigned int col, nc = (h->nx + 1) / 2, ny = h->ny;
+	double k_ref = 2.0 * M_PI / width;
+
+	if (f_x) {
+		*f_x = get_half_response (2 * nc, h->inc[GMT_X], k_ref, Ctrl->D.dir != 'y', 1.0);
+		*f_y = get_half_response (ny, h->inc[GMT_Y], k_ref, Ctrl->D.dir != 'x', 1.0 / ((double)nc * ny));	/* Also undo the FFT scaling */
+		if (*f_x == NULL || *f_y == NULL) return (EXIT_FAILURE);
+	}
+	if (w == NULL) return (GMT_NOERROR);
+	if ((*w = malloc (2 * nc * sizeof (double))) == NULL) return (EXIT_FAILURE);
+	for (col = 0; col < nc; col++) {	/* The twiddle factors W^k */
+		(*w)[2*col]   =  cos (M_PI * col / nc);
+		(*w)[2*col+1] = -sin (M_PI * col / nc);
+	}
+	return (GMT_NOERROR);
+}
+
+static int half_filter (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_GRID *Grid) {
+	/* Filter the real grid via a complex transform of half the size */
+	unsigned int nc = (Grid->header->nx + 1) / 2, ny = Grid->header->ny;
+	int error = GMT_NOERROR;
+	double *f_x = NULL, *f_y = NULL, *w = NULL;
+	gmt_grdfloat *z = NULL;
+	struct GRDFOURIER_CHAIN C, *chain = NULL;
+
+	if (Ctrl->S.active) {	/* Apply the -S filters on the wavenumbers of the packed transform instead */
+		chain = &C;
+		C.n_stages = Ctrl->S.n_stages;	C.stage = Ctrl->S.stage;
+		C.kx2 = get_half_wavenumbers (2 * nc, Grid->header->inc[GMT_X], Ctrl->D.dir != 'y');
+		C.ky2 = get_half_wavenumbers (ny, Grid->header->inc[GMT_Y], Ctrl->D.dir != 'x');
+		C.scale = 1.0 / ((double)nc * ny);	/* Undo the FFT scaling */
+	}
+	if ((chain && (C.kx2 == NULL || C.ky2 == NULL)) || half_tables (Ctrl, Grid->header, Ctrl->F.width, (chain) ? NULL : &f_x, &f_y, &w)) {
+		GMT_Message (API, GMT_TIME_CLOCK, "Unable to allocate memory for the filter response\n");
+		error = EXIT_FAILURE;
+	}
+	else if ((z = half_pack (API, Grid)) == NULL)
+		error = EXIT_FAILURE;
+	else {
+		GMT_Report (API, GMT_MSG_LONG_VERBOSE, "Half-spectrum transform of %u x %u complex values\n", nc, ny);
+		plan_cache (API, Ctrl, nc, ny);
+		if (GMT_FFT_2D (API, z, nc, ny, GMT_FFT_FWD, GMT_FFT_COMPLEX)) error = EXIT_FAILURE;
+		else {
+			if (threaded_response (Ctrl->x.n_threads, z, nc, ny, f_x, f_y, NULL, NULL, w, chain)) {
+				GMT_Message (API, GMT_TIME_CLOCK, "Unable to allocate memory for the filter response\n");
+				error = EXIT_FAILURE;
+			}
+			else if (GMT_FFT_2D (API, z, nc, ny, GMT_FFT_INV, GMT_FFT_COMPLEX)) error = EXIT_FAILURE;
+			else half_unpack (API, Grid, z);
+		}
+		if (z != Grid->data) free (z);
+	}
+	free (f_x);	free (f_y);	free (w);
+	if (chain) {
+		free (C.kx2);	free (C.ky2);
+	}
+	return (error);
+}
+
+static int full_filter (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_GRID *Grid) {
+	/* Filter the complex grid using the GMT FFT machinery and the -N settings */
+	int error = GMT_NOERROR;
+	double k_ref;					/* Normally all math is done in double */
+	double *f_x = NULL, *f_y = NULL;		/* Filter response along x and y */
+	float *g_x = NULL, *g_y = NULL;			/* The same in single precision [-M] */
+	void *FFT_info = NULL;				/* Holds information about all things FFT related */
+	struct GRDFOURIER_CHAIN C, *chain = NULL;	/* The -S filters, if any */
+
+	/* Initialize FFT structs, check for NaNs, detrend, save intermediate files, etc., per -N settings */
+	
+	FFT_info = GMT_FFT_Create (API, Grid, MY_FFT_DIM, GMT_GRID_IS_COMPLEX_REAL, Ctrl->N.info);
+	plan_cache (API, Ctrl, Grid->header->mx, Grid->header->my);
+
+	/* Take the forward FFT */
+	if (GMT_FFT (API, Grid, GMT_FFT_FWD, GMT_FFT_COMPLEX, FFT_info)) return (EXIT_FAILURE);
+
+	/* Now do operations in frequency domain.  Here we are just filtering our spike  */
+	
+	/* Grid->data contains Grid->header->size values with {real, imag} in adjacent positions, i.e., my rows
+	 * of mx complex values.  Rather than getting the wavenumber and evaluating the Gaussian at every node,
+	 * we compute the response once per column and once per row and multiply the two as we go */
+	
+	if (Ctrl->S.active) {	/* The -S filters depend on |k| so we need the wavenumbers along x and y instead */
+		chain = &C;
+		C.n_stages = Ctrl->S.n_stages;	C.stage = Ctrl->S.stage;	C.scale = 1.0;
+		C.kx2 = get_wavenumbers (API, FFT_info, Grid->header->mx, 2, 0, Ctrl->D.dir != 'y');
+		C.ky2 = get_wavenumbers (API, FFT_info, Grid->header->my, 2 * (uint64_t)Grid->header->mx, 1, Ctrl->D.dir != 'x');
+		if (C.kx2 == NULL || C.ky2 == NULL) error = EXIT_FAILURE;
+		GMT_Report (API, GMT_MSG_LONG_VERBOSE, "Apply %u filters in one pass over the spectrum\n", C.n_stages);
+	}
+	else {
+		k_ref = 2.0 * M_PI / Ctrl->F.width;	/* Filter is exp (-(k/k_ref)^2) */
+		f_x = get_response (API, FFT_info, Grid->header->mx, 2, 0, k_ref, Ctrl->D.dir != 'y');
+		f_y = get_response (API, FFT_info, Grid->header->my, 2 * (uint64_t)Grid->header->mx, 1, k_ref, Ctrl->D.dir != 'x');
+		if (Ctrl->M.active) {	/* Do the multiplication in single precision */
+			g_x = get_response_f (f_x, Grid->header->mx);
+			g_y = get_response_f (f_y, Grid->header->my);
+		}
+		if (f_x == NULL || f_y == NULL || (Ctrl->M.active && (g_x == NULL || g_y == NULL))) error = EXIT_FAILURE;
+	}
+	if (error || threaded_response (Ctrl->x.n_threads, Grid->data, Grid->header->mx, Grid->header->my, f_x, f_y, g_x, g_y, NULL, chain)) {
+		GMT_Message (API, GMT_TIME_CLOCK, "Unable to allocate memory for the filter response\n");
+		error = EXIT_FAILURE;
+	}
+	free (f_x);	free (f_y);	free (g_x);	free (g_y);
+	if (chain) {
+		free (C.kx2);	free (C.ky2);
+	}
+	if (error) return (error);
+
+	/* Take the inverse FFT; the 2/nm scaling is taken care of automatically */
+	if (GMT_FFT (API, Grid, GMT_FFT_INV, GMT_FFT_COMPLEX, FFT_info)) return (EXIT_FAILURE);
+
+	GMT_FFT_Destroy (API, &FFT_info);	/* Free the FFT machinery */
+	return (GMT_NOERROR);
+}
+
+struct GRDFOURIER_JOB {	/* One filter width in batch mode [-F<width>,<width>,...] */
+	double *f_x, *f_y;	/* The response along x and y for this width */
+	float *g_x, *g_y;	/* The same in single precision [-M], else NULL */
+	gmt_grdfloat *z;	/* This width's copy of the spectrum */
+	struct GMT_GRID *Out;	/* Grid receiving the filtered result */
+};
+
+struct GRDFOURIER_BATCH {	/* What the workers share in batch mode */
+	unsigned int half;	/* 1 for the half-spectrum transform [-H] */
+	unsigned int nx, ny;	/* Dimensions of the complex spectrum */
+	double *w;		/* Twiddle factors for -H */
+	gmt_grdfloat *spectrum;	/* The forward transform, computed once */
+	struct GRDFOURIER_JOB *job;	/* The widths being filtered */
+};
+
+static void filter_jobs (void *arg, uint64_t start, uint64_t end, unsigned int thread_id) {
+	/* Copy the spectrum for each width in [start, end) and multiply it by the response for that width */
+	uint64_t k;
+	struct GRDFOURIER_BATCH *B = arg;
+
+	for (k = start; k < end; k++) {
+		memcpy (B->job[k].z, B->spectrum, 2 * (uint64_t)B->nx * B->ny * sizeof (gmt_grdfloat));
+		if (B->half)
+			apply_half_response (B->job[k].z, B->nx, B->ny, 0, B->ny, B->job[k].f_x, B->job[k].f_y, B->w, NULL, NULL);
+		else if (B->job[k].g_x)
+			apply_response_f (B->job[k].z, B->nx, B->ny, B->job[k].g_x, B->job[k].g_y);
+		else
+			apply_response (B->job[k].z, B->nx, B->ny, B->job[k].f_x, B->job[k].f_y);
+	}
+}
+
+static int batch_filter (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_GRID *Grid, unsigned int rw_mode) {
+	/* Filter the grid with each of the -F widths and write one grid per width.  The forward transform is done
+	 * once and kept.  Up to n_threads widths at a time get their own copy of the spectrum, which the workers
+	 * multiply by the responses concurrently.  The inverse transforms and writes then follow one by one since
+	 * they go through the GMT API */
+	unsigned int k, first, n_par, n_now;
+	int error = GMT_NOERROR;
+	double k_ref;
+	char file[GMT_LEN256] = {""};
+	void *FFT_info = NULL;
+	struct GRDFOURIER_JOB *job = NULL;
+	struct GRDFOURIER_BATCH B;
+
+	memset (&B, 0, sizeof (struct GRDFOURIER_BATCH));
+	B.half = Ctrl->H.active;
+	if (B.half) {	/* Pack the real grid as complex values and transform it */
+		B.nx = (Grid->header->nx + 1) / 2;	B.ny = Grid->header->ny;
+		if ((B.spectrum = half_pack (API, Grid)) == NULL) return (EXIT_FAILURE);
+		plan_cache (API, Ctrl, B.nx, B.ny);
+		if (GMT_FFT_2D (API, B.spectrum, B.nx, B.ny, GMT_FFT_FWD, GMT_FFT_COMPLEX)) error = EXIT_FAILURE;
+	}
+	else {	/* Use the GMT FFT machinery and the -N settings on the complex grid */
+		B.nx = Grid->header->mx;	B.ny = Grid->header->my;
+		B.spectrum = Grid->data;
+		FFT_info = GMT_FFT_Create (API, Grid, MY_FFT_DIM, GMT_GRID_IS_COMPLEX_REAL, Ctrl->N.info);
+		plan_cache (API, Ctrl, B.nx, B.ny);
+		if (GMT_FFT (API, Grid, GMT_FFT_FWD, GMT_FFT_COMPLEX, FFT_info)) error = EXIT_FAILURE;
+	}
+	n_par = Ctrl->x.n_threads;
+	if (n_par > Ctrl->F.n_widths) n_par = Ctrl->F.n_widths;
+	if (!error && (job = calloc (n_par, sizeof (struct GRDFOURIER_JOB))) == NULL) error = EXIT_FAILURE;
+	B.job = job;
+	GMT_Message (API, GMT_TIME_CLOCK, "Filter the spectrum with %u widths, %u at the time\n", Ctrl->F.n_widths, n_par);
+
+	for (first = 0; !error && first < Ctrl->F.n_widths; first += n_now) {
+		n_now = (Ctrl->F.n_widths - first > n_par) ? n_par : Ctrl->F.n_widths - first;
+		for (k = 0; !error && k < n_now; k++) {	/* Set up the output grids and responses for this group of widths */
+			if ((job[k].Out = GMT_Duplicate_Data (API, GMT_IS_GRID, GMT_DUPLICATE_ALLOC, Grid)) == NULL)
+				error = EXIT_FAILURE;
+			else if (B.half) {	/* The packed spectrum fits in the output grid unless it did not fit in the input */
+				job[k].z = (B.spectrum == Grid->data) ? job[k].Out->data : malloc (2 * (uint64_t)B.nx * B.ny * sizeof (gmt_grdfloat));
+				if (job[k].z == NULL || half_tables (Ctrl, Grid->header, Ctrl->F.widths[first+k], &job[k].f_x, &job[k].f_y, (B.w) ? NULL : &B.w))
+					error = EXIT_FAILURE;
+			}
+			else {
+				job[k].z = job[k].Out->data;
+				k_ref = 2.0 * M_PI / Ctrl->F.widths[first+k];
+				job[k].f_x = get_response (API, FFT_info, B.nx, 2, 0, k_ref, Ctrl->D.dir != 'y');
+				job[k].f_y = get_response (API, FFT_info, B.ny, 2 * (uint64_t)B.nx, 1, k_ref, Ctrl->D.dir != 'x');
+				if (Ctrl->M.active) {	/* Do the multiplication in single precision */
+					job[k].g_x = get_response_f (job[k].f_x, B.nx);
+					job[k].g_y = get_response_f (job[k].f_y, B.ny);
+				}
+				if (job[k].f_x == NULL || job[k].f_y == NULL || (Ctrl->M.active && (job[k].g_x == NULL || job[k].g_y == NULL))) error = EXIT_FAILURE;
+			}
+		}
+		if (error || (error = custom_parallel_for (n_par, n_now, 1, filter_jobs, &B)))
+			GMT_Message (API, GMT_TIME_CLOCK, "Unable to allocate memory for the filtered grids\n");
+		for (k = 0; k < n_now; k++) {	/* Inverse transform and write the results in order */
+			if (!error && B.half) {
+				if (GMT_FFT_2D (API, job[k].z, B.nx, B.ny, GMT_FFT_INV, GMT_FFT_COMPLEX)) error = EXIT_FAILURE;
+				else half_unpack (API, job[k].Out, job[k].z);
+			}
+			else if (!error && GMT_FFT (API, job[k].Out, GMT_FFT_INV, GMT_FFT_COMPLEX, FFT_info))
+				error = EXIT_FAILURE;
+			if (!error) {
+				snprintf (file, GMT_LEN256, Ctrl->G.file, Ctrl->F.widths[first+k]);
+				GMT_Message (API, GMT_TIME_CLOCK, "Write grid filtered with width %g to %s\n", Ctrl->F.widths[first+k], file);
+				if (GMT_Write_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, rw_mode, NULL, file, job[k].Out)) error = EXIT_FAILURE;
+			}
+			if (job[k].Out && job[k].z != job[k].Out->data) free (job[k].z);
+			if (job[k].Out) GMT_Destroy_Data (API, &job[k].Out);
+			free (job[k].f_x);	free (job[k].f_y);	free (job[k].g_x);	free (job[k].g_y);
+			memset (&job[k], 0, sizeof (struct GRDFOURIER_JOB));
+		}
+	}
+	if (B.half && B.spectrum != Grid->data) free (B.spectrum);
+	if (FFT_info) GMT_FFT_Destroy (API, &FFT_info);
+	free (B.w);	free (job);
+	return (error);
+}
+
+struct GRDFOURIER_SPATIAL {	/* What the workers share in one pass of the spatial convolution */
+	unsigned int nx, ny;	/* Grid dimensions */
+	unsigned int h;		/* Half-width of the kernel in nodes */
+	double *w;		/* The 2*h+1 kernel weights */
+	double *norm;		/* Sum of the weights that fall inside the grid, per column (x pass) or row (y pass) */
+	double *acc;		/* MY_BLOCK or nx accumulators per worker, whichever is more */
+	uint64_t n_acc;		/* Number of accumulators per worker */
+	gmt_grdfloat *in, *out;	/* First node of the input and output */
+	uint64_t in_mx, out_mx;	/* Distance between rows in the input and output */
+};
+
+static double *spatial_weights (double width, double inc, unsigned int active, unsigned int *h) {
+	/* Return the 2*h+1 weights exp (-(pi*x/width)^2) for x = j*inc, j = -h..h, normalized to unit sum.  This is the
+	 * kernel whose transform is our response exp (-(k/k_ref)^2) with k_ref = 2*pi/width.  We go out to MY_HALO widths
+	 * where the kernel has dropped below 1e-9.  If this direction is not filtered the single weight is 1 */
+	unsigned int j;
+	double x, sum = 0.0, *w = NULL;
+
+	*h = (active) ? (unsigned int)ceil (MY_HALO * width / inc) : 0;
+	if ((w = malloc ((2 * *h + 1) * sizeof (double))) == NULL) return (NULL);
+	for (j = 0; j <= 2 * *h; j++) {
+		x = M_PI * ((double)j - *h) * inc / width;
+		sum += (w[j] = exp (-x * x));
+	}
+	for (j = 0; j <= 2 * *h; j++) w[j] /= sum;
+	return (w);
+}
+
+static double *spatial_norm (double *w, unsigned int h, unsigned int n) {
+	/* Return the sum of the weights that fall inside [0, n) when the kernel is centered on each of the n nodes.
+	 * This is 1 except within h nodes of the ends, where we divide by it so the missing nodes are not taken as 0 */
+	unsigned int i, j;
+	double *norm = NULL;
+
+	if ((norm = calloc (n, sizeof (double))) == NULL) return (NULL);
+	for (i = 0; i < n; i++)
+		for (j = 0; j <= 2 * h; j++)
+			if (i + j >= h && i + j - h < n) norm[i] += w[j];
+	return (norm);
+}
+
+static void spatial_rows (void *arg, uint64_t start, uint64_t end, unsigned int thread_id) {
+	/* x pass: convolve the rows [start, end) with the kernel.  Looping over the weights outside and the columns
+	 * inside gives contiguous loads and stores the compiler can vectorize */
+	unsigned int j, c, c0, c1;
+	uint64_t row;
+	double *acc = NULL, wj;
+	gmt_grdfloat *in = NULL, *out = NULL;
+	struct GRDFOURIER_SPATIAL *S = arg;
+
+	acc = &S->acc[thread_id * S->n_acc];
+	for (row = start; row < end; row++) {
+		in = &S->in[row * S->in_mx];	out = &S->out[row * S->out_mx];
+		for (c = 0; c < S->nx; c++) acc[c] = 0.0;
+		for (j = 0; j <= 2 * S->h; j++) {	/* Node c gets w[j] * in[c + j - h] for the c where that is inside the row */
+			c0 = (j < S->h) ? S->h - j : 0;
+			c1 = (j > S->h) ? ((S->nx > j - S->h) ? S->nx - (j - S->h) : 0) : S->nx;
+			wj = S->w[j];
+			for (c = c0; c < c1; c++) acc[c] += wj * in[c + j - S->h];
+		}
+		for (c = 0; c < S->nx; c++) out[c] = (gmt_grdfloat)(acc[c] / S->norm[c]);
+	}
+}
+
+static void spatial_cols (void *arg, uint64_t start, uint64_t end, unsigned int thread_id) {
+	/* y pass: convolve the columns of the output rows [start, end) with the kernel.  Each output row is a weighted
+	 * sum of whole input rows, which we do MY_BLOCK columns at a time so the accumulators stay in cache */
+	unsigned int j, c, c0, n;
+	uint64_t row, r0, r1;
+	double *acc = NULL, wj;
+	gmt_grdfloat *in = NULL, *out = NULL;
+	struct GRDFOURIER_SPATIAL *S = arg;
+
+	acc = &S->acc[thread_id * S->n_acc];
+	for (row = start; row < end; row++) {
+		r0 = (row > S->h) ? row - S->h : 0;	/* First and last input rows inside the grid */
+		r1 = (row + S->h < S->ny) ? row + S->h : S->ny - 1;
+		out = &S->out[row * S->out_mx];
+		for (c0 = 0; c0 < S->nx; c0 += MY_BLOCK) {
+			n = (S->nx - c0 > MY_BLOCK) ? MY_BLOCK : S->nx - c0;
+			for (c = 0; c < n; c++) acc[c] = 0.0;
+			for (j = (unsigned int)(r0 + S->h - row); j <= (unsigned int)(r1 + S->h - row); j++) {
+				in = &S->in[(row + j - S->h) * S->in_mx + c0];
+				wj = S->w[j];
+				for (c = 0; c < n; c++) acc[c] += wj * in[c];
+			}
+			for (c = 0; c < n; c++) out[c0+c] = (gmt_grdfloat)(acc[c] / S->norm[row]);
+		}
+	}
+}
+
+static int spatial_filter (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_GRID *Grid) {
+	/* Filter the real grid by convolving it with the Gaussian kernel, first along the rows into a scratch grid
+	 * and then along the columns back into the grid.  This is exact since the kernel is separable like the
+	 * response.  Near the edges we only use the nodes inside the grid and scale by the weights used.  The scratch
+	 * grid and accumulators are kept in Ctrl->work and only grow, so strips and grids after the first reuse them */
+	unsigned int nx = Grid->header->nx, ny = Grid->header->ny, h[2], n_threads = Ctrl->x.n_threads;
+	int error = GMT_NOERROR;
+	double *w[2] = {NULL, NULL}, *norm[2] = {NULL, NULL};
+	uint64_t n_acc, n_tmp = (uint64_t)nx * ny;
+	struct GRDFOURIER_SPATIAL S;
+
+	memset (&S, 0, sizeof (struct GRDFOURIER_SPATIAL));
+	w[GMT_X] = spatial_weights (Ctrl->F.width, Grid->header->inc[GMT_X], Ctrl->D.dir != 'y', &h[GMT_X]);
+	w[GMT_Y] = spatial_weights (Ctrl->F.width, Grid->header->inc[GMT_Y], Ctrl->D.dir != 'x', &h[GMT_Y]);
+	if (w[GMT_X]) norm[GMT_X] = spatial_norm (w[GMT_X], h[GMT_X], nx);
+	if (w[GMT_Y]) norm[GMT_Y] = spatial_norm (w[GMT_Y], h[GMT_Y], ny);
+	S.n_acc = (nx > MY_BLOCK) ? nx : MY_BLOCK;
+	n_acc = n_threads * S.n_acc;
+	if (n_acc > Ctrl->work.n_acc) {	/* Need more accumulators than we have */
+		free (Ctrl->work.acc);
+		Ctrl->work.n_acc = ((Ctrl->work.acc = malloc (n_acc * sizeof (double))) == NULL) ? 0 : n_acc;
+	}
+	if (n_tmp > Ctrl->work.n_tmp) {	/* Need a larger scratch grid */
+		free (Ctrl->work.tmp);
+		Ctrl->work.n_tmp = ((Ctrl->work.tmp = malloc (n_tmp * sizeof (gmt_grdfloat))) == NULL) ? 0 : n_tmp;
+	}
+	S.acc = Ctrl->work.acc;
+	if (norm[GMT_X] == NULL || norm[GMT_Y] == NULL || Ctrl->work.acc == NULL || Ctrl->work.tmp == NULL) {
+		GMT_Message (API, GMT_TIME_CLOCK, "Unable to allocate memory for the spatial convolution\n");
+		error = EXIT_FAILURE;
+	}
+	else {
+		GMT_Report (API, GMT_MSG_LONG_VERBOSE, "Spatial convolution with %u x %u weights using %u threads\n", 2 * h[GMT_X] + 1, 2 * h[GMT_Y] + 1, n_threads);
+		S.nx = nx;	S.ny = ny;
+		S.h = h[GMT_X];	S.w = w[GMT_X];	S.norm = norm[GMT_X];	/* Grid rows to tmp */
+		S.in = &Grid->data[GMT_Get_Index (API, Grid->header, 0, 0)];	S.in_mx = Grid->header->mx;
+		S.out = Ctrl->work.tmp;	S.out_mx = nx;
+		error = custom_parallel_for (n_threads, ny, MY_ROWS, spatial_rows, &S);
+		S.h = h[GMT_Y];	S.w = w[GMT_Y];	S.norm = norm[GMT_Y];	/* tmp columns back to the grid */
+		S.out = S.in;	S.out_mx = S.in_mx;
+		S.in = Ctrl->work.tmp;	S.in_mx = nx;
+		if (!error) error = custom_parallel_for (n_threads, ny, MY_ROWS, spatial_cols, &S);
+		if (error) GMT_Message (API, GMT_TIME_CLOCK, "Unable to allocate memory for the spatial convolution\n");
+	}
+	free (w[GMT_X]);	free (w[GMT_Y]);	free (norm[GMT_X]);	free (norm[GMT_Y]);
+	return (error);
+}
+
+static void choose_engine (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_GRID_HEADER *h) {
+	/* Settle -Ea on the FFT or spatial convolution for this grid and report the choice.  The cost of the convolution is about
+	 * 2 flops per weight per node and pass, and that of the two transforms about 2 * 5 M log2 (M) flops for
+	 * M complex values, plus the filter itself.  With -H, M is half the number of nodes */
+	unsigned int hx = 0, hy = 0;
+	double n = (double)h->nx * h->ny, m = (Ctrl->H.active) ? 0.5 * n : n, c_fft, c_conv;
+
+	if (Ctrl->E.mode != 'a') {
+		Ctrl->E.engine = Ctrl->E.mode;
+		GMT_Report (API, GMT_MSG_VERBOSE, "Using the %s engine as selected\n", (Ctrl->E.mode == 's') ? "spatial convolution" : "FFT");
+		return;
+	}
+	if (Ctrl->F.n_widths > 1 || Ctrl->N.active || Ctrl->M.active || Ctrl->E.geographic || Ctrl->S.active) {
+		Ctrl->E.engine = 'f';
+		GMT_Report (API, GMT_MSG_VERBOSE, "Using the FFT engine since %s\n", (Ctrl->F.n_widths > 1) ? "several -F widths share one transform" :
+			((Ctrl->N.active) ? "-N applies to the FFT only" : ((Ctrl->M.active) ? "-M applies to the FFT only" :
+			((Ctrl->S.active) ? "the -S filters are spectral" : "the grid is geographic"))));
+		return;
+	}
+	if (Ctrl->D.dir != 'y') hx = (unsigned int)ceil (MY_HALO * Ctrl->F.width / h->inc[GMT_X]);
+	if (Ctrl->D.dir != 'x') hy = (unsigned int)ceil (MY_HALO * Ctrl->F.width / h->inc[GMT_Y]);
+	c_conv = 2.0 * n * ((hx) ? 2 * hx + 1 : 0) + 2.0 * n * ((hy) ? 2 * hy + 1 : 0);
+	c_fft = 10.0 * m * log2 (m) + 6.0 * m;
+	Ctrl->E.engine = (c_conv < c_fft) ? 's' : 'f';
+	GMT_Report (API, GMT_MSG_VERBOSE, "Convolution with %u x %u weights costs about %.3g Mflop and the FFT about %.3g Mflop: Using the %s engine\n",
+		2 * hx + 1, 2 * hy + 1, 1.0e-6 * c_conv, 1.0e-6 * c_fft, (Ctrl->E.engine == 's') ? "spatial convolution" : "FFT");
+	if (Ctrl->E.engine == 's')	/* Not what the default FFT engine would give near the edges */
+		GMT_Report (API, GMT_MSG_VERBOSE, "Within %u columns and %u rows of the edges the convolution only uses nodes inside the grid, "
+			"whereas the FFT treats the grid as periodic; use -Ef to keep the FFT edges\n", hx, hy);
+}
+
+static int set_spike (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_GRID_HEADER *h) {
+	/* Select the middle node for the spike unless -A was given, and make sure it is inside the grid */
+	if (!Ctrl->A.active) {	/* We know the grid dimension so we can select the mid point */
+		Ctrl->A.row = h->ny / 2;
+		Ctrl->A.col = h->nx / 2;
+	}
+	if (Ctrl->A.row >= h->ny || Ctrl->A.col >= h->nx) {
+		GMT_Message (API, GMT_TIME_CLOCK, "Spike is placed outside the grid! We give up.\n");
+		return (EXIT_FAILURE);
+	}
+	return (GMT_NOERROR);
+}
+
+static int tiled_filter (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, char *in_file, char *out_file) {
+	/* Filter the grid in strips of Ctrl->T.rows full-width rows so that only one strip is in memory at the time.
+	 * Each strip is read with halo rows on either side, filtered with the half-spectrum transform, and then only
+	 * its own rows are written (overlap-save).  The Gaussian exp (-(k/k_ref)^2) has the kernel exp (-(pi*y/width)^2)
+	 * which is below 1e-9 beyond MY_HALO widths, so the halo rows absorb the wrap-around of the transform in y.
+	 * Without in_file we filter a new grid made from -R -I [-r] */
+	unsigned int row, r0, r1, s0, s1, halo, n_strips = 0;
+	int error;
+	double wesn[4], off;
+	struct GMT_GRID *Header = NULL, *Out = NULL, *Strip = NULL;
+	struct GMT_GRID_HEADER *h = NULL;
+
+	if (in_file) {	/* Just get the dimensions for now */
+		GMT_Message (API, GMT_TIME_CLOCK, "Filter input grid %s in strips of %u rows\n", in_file, Ctrl->T.rows);
+		if ((Header = GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_HEADER_ONLY, NULL, in_file, NULL)) == NULL)
+			return (EXIT_FAILURE);
+	}
+	else if ((Header = GMT_Create_Data (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_CONTAINER_ONLY, NULL, NULL, NULL, \
+		GMT_GRID_DEFAULT_REG, 0, NULL)) == NULL) return (EXIT_FAILURE);
+	h = Header->header;
+	if (set_spike (API, Ctrl, h)) return (EXIT_FAILURE);
+	choose_engine (API, Ctrl, h);
+	halo = (Ctrl->D.dir == 'x') ? 0 : (unsigned int)ceil (MY_HALO * Ctrl->F.width / h->inc[GMT_Y]);
+	off = (h->registration == GMT_GRID_PIXEL_REG) ? 1.0 : 0.0;	/* Pixel rows extend a full increment below their top */
+
+	/* Write the header now; the rows follow strip by strip */
+
+	if ((Out = GMT_Create_Data (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_CONTAINER_ONLY, NULL, h->wesn, h->inc, \
+		h->registration, 0, NULL)) == NULL) return (EXIT_FAILURE);
+	if (GMT_Write_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_HEADER_ONLY | GMT_GRID_ROW_BY_ROW, NULL, out_file, Out))
+		return (EXIT_FAILURE);
+	GMT_Message (API, GMT_TIME_CLOCK, "Using %u halo rows above and below each strip\n", halo);
+
+	for (r0 = 0; r0 < h->ny; r0 = r1, n_strips++) {	/* Output rows [r0, r1) come from input rows [s0, s1) */
+		r1 = (h->ny - r0 > Ctrl->T.rows) ? r0 + Ctrl->T.rows : h->ny;
+		s0 = (r0 > halo) ? r0 - halo : 0;
+		s1 = (h->ny - r1 > halo) ? r1 + halo : h->ny;
+		wesn[GMT_XLO] = h->wesn[GMT_XLO];	wesn[GMT_XHI] = h->wesn[GMT_XHI];
+		wesn[GMT_YHI] = h->wesn[GMT_YHI] - s0 * h->inc[GMT_Y];
+		wesn[GMT_YLO] = h->wesn[GMT_YHI] - (s1 - 1 + off) * h->inc[GMT_Y];
+		if (in_file)
+			Strip = GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_ALL, wesn, in_file, NULL);
+		else
+			Strip = GMT_Create_Data (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_GRID_ALL, NULL, wesn, h->inc, h->registration, 0, NULL);
+		if (Strip == NULL) return (EXIT_FAILURE);
+		if (Ctrl->A.row >= s0 && Ctrl->A.row < s1)	/* The spike is part of this strip's input */
+			Strip->data[GMT_Get_Index (API, Strip->header, Ctrl->A.row - s0, Ctrl->A.col)] = 1.0;
+		error = (Ctrl->E.engine == 's') ? spatial_filter (API, Ctrl, Strip) : half_filter (API, Ctrl, Strip);
+		if (error) return (error);
+		for (row = r0; row < r1; row++)
+			if (GMT_Put_Row (API, row, Out, &Strip->data[GMT_Get_Index (API, Strip->header, row - s0, 0)])) return (EXIT_FAILURE);
+		GMT_Destroy_Data (API, &Strip);	/* Done with this strip */
+	}
+	GMT_Message (API, GMT_TIME_CLOCK, "Filtered %u strips\n", n_strips);
+	GMT_Destroy_Data (API, &Out);	/* So a session filtering many grids does not hold on to them */
+	GMT_Destroy_Data (API, &Header);
+	return (GMT_NOERROR);
+}
+
+static int filter_grid (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, char *in_file, char *out_file) {
+	/* Read in_file (or create a grid from -R -I [-r] if NULL), add the spike, filter it, and write it to out_file.
+	 * The grid is freed afterwards so a session filtering many grids only holds one at the time */
+	int error;
+	unsigned int rw_mode;				/* Mode to pass when reading or creating grid */
+	uint64_t node;					/* Indeces into grids should be of this type */
+	double x, y;					/* Coordinates of the spike */
+	struct GMT_GRID *Grid = NULL;			/* This will be pointer to our grid */
+	struct GMT_GRID_HEADER *h = NULL;
+
+	/* Get the grid dimensions first since they decide the engine, and that decides if the grid must be complex */
+	if (in_file) {	/* User specified an input grid file */
+		GMT_Message (API, GMT_TIME_CLOCK, "Read input grid from %s\n", in_file);
+		if ((Grid = GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_HEADER_ONLY, NULL, in_file, NULL)) == NULL)
+			return (EXIT_FAILURE);
+	}
+	else if ((Grid = GMT_Create_Data (API, GMT_IS_GRID, GMT_IS_SURFACE, GMT_CONTAINER_ONLY, NULL, NULL, NULL, \
+		GMT_GRID_DEFAULT_REG, 0, NULL)) == NULL) return (EXIT_FAILURE);
+	choose_engine (API, Ctrl, Grid->header);
+
+	rw_mode = GMT_GRID_ALL;
+	if (!Ctrl->H.active && Ctrl->E.engine == 'f') rw_mode |= GMT_GRID_IS_COMPLEX_REAL;	/* Place our grid as the real component in a complex grid */
+	if (in_file) {	/* Now read the data */
+		if (GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, GMT_GRID_DATA_ONLY | rw_mode, NULL, in_file, Grid) == NULL)
+			return (EXIT_FAILURE);
+	}
+	else {	/* Create an empty grid from current -R -I [-r] instead */
+		GMT_Message (API, GMT_TIME_CLOCK, "No grid provided, create an empty grid from current -R -I [-r] settings\n");
+		GMT_Destroy_Data (API, &Grid);	/* Just needed the dimensions */
+		if ((Grid = GMT_Create_Data (API, GMT_IS_GRID, GMT_IS_SURFACE, rw_mode, NULL, NULL, NULL, \
+			GMT_GRID_DEFAULT_REG, 0, NULL)) == NULL) return (EXIT_FAILURE);
+	}
+	h = Grid->header;
+
+	if (set_spike (API, Ctrl, h)) return (EXIT_FAILURE);
+
+	/* Place our spike at the desired location; 2 * if grid is complex */
+	node = GMT_Get_Index (API, h, Ctrl->A.row, Ctrl->A.col);
+	if (rw_mode & GMT_GRID_IS_COMPLEX_REAL) node *= 2;
+	Grid->data[node] = 1.0;	/* The deadly spike */
+	x = h->wesn[GMT_XLO] + (Ctrl->A.col + h->xy_off) * h->inc[GMT_X];
+	y = h->wesn[GMT_YHI] - (Ctrl->A.row + h->xy_off) * h->inc[GMT_Y];
+	GMT_Message (API, GMT_TIME_CLOCK, "Placed spike at %g, %g [col = %u, row = %u]\n", x, y, Ctrl->A.col, Ctrl->A.row);
+
+	GMT_Message (API, GMT_TIME_CLOCK, "Using wavenumbers in the %c direction\n", Ctrl->D.dir);
+	if (Ctrl->F.n_widths > 1)	/* One forward transform, then one filtered grid per width */
+		error = batch_filter (API, Ctrl, Grid, rw_mode);
+	else {
+		if (Ctrl->E.engine == 's')	/* Convolve with the Gaussian instead */
+			error = spatial_filter (API, Ctrl, Grid);
+		else if (Ctrl->H.active)	/* Transform only half the spectrum */
+			error = half_filter (API, Ctrl, Grid);
+		else	/* Use the general GMT FFT machinery */
+			error = full_filter (API, Ctrl, Grid);
+		/* Time to write our data out */
+		if (!error && GMT_Write_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, rw_mode, NULL, out_file, Grid)) error = EXIT_FAILURE;
+	}
+	GMT_Destroy_Data (API, &Grid);
+	return (error);
+}
+
+static void out_name (struct GMT_GRDFOURIER_CTRL *Ctrl, char *in_file, char *file) {
+	/* With several input grids, replace the %s in the -G template by the input name without directory or extension */
+	size_t len;
+	char *c = NULL, *stem = NULL, *dot = NULL;
+
+	if (Ctrl->In.n_files < 2 || (c = strstr (Ctrl->G.file, "%s")) == NULL) {	/* Just the one name */
+		strncpy (file, Ctrl->G.file, GMT_BUFSIZ - 1);
+		return;
+	}
+	stem = (strrchr (in_file, '/')) ? strrchr (in_file, '/') + 1 : in_file;
+	if (strrchr (stem, '\\')) stem = strrchr (stem, '\\') + 1;
+	len = ((dot = strrchr (stem, '.')) && dot > stem) ? (size_t)(dot - stem) : strlen (stem);
+	snprintf (file, GMT_BUFSIZ, "%.*s%.*s%s", (int)(c - Ctrl->G.file), Ctrl->G.file, (int)len, stem, c + 2);
+}
+
+struct GRDFOURIER_NAME {	/* Output name of an input grid, and which one it was */
+	char *name;
+	unsigned int k;
+};
+
+static int compare_names (const void *p1, const void *p2) {
+	/* Sort on name, then on input order so the first grid of a run of equal names comes first */
+	const struct GRDFOURIER_NAME *n1 = p1, *n2 = p2;
+	int c = strcmp (n1->name, n2->name);
+	if (c) return (c);
+	return ((n1->k < n2->k) ? -1 : ((n1->k > n2->k) ? 1 : 0));
+}
+
+static unsigned int same_names (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl) {
+	/* Return the number of input grids whose output name from out_name is that of an earlier one, e.g., a/z.nc and b/z.nc.
+	 * We sort the names so only neighbours need comparing */
+	unsigned int k, first, n_same = 0, n = Ctrl->In.n_files;
+	char file[GMT_BUFSIZ];
+	struct GRDFOURIER_NAME *N = NULL;
+
+	if ((N = calloc (n, sizeof (struct GRDFOURIER_NAME))) == NULL) {
+		GMT_Report (API, GMT_MSG_NORMAL, "Unable to allocate memory for %u output names\n", n);
+		return (1);
+	}
+	for (k = 0; k < n && n_same == 0; k++) {
+		out_name (Ctrl, Ctrl->In.files[k], file);
+		N[k].k = k;
+		if ((N[k].name = strdup (file)) == NULL) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Unable to allocate memory for %u output names\n", n);
+			n_same = 1;
+		}
+	}
+	if (n_same == 0) {
+		qsort (N, n, sizeof (struct GRDFOURIER_NAME), compare_names);
+		for (k = first = 0; k < n; k++) {
+			if (k == 0 || strcmp (N[k].name, N[first].name)) {	/* Start of a new run of names */
+				first = k;
+				continue;
+			}
+			GMT_Report (API, GMT_MSG_NORMAL, "Both %s and %s would be written to %s\n", Ctrl->In.files[N[first].k], Ctrl->In.files[N[k].k], N[k].name);
+			n_same++;
+		}
+	}
+	for (k = 0; k < n; k++) free (N[k].name);
+	free (N);
+	return (n_same);
+}
+
+static void prefetch (char *file) {
+	/* Ask the OS to start reading the next grid while we filter this one.  This is only a hint, and the
+	 * GMT API is not thread-safe so we cannot read the grid itself in the background */
+#if defined(POSIX_FADV_WILLNEED) && !defined(_WIN32)
+	int fd;
+	if (file == NULL || (fd = open (file, O_RDONLY)) < 0) return;	/* Perhaps not a plain file; GMT will tell */
+	posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+	close (fd);
+#endif
+}
+
 /* Convenience macros to free memory before exiting due to error or completion */
 #define Free_Options {if (GMT_Destroy_Options (API, &options) != GMT_NOERROR) return (EXIT_FAILURE);}
 #define bailout(code) {Free_Options; return (code);}
@@ -193,14 +1535,10 @@ static int parse (void *API, struct GMT_GRDFOURIER_CTRL *Ctrl, struct GMT_OPTION
 
 int GMT_grdfourier (void *API, int mode, void *args) {
 	/* 1. Define local variables */
-	int error;
-	unsigned int wn_mode = 0;			/* To select radial [0], x (1), or y (2) wavenumber */
-	unsigned int rw_mode;				/* Mode to pass when reading or creating grid */
-	uint64_t re, im, node;				/* Indeces into grids should be of this type */
-	double k, filter, k_ref;			/* Normally all math is done in double */
-	double *x = NULL, *y = NULL;			/* Coordinate arrays for the grid */
-	struct GMT_GRID *Grid = NULL;			/* This will be pointer to our grid */
-	void *FFT_info = NULL;				/* Holds information about all things FFT related */
+	int error = GMT_NOERROR;
+	unsigned int k, n_grids;
+	char fft[GMT_LEN64] = {""};			/* GMT_FFT setting for -W */
+	char file[GMT_BUFSIZ] = {""};			/* Name of the current output grid */
 	struct GMT_GRDFOURIER_CTRL *Ctrl = NULL;	/* Control for this program */
 	struct GMT_OPTION *options = NULL;		/* Linked list of program options */
 
@@ -220,75 +1558,34 @@ int GMT_grdfourier (void *API, int mode, void *args) {
 
 	/* ---------------------------- This is the grdfourier main code ----------------------------*/
 
-	rw_mode = GMT_GRID_ALL | GMT_GRID_IS_COMPLEX_REAL;	/* Place our grid as the real component in a complex grid */
-	if (Ctrl->In.active) {	/* User specified an input grid file */
-		GMT_Message (API, GMT_TIME_CLOCK, "Read input grid from %s\n", Ctrl->In.file);
-		if ((Grid = GMT_Read_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, rw_mode, NULL, Ctrl->In.file, NULL)) == NULL)
-			Return (EXIT_FAILURE);
-	}
-	else {	/* Create an empty grid from current -R -I [-r] instead */
-		GMT_Message (API, GMT_TIME_CLOCK, "No grid provided, create an empty grid from current -R -I [-r] settings\n");
-		if ((Grid = GMT_Create_Data (API, GMT_IS_GRID, GMT_IS_SURFACE, rw_mode, NULL, NULL, NULL, \
-			GMT_GRID_DEFAULT_REG, 0, NULL)) == NULL) Return (EXIT_FAILURE);
-	}
-
-	x = GMT_Get_Coord (API, GMT_IS_GRID, GMT_X, Grid);	/* Get array of x coordinates */
-	y = GMT_Get_Coord (API, GMT_IS_GRID, GMT_Y, Grid);	/* Get array of y coordinates */
-
-	if (!Ctrl->A.active) {	/* We know the grid dimension so we can select the mid point */
-		Ctrl->A.row = Grid->header->ny / 2;
-		Ctrl->A.col = Grid->header->nx / 2;
-	}
-	if (Ctrl->A.row >= Grid->header->ny || Ctrl->A.col >= Grid->header->nx) {
-		GMT_Message (API, GMT_TIME_CLOCK, "Spike is placed outside the grid! We give up.\n");
-		Return (EXIT_FAILURE);
-	}
-	
-	/* Place our spike at the desired location; 2 * since grid is complex */
-	node = 2 * GMT_Get_Index (API, Grid->header, Ctrl->A.row, Ctrl->A.col);
-	Grid->data[node] = 1.0;	/* The deadly spike */
-	GMT_Message (API, GMT_TIME_CLOCK, "Placed spike at %g, %g [col = %u, row = %u]\n", x[Ctrl->A.col], y[Ctrl->A.row], Ctrl->A.col, Ctrl->A.row);
-	
-	/* Initialize FFT structs, check for NaNs, detrend, save intermediate files, etc., per -N settings */
-	
-	FFT_info = GMT_FFT_Create (API, Grid, MY_FFT_DIM, GMT_GRID_IS_COMPLEX_REAL, Ctrl->N.info);
-	
-	switch (Ctrl->D.dir) {	/* Select which type of wavenumber to use */
-		case 'x': wn_mode = 0; break;
-		case 'y': wn_mode = 1; break;
-		case 'r': wn_mode = 2; break;
-	}
-	GMT_Message (API, GMT_TIME_CLOCK, "Using wavenumbers in the %c direction [wn_mode = %u]\n", Ctrl->D.dir, wn_mode);
-
-	/* Take the forward FFT */
-	if (GMT_FFT (API, Grid, GMT_FFT_FWD, GMT_FFT_COMPLEX, FFT_info)) Return (EXIT_FAILURE);
-
-	/* Now do operations in frequency domain.  Here we are just filtering our spike  */
-	
-	k_ref = 2.0 * M_PI / Ctrl->F.width;	/* Filter is exp (-0.5*(k/k_ref)^2) */
-	
-	/* Grid->data contains Grid->header->size values with {real, imag} in adjacent positions.  Typically,
-	 * you will loop over all of these as below, and obtain the wavenumber using either the real or imaginary
-	 * loop variable.  This indirectly loops over all the frequencies in the grid. */
-	
-	for (re = 0, im = 1; re < Grid->header->size; re += 2, im += 2) {	/* Loop over the entire complex grid */
-		k = GMT_FFT_Wavenumber (API, re, wn_mode, FFT_info);	/* Get chosen wavenumber */
-		filter = exp (-pow (k/k_ref, 2.0));	/* Compute filter for this wavenumber */
-		Grid->data[re] *= filter;		/* Filter real component */
-		Grid->data[im] *= filter;		/* Filter imag component */
+	if (Ctrl->W.active) {	/* Have GMT use FFTW with a planner whose results it saves and loads as wisdom */
+		snprintf (fft, GMT_LEN64, "fftw,%s", Ctrl->W.planner);
+		if (GMT_Set_Default (API, "GMT_FFT", fft)) {
+			GMT_Report (API, GMT_MSG_NORMAL, "Unable to select FFTW for -W; plans will not be kept\n");
+			Ctrl->W.active = 0;
+		}
 	}
 
-	/* Take the inverse FFT; the 2/nm scaling is taken care of automatically */
-	if (GMT_FFT (API, Grid, GMT_FFT_INV, GMT_FFT_COMPLEX, FFT_info)) Return (EXIT_FAILURE);
+	if (Ctrl->In.n_files > 1 && same_names (API, Ctrl)) Return (EXIT_FAILURE);	/* Would overwrite some results */
+	wisdom_load (API, Ctrl);
 
-	/* Time to write our data out */
-	if (GMT_Write_Data (API, GMT_IS_GRID, GMT_IS_FILE, GMT_IS_SURFACE, rw_mode, NULL, Ctrl->G.file, Grid)) {
-		Return (EXIT_FAILURE);
+	/* Filter the grids one by one, letting the OS read ahead the next one.  Scratch space and, with -W,
+	 * the FFTW plans carry over from one grid to the next */
+	n_grids = (Ctrl->In.n_files) ? Ctrl->In.n_files : 1;
+	for (k = 0; !error && k < n_grids; k++) {
+		Ctrl->In.file = (Ctrl->In.n_files) ? Ctrl->In.files[k] : NULL;
+		if (k + 1 < Ctrl->In.n_files) prefetch (Ctrl->In.files[k+1]);
+		out_name (Ctrl, Ctrl->In.file, file);
+		if (n_grids > 1) GMT_Report (API, GMT_MSG_VERBOSE, "Grid %u of %u: %s -> %s\n", k + 1, n_grids, Ctrl->In.file, file);
+		if (Ctrl->T.active)	/* Never hold the whole grid in memory */
+			error = tiled_filter (API, Ctrl, Ctrl->In.file, file);
+		else
+			error = filter_grid (API, Ctrl, Ctrl->In.file, file);
 	}
-
-	GMT_FFT_Destroy (API, &FFT_info);	/* Free the FFT machinery */
+	if (n_grids > 1 && !error) GMT_Message (API, GMT_TIME_CLOCK, "Filtered %u grids\n", n_grids);
+	wisdom_save (API, Ctrl);
 
 	/* Destroy options and let GMT garbage collection free memory used byt the API */
 
-	Return (GMT_NOERROR);
+	Return (error);
 }
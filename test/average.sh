@@ -0,0 +1,87 @@
+#!/bin/bash
+#	$Id$
+#
+# Test that gmtaverage computes the same medians and quantiles as blockmedian
+# when it does the binning itself, and check the histogram mode
+
+fail=0
+awk 'BEGIN {srand (7); for (i = 0; i < 20000; i++) printf "%.4f\t%.4f\t%d\t%d\n", 10*rand(), 10*rand(), int(40*rand()), 1+int(3*rand())}' > average_xyzw.txt
+
+compare () {	# compare <description> <file1> <file2>
+	if ! diff -q $2 $3 > /dev/null; then
+		echo "gmtaverage $1 differs from the reference"
+		fail=1
+	fi
+}
+
+for q in 0.5 0.25 0.9; do
+	gmt blockmedian average_xyzw.txt -R0/10/0/10 -I1 -T$q > average_ref.txt
+	gmt gmtaverage  average_xyzw.txt -R0/10/0/10 -I1 -T$q > average_new.txt
+	compare "-T$q" average_ref.txt average_new.txt
+	gmt blockmedian average_xyzw.txt -R0/10/0/10 -I1 -T$q -Q -Eb > average_ref.txt
+	gmt gmtaverage  average_xyzw.txt -R0/10/0/10 -I1 -T$q -Q -Eb -x > average_new.txt
+	compare "-T$q -Q -Eb" average_ref.txt average_new.txt
+done
+# Weights in tenths make the running weight land on the mark within rounding in many small blocks
+awk 'BEGIN {srand (5); for (i = 0; i < 20000; i++) printf "%.4f\t%.4f\t%.4f\t%.1f\n", 10*rand(), 10*rand(), 100*rand(), 0.1*(1+int(3*rand()))}' > average_ties.txt
+gmt blockmedian average_ties.txt -R0/10/0/10 -I0.2 -T0.5 -W -C > average_ref.txt
+gmt gmtaverage  average_ties.txt -R0/10/0/10 -I0.2 -T0.5 -W -C > average_new.txt
+compare "-T0.5 -W on ties" average_ref.txt average_new.txt
+
+# A single median with an increment that only the block modules understand is passed on to blockmedian
+gmt blockmedian average_xyzw.txt -R0/10/0/10 -I1+e -T0.5 > average_ref.txt
+gmt gmtaverage  average_xyzw.txt -R0/10/0/10 -I1+e -Te > average_new.txt
+compare "-Te -I1+e" average_ref.txt average_new.txt
+gmt blockmedian average_xyzw.txt -R0/10/0/10 -I2 -E -r > average_ref.txt
+gmt gmtaverage  average_xyzw.txt -R0/10/0/10 -I2 -Te -E -r > average_new.txt
+compare "-Te -E" average_ref.txt average_new.txt
+
+# Points within half a block outside a gridline-registered region are skipped, as by the block modules
+awk 'BEGIN {srand (3); for (i = 0; i < 5000; i++) printf "%.4f\t%.4f\t%d\n", -0.5+11*rand(), -0.5+11*rand(), int(40*rand())}' > average_edge.txt
+gmt blockmedian average_edge.txt -R0/10/0/10 -I1 -T0.5 > average_ref.txt
+gmt gmtaverage  average_edge.txt -R0/10/0/10 -I1 -T0.5 > average_new.txt
+compare "-T0.5 near the edges" average_ref.txt average_new.txt
+gmt blockmean average_edge.txt -R0/10/0/10 -I1 > average_ref.txt
+gmt gmtaverage average_edge.txt -R0/10/0/10 -I1 -Tm -x > average_new.txt
+compare "-Tm -x near the edges" average_ref.txt average_new.txt
+
+# Plain binary input is read directly and must give the same answers
+gmt convert average_xyzw.txt -bo4d > average_xyzw.b
+for T in m 0.5 o; do
+	gmt gmtaverage average_xyzw.txt -R0/10/0/10 -I1 -T$T -W > average_ref.txt
+	gmt gmtaverage average_xyzw.b   -R0/10/0/10 -I1 -T$T -W -bi4d > average_new.txt
+	compare "-T$T -bi4d" average_ref.txt average_new.txt
+done
+
+# A small -M budget spills the points to band files but must give the same output as in memory,
+# while a single -To, which blockmode does in memory, is refused
+for T in e,o o,0.9; do
+	gmt gmtaverage average_xyzw.txt -R0/10/0/10 -I1 -T$T > average_ref.txt
+	gmt gmtaverage average_xyzw.txt -R0/10/0/10 -I1 -T$T -M64k > average_new.txt
+	compare "-T$T -M64k" average_ref.txt average_new.txt
+done
+if gmt gmtaverage average_xyzw.txt -R0/10/0/10 -I1 -To -M64k > /dev/null 2>&1; then
+	echo "gmtaverage -To -M64k was accepted"
+	fail=1
+fi
+
+# The AVX2 and scalar kernels must bin every point into the same block, also on block
+# edges, outside the region, and for longitudes that must be wrapped into it
+awk 'BEGIN {srand (11); for (i = 0; i < 20000; i++) printf "%.1f\t%.1f\t%.3f\t%d\n", -400+800*rand(), -95+190*rand(), 100*rand(), 1+int(3*rand())}' > average_xyzw.txt
+for R in "-R-180/180/-90/90 -fg" "-R0/360/-90/90 -fg -r" "-R-30/60/-60/60 -fg" "-R-200/200/-90/90"; do
+	GMT_AVERAGE_SCALAR=1 gmt gmtaverage average_xyzw.txt $R -I7.5 -Tm,e,0.9 -W -x > average_ref.txt
+	gmt gmtaverage average_xyzw.txt $R -I7.5 -Tm,e,0.9 -W -x > average_new.txt
+	compare "$R kernel" average_ref.txt average_new.txt
+done
+
+# Histogram mode: 2 is the most common value, hence bin [2,3) or the bin centered on 2
+printf "0.5\t0.5\t1\n0.5\t0.5\t2\n0.5\t0.5\t2\n0.5\t0.5\t3\n" > average_xyzw.txt
+echo "0.5	0.5	2.5" > average_ref.txt
+gmt gmtaverage average_xyzw.txt -R0/1/0/1 -I1 -r -To -D1 -C > average_new.txt
+compare "-To -D1" average_ref.txt average_new.txt
+echo "0.5	0.5	2" > average_ref.txt
+gmt gmtaverage average_xyzw.txt -R0/1/0/1 -I1 -r -To -D1+c -C > average_new.txt
+compare "-To -D1+c" average_ref.txt average_new.txt
+
+rm -f average_xyzw.txt average_edge.txt average_ties.txt average_xyzw.b average_ref.txt average_new.txt
+exit $fail
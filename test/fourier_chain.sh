@@ -0,0 +1,41 @@
+#!/bin/bash
+#	$Id$
+#
+# Check the chain of spectral filters of grdfourier -S on a synthetic spike grid
+# made from -R -I: For both the full (-Ef) and the half (-H) spectrum the result
+# must not depend on the order of the filters or on the number of threads, and
+# -Sg must be refused.  Give the grid size as the argument [512].
+
+n=${1:-512}
+fail=0
+chain="-Sb-/200 -Sc400/300/50/40 -Su10"
+reverse="-Su10 -Sc400/300/50/40 -Sb-/200"
+
+run () {	# run <grid> <options>: filter the spike grid into <grid>
+	local grid=$1
+	shift
+	gmt grdfourier -R0/$n/0/$n -I1 -F25 $* -G$grid > /dev/null 2>&1 || { echo "grdfourier $*: failed"; fail=1; }
+}
+
+compare () {	# compare <what>: check that chain_new.nc matches chain_ref.nc to rounding
+	gmt grdmath chain_ref.nc chain_new.nc SUB ABS = chain_diff.nc
+	if ! gmt grdinfo -C chain_diff.nc | awk '{exit ($7 > 1e-6)}'; then
+		echo "grdfourier $engine $chain: $1 differs"
+		fail=1
+	fi
+}
+
+for engine in "-Ef" "-H"; do
+	run chain_ref.nc $engine $chain
+	run chain_new.nc $engine $reverse
+	compare "reversing the filters"
+	run chain_new.nc $engine $chain -x4
+	compare "-x4"
+done
+if gmt grdfourier -R0/$n/0/$n -I1 -Sg25 -Gchain_new.nc > /dev/null 2>&1; then
+	echo "grdfourier -Sg25 was accepted"
+	fail=1
+fi
+
+rm -f chain_ref.nc chain_new.nc chain_diff.nc
+exit $fail
@@ -0,0 +1,33 @@
+#!/bin/bash
+#	$Id$
+#
+# Check the shortcuts of grdfourier against the plain in-memory transform on a
+# grid of random values: The half-spectrum transform (-H) must match the full
+# complex transform of the unextended grid (-Nf+n+l), and filtering in strips
+# (-T) must match -H except within 1.5 filter widths of the top and bottom
+# edges.  Give the grid size as the argument [512].
+
+n=${1:-512}
+fail=0
+R=-R0/$((n-1))/0/$((n-1))
+
+compare () {	# compare <what> <grid1> <grid2>: check that the grids agree to single precision
+	gmt grdmath $2 $3 SUB ABS UPPER = strips_diff.nc
+	if ! gmt grdinfo -C strips_diff.nc | awk '{exit ($7 > 1e-5)}'; then
+		echo "grdfourier $1 differs from the in-memory transform"
+		fail=1
+	fi
+}
+
+gmt grdmath $R -I1 0 1 RAND = strips_in.nc
+gmt grdfourier strips_in.nc -F25 -Nf+n+l -Gstrips_full.nc > /dev/null 2>&1 || { echo "grdfourier: failed"; fail=1; }
+gmt grdfourier strips_in.nc -F25 -H -Gstrips_half.nc > /dev/null 2>&1 || { echo "grdfourier -H: failed"; fail=1; }
+gmt grdfourier strips_in.nc -F25 -T100 -Gstrips_tiled.nc > /dev/null 2>&1 || { echo "grdfourier -T100: failed"; fail=1; }
+compare "-H" strips_full.nc strips_half.nc
+# Strip borders every 100 rows; keep clear of the 1.5 * 25 rows where -H wraps around in y
+gmt grdcut strips_half.nc -R0/$((n-1))/38/$((n-39)) -Gstrips_ref.nc
+gmt grdcut strips_tiled.nc -R0/$((n-1))/38/$((n-39)) -Gstrips_new.nc
+compare "-T100" strips_ref.nc strips_new.nc
+
+rm -f strips_in.nc strips_full.nc strips_half.nc strips_tiled.nc strips_ref.nc strips_new.nc strips_diff.nc
+exit $fail
@@ -0,0 +1,37 @@
+#!/bin/bash
+#	$Id$
+#
+# Report how grdfourier speeds up with the number of threads (-x) when filtering
+# a synthetic spike grid made from -R -I, and check that the filtered grid does
+# not depend on the number of threads.  Only the filtering is threaded by -x; the
+# forward and inverse FFTs are done by GMT and are part of every timing, so the
+# speedup of a whole run stays well below the thread count.  Give the grid size as
+# the argument [4000].
+
+n=${1:-4000}
+fail=0
+TIMEFORMAT=%R
+
+run () {	# run <threads> <options>: time one run and leave the grid in fourier_x$1.nc
+	local t=$1
+	shift
+	{ time gmt grdfourier -R0/$n/0/$n -I1 -F25 $* -x$t -Gfourier_x$t.nc > /dev/null 2>&1; } 2>&1
+}
+
+for engine in "" "-H" "-Es"; do
+	echo "grdfourier ${engine:-(FFT)} on a $n x $n grid:"
+	t1=$(run 1 $engine)
+	gmt grd2xyz fourier_x1.nc > fourier_ref.txt
+	for t in 1 2 4 8 16; do
+		[ $t -gt 1 ] && tn=$(run $t $engine) || tn=$t1
+		echo "$t $t1 $tn" | awk '{printf "\t%2d threads: %8.3f s  speedup %5.2f\n", $1, $3, $2 / $3}'
+		gmt grd2xyz fourier_x$t.nc > fourier_new.txt
+		if ! diff -q fourier_ref.txt fourier_new.txt > /dev/null; then
+			echo "grdfourier $engine -x$t differs from -x1"
+			fail=1
+		fi
+	done
+done
+
+rm -f fourier_x*.nc fourier_ref.txt fourier_new.txt
+exit $fail
@@ -0,0 +1,24 @@
+#!/bin/bash
+#	$Id$
+#
+# Test the illumination gradient cache (-I) of the Mercator map maker: A map made
+# while filling the cache and one read from it must be identical, and both must match
+# the map whose intensities come from grdgradient and the normalization of the region.
+# Give the tile pyramid directory made with -A<dir>+b as the argument [relief_tiles].
+
+dir=${1:-relief_tiles}
+ps=mercmap_cache.ps
+fail=0
+
+rm -rf mercmap_cache
+gmt mercmap -R-30/10/0/30 -A$dir -P -W6i -S > mercmap_direct.ps
+gmt mercmap -R-30/10/0/30 -A$dir -Imercmap_cache -P -W6i -S > mercmap_cold.ps
+gmt mercmap -R-30/10/0/30 -A$dir -Imercmap_cache -P -W6i -S > $ps
+
+diff -q <(grep -v '^%%' mercmap_cold.ps) <(grep -v '^%%' $ps) > /dev/null || { echo "mercmap -I differs between filling and reading the cache"; fail=1; }
+# The cached gradients see the neighbouring tiles, so the map edges may differ slightly
+rms=$(compare -density 100 -metric RMSE $ps mercmap_direct.ps null: 2>&1 | sed -e 's/.*(\(.*\))/\1/')
+awk -v rms="$rms" 'BEGIN {exit !(rms ~ /^[0-9.eE+-]+$/ && rms + 0 < 0.01)}' || { echo "mercmap -I differs from grdgradient + grdimage: RMSE $rms"; fail=1; }
+
+rm -rf mercmap_cache mercmap_direct.ps mercmap_cold.ps
+exit $fail
@@ -0,0 +1,20 @@
+#!/bin/bash
+#	$Id$
+#
+# Test the fused renderer (-F) of the Mercator map maker against the grdgradient and grdimage path
+
+ps=mercmap_fused.ps
+fail=0
+
+gmt mercmap -R-30/10/0/30 -Crelief -P -W6i -S -F > $ps
+gmt mercmap -R-30/10/0/30 -Crelief -P -W6i -S > mercmap_default.ps
+gmt mercmap -R-30/10/0/30 -Crelief -P -W6i -S -F -x4 > mercmap_x4.ps
+
+# Colors are interpolated rather than heights when the image is projected, so allow small differences
+rms=$(compare -density 100 -metric RMSE $ps mercmap_default.ps null: 2>&1 | sed -e 's/.*(\(.*\))/\1/')
+awk -v rms="$rms" 'BEGIN {exit !(rms != "" && rms + 0 < 0.01)}' || { echo "mercmap -F differs from grdgradient + grdimage: RMSE $rms"; fail=1; }
+# The image must not depend on the number of threads
+diff -q <(grep -v '^%%' $ps) <(grep -v '^%%' mercmap_x4.ps) > /dev/null || { echo "mercmap -F -x4 differs from -x1"; fail=1; }
+
+rm -f mercmap_default.ps mercmap_x4.ps
+exit $fail
@@ -0,0 +1,59 @@
+#!/bin/bash
+#	$Id$
+#
+# Replay map requests against gmtmercmap in server mode (-Q) and report the p50 and
+# p99 latency of the round trips, first as the caches fill up and then again with
+# the caches warm.  Give a file of requests or their number [200], followed by any
+# other options for gmtmercmap, e.g. mercmap_server.sh 500 -Arelief_tiles -F -x
+
+arg=${1:-200}
+shift
+fail=0
+
+if [ -f "$arg" ]; then	# The server does not answer blank records or those starting with #
+	grep -v -e '^[[:space:]]*$' -e '^[[:space:]]*#' $arg > server_requests.txt
+else	# Random regions 2-40 degrees wide; about a third repeat an earlier request
+	awk -v n=$arg 'BEGIN {srand (3); for (i = 0; i < n; i++) {
+		if (i > 0 && rand () < 0.3)
+			r[i] = r[int (i * rand ())]
+		else {
+			w = -180 + 320 * rand (); s = -60 + 100 * rand (); d = 2 + 38 * rand ()
+			r[i] = sprintf ("%.2f/%.2f/%.2f/%.2f %s", w, w + d, s, s + d / 2, (rand () < 0.5) ? "10c" : "-")
+		}
+		print r[i]
+	}}' > server_requests.txt
+fi
+
+replay () {	# replay <pass>: send each request to the server and keep the round-trip times in server_<pass>.txt
+	local request reply bytes t0 t1
+	: > server_$1.txt
+	while read request; do
+		t0=$EPOCHREALTIME
+		echo "$request" >&${MAP[1]}
+		read -r reply <&${MAP[0]}
+		case "$reply" in
+			OK*)	bytes=${reply#OK }
+				head -c ${bytes%% *} <&${MAP[0]} > /dev/null ;;
+			*)	echo "gmtmercmap -Q: $request: ${reply:-no reply}"
+				fail=1 ;;
+		esac
+		t1=$EPOCHREALTIME
+		echo "$t0 $t1" | awk '{printf "%.6f\n", $2 - $1}' >> server_$1.txt
+	done < server_requests.txt
+}
+
+stats () {	# stats <pass>: report the p50 and p99 latency of server_<pass>.txt
+	sort -g server_$1.txt | awk -v pass=$1 'function rank (q) {k = int (q * NR); if (k < q * NR) k++; return (k < 1) ? 1 : k}
+		{t[NR] = $1} END {printf "%s: %d maps, p50 %.3f s, p99 %.3f s\n", pass, NR, t[rank(0.5)], t[rank(0.99)]}'
+}
+
+coproc MAP { gmt gmtmercmap -Q "$@"; }
+replay cold
+stats cold
+replay warm
+stats warm
+echo quit >&${MAP[1]}
+wait $MAP_PID || fail=1
+
+rm -f server_requests.txt server_cold.txt server_warm.txt
+exit $fail